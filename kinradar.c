@@ -3,17 +3,52 @@
  * (C)2011 Mike Bourgeous
  * Distributed with no warranty under GPLv2 or later.
  */
+#define _GNU_SOURCE // pthread_setaffinity_np()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KINRADAR_X86 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define KINRADAR_NEON 1
+#include <arm_neon.h>
+#endif
 
 #include <libfreenect/libfreenect.h>
+#include <libusb-1.0/libusb.h>
 
 
 #define INFO_OUT(...) {\
@@ -34,6 +69,86 @@
 // Get a depth pixel from an 11-bit buffer stored in uint16_t
 #define DPT(buf, x, y) (buf[(y) * FREENECT_FRAME_W + (x)])
 
+// Index into a grid's U bin table.  The overhead view walks image columns
+// within a row, so its table is depth-major to keep neighboring pixels of
+// similar depth in neighboring entries.  The side view uses one image row at
+// a time, so its table is row-major.
+#define UBIN(grid, coord, d) ((grid)->ubin[(grid)->ubin_major ?\
+		(coord) * (grid)->ndepth + (d) - (grid)->dlo :\
+		((d) - (grid)->dlo) * FREENECT_FRAME_W + (coord)])
+
+// Largest count stored in a grid cell.  Counts saturate here.  The cone
+// borders are kept in a separate overlay, so every value is a count.
+#define CELL_MAX 0xffff
+
+// Adds one to a cell count, saturating at CELL_MAX.
+#define CELL_INC(cell) ((cell) += (cell) < CELL_MAX)
+
+// Cache line size, used to align grid and histogram buffers
+#define CACHE_LINE 64
+
+// Index of cell (u, v) in a grid's gridpop buffer
+#define CELL(grid, u, v) ((u) * (grid)->ustride + (v) * (grid)->vstride)
+
+// Active pixels x0 through x1 - 1 of an image row (--mask, --learn-mask,
+// --stride)
+struct pixel_span {
+	uint16_t x0;
+	uint16_t x1;
+};
+
+// Direction a pixel sees, from --calibration: world X and Y divided by
+// distance, positive to the left and up like xworld() and yworld()
+struct pixel_ray {
+	float x;
+	float y;
+};
+
+// Bounds of image row y's active pixel spans, see compile_spans()
+#define SPAN_FIRST(data, y) (&(data)->spans[(data)->row_spans[y]])
+#define SPAN_END(data, y) (&(data)->spans[(data)->row_spans[(y) + 1]])
+
+// Raw depth a pixel may wander while learning the mask and still be masked
+// out as static background (--learn-mask)
+#define MASK_LEARN_SLOP 8
+
+// Largest --stride
+#define MAX_STRIDE 8
+
+// Stored in place of background pixels (--background).  The fill kernels bin
+// it nowhere and don't count it as out of range, as its low 11 bits are 2047
+// but it isn't 2047.
+#define DEPTH_IGNORED 0xffff
+
+// Background model (--background).  The model holds raw depth in fixed point
+// with BG_FRAC fraction bits, and moves 1 / 2^BG_ADAPT_SHIFT of the way to
+// each new reading, so objects that stop moving fade into the background.
+#define BG_FRAC 5
+#define BG_ADAPT_SHIFT 8
+#define BG_UNKNOWN 0xffff // Never seen, farther than any raw depth
+#define BG_THRESHOLD 10 // Default raw depth change that makes a pixel foreground
+
+// Maximum number of extra row bands (--band)
+#define MAX_BANDS 4
+
+// Products of binning a frame, kept in kinradar_data's wanted.  Each consumer
+// asks for the products it uses with want_products() before binning starts,
+// and the binning stages for anything nobody wants are skipped.
+#define WANT_XGRID 0x1 // Overhead view
+#define WANT_YGRID 0x2 // Side view
+#define WANT_BANDS 0x4 // Row bands and height slices
+#define WANT_BORDERS 0x8 // Cone border overlays of the other wanted grids
+#define WANT_RECORD (WANT_XGRID | WANT_YGRID | WANT_BANDS) // Grids in a grid_record
+
+// Bits of kinradar_data's row_mask, saying which grids an image row is
+// binned into.  Only the grids in data->wanted get bits.
+#define ROW_MAIN 0x1 // Inside ytop..ybot, where out of range samples are counted
+#define ROW_XGRID 0x2 // Inside ytop..ybot, binned into xgrid
+#define ROW_YGRID 0x4 // Inside ytop..ybot, binned into ygrid
+#define ROW_VOXELS 0x8 // Inside ytop..ybot, binned into the voxels for height slices
+#define ROW_BAND(b) (0x10 << (b)) // Inside band b, binned into its overhead grid
+#define ROW_BANDS (ROW_BAND(MAX_BANDS) - ROW_BAND(0))
+
 struct grid_info {
 	int udiv; // X or Y axis divisions
 	int vdiv; // Z axis divisions
@@ -41,11 +156,559 @@ struct grid_info {
 	float zmin; // Near clipping plane (millimeters)
 	float zmax; // Far clipping plane
 	float wmax; // Max X or Y coordinate visible on the grid
+	float edge_lo; // Cone edges at zmax as fractions of wmax: -1 and 1, unless
+	float edge_hi; // a --calibration is off-center
 
-	int *gridpop_buffer;
-	int **gridpop;
+	// Cell counts, in a flat cache-aligned buffer laid out in the order the
+	// view is displayed: [v][u] normally, [u][v] if transposed.  Both
+	// filling and drawing then walk it sequentially.
+	uint16_t *gridpop;
+	uint8_t *overlay; // Cell class forced on each cell or OVERLAY_COUNT, same layout, or NULL
+	int ustride; // Distance between cells (u, v) and (u + 1, v)
+	int vstride; // Distance between cells (u, v) and (u, v + 1)
 	int popmax;
-	int bufsize;
+	int bufsize; // Bytes in gridpop and each histogram, a multiple of CACHE_LINE
+
+	// Persistence (-e).  gridpop shows each cell's decayed history instead of
+	// the frame's raw count.
+	uint32_t *history; // Decayed counts in 16.16 fixed point, NULL if not decaying
+	unsigned int keep; // Fraction of history kept each frame, 0.16 fixed point
+	int *active; // Cells with nonzero history, for sparse kernels
+	int nactive;
+
+	// Binning lookup tables, built by init_grid_lut() from the values above
+	int16_t zbin[2048]; // Raw depth to V bin, or -1 if outside zmin..zmax
+	uint16_t *ubin; // (Image coordinate, raw depth) to U bin
+	int ubin_major; // Nonzero if ubin is indexed [coord][depth], else [depth][coord]
+	int dlo; // Lowest raw depth with a valid V bin
+	int ndepth; // Number of raw depths covered by ubin, starting at dlo
+	float wscale[2048]; // Raw depth to U bins per unit of ray, see ray_bin()
+};
+
+// Number of sub-histograms used by the vectorized fill kernels.  Lane n of a
+// kernel increments sub-histogram n % NSUBHIST so that back-to-back
+// increments of the same cell don't stall on each other.  Must be a power of
+// two.
+#define NSUBHIST 4
+
+// Voxels along each edge of a brick of the voxel map, as a power of two
+#define BRICK_SHIFT 3
+#define BRICK_SIZE (1 << BRICK_SHIFT)
+#define BRICK_VOXELS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
+// Index of voxel (u, h, v) within its brick
+#define BRICK_VOXEL(u, h, v) ((((h) & (BRICK_SIZE - 1)) << (2 * BRICK_SHIFT)) |\
+		(((v) & (BRICK_SIZE - 1)) << BRICK_SHIFT) | ((u) & (BRICK_SIZE - 1)))
+
+// 3D occupancy counts for height slices (--slice).  U and V are the overhead
+// view's bins, and H (height) is the side view's U bin.  Space is split into
+// bricks of BRICK_SIZE^3 voxels, and a brick's cells are only in use while
+// something is in it, so the work of clearing, merging, and slicing follows
+// occupied space rather than the size of the room.  A brick for every
+// position is allocated up front in one pool, so binning never allocates.
+struct voxel_map {
+	int bu, bh, bv; // Bricks along each axis
+	int32_t *dir; // Index in bricks of the brick at each position, or -1
+	int *keys; // Position ((h * bv + v) * bu + u) of each brick in use
+	uint16_t **bricks; // nused bricks in use, then nfree cleared spares
+	uint16_t *pool; // Every brick's voxels
+	int nused;
+	int nfree;
+};
+
+// Histograms and counters written by a fill kernel.  For the first binning
+// worker, xpop[0] and ypop[0] are the grids' own buffers.  Everything else is
+// private to a worker and merged into the grids by merge_grid().
+struct bin_scratch {
+	uint16_t *xpop[NSUBHIST];
+	uint16_t *ypop[NSUBHIST];
+	int nsub; // Number of sub-histograms in use
+	int oor; // Out of range sample count
+
+	// Histograms of each row band's overhead grid, one per band.  Bands
+	// are never sparse and don't use sub-histograms.
+	uint16_t *bpop[MAX_BANDS];
+
+	// Voxels of the samples in ROW_VOXELS rows, or NULL without height slices
+	struct voxel_map *voxels;
+
+	// Indices of the nonzero cells of xpop[0] and ypop[0], only kept by
+	// sparse kernels
+	int *xtouched;
+	int *ytouched;
+	int nxtouched;
+	int nytouched;
+};
+
+struct kinradar_data;
+typedef void (*fill_func)(const struct kinradar_data *data, const uint16_t *buf,
+		int y0, int y1, struct bin_scratch *s);
+
+struct fill_kernel {
+	const char *name;
+	fill_func fill;
+	int nsub; // Number of sub-histograms the kernel writes
+	int (*supported)(void); // NULL if always supported
+	int sparse; // Nonzero if the kernel keeps touched cell lists
+	int (*reduce)(const uint16_t *a, const uint16_t *b, uint16_t *out, int n); // See reduce_scalar()
+};
+
+// Maximum number of binning threads (-j)
+#define MAX_WORKERS 64
+
+// A binning thread.  Worker 0 runs on the thread that calls fill_grids().
+// Each frame, every worker bins its share of the active rows into its own
+// histograms, then merges a share of every worker's histograms into the grids.
+struct bin_worker {
+	struct kinradar_data *data;
+	pthread_t thread;
+	int index;
+
+	struct bin_scratch scratch;
+	int64_t clear_ns; // Time spent clearing histograms for the current frame
+	int xpopmax; // Largest merged cell in this worker's share of xgrid
+	int ypopmax; // Largest merged cell in this worker's share of ygrid
+	int bpopmax[MAX_BANDS]; // Largest merged cell in its share of each band
+};
+
+// Most objects tracked in one frame (--track)
+#define MAX_BLOBS 64
+
+// Connected components with fewer occupied cells are noise, not objects
+#define BLOB_MIN_CELLS 2
+
+// Weight of each frame's velocity in a blob's smoothed velocity
+#define BLOB_SMOOTHING 0.3f
+
+// An object tracked in the overhead view (--track), as written to headless
+// blob records
+struct blob {
+	uint32_t id; // Kept from frame to frame while the object overlaps itself
+	uint32_t age; // Frames since the object was first seen, from 0
+	uint32_t cells; // Occupied cells
+	uint32_t count; // Samples in those cells
+	float x; // Count-weighted centroid in meters, positive X to the left
+	float z;
+	float vx; // Smoothed velocity in meters per second
+	float vz;
+	uint16_t umin; // Bounding box in overhead cells, inclusive
+	uint16_t umax;
+	uint16_t vmin;
+	uint16_t vmax;
+};
+
+// Running totals of one connected component of occupied cells, see
+// track_blobs()
+struct blob_comp {
+	uint32_t cells;
+	uint32_t count;
+	uint64_t usum; // Count-weighted sums of cell coordinates
+	uint64_t vsum;
+	uint16_t umin, umax, vmin, vmax;
+	uint32_t votes; // Majority vote of the cells' slots in the last frame
+	uint8_t vote; // Last frame's slot + 1 winning the vote, 0 while there is none
+	int slot; // Index in the frame's blobs, or -1 if untracked
+};
+
+// Information about a binned frame shown in the status lines
+struct frame_info {
+	int64_t time_ns; // CLOCK_REALTIME when the frame was binned
+	int64_t in_ns; // now_ns() when the frame arrived from libfreenect
+	uint32_t timestamp;
+	unsigned int frame;
+	int oor_total; // Out of range count
+	int ytop;
+	int ybot;
+	int disp_mode; // kinradar_data's disp_mode when the frame was binned
+	unsigned int config; // Reconfigurations applied before the frame was binned
+	int level; // kinradar_data's level when the frame was binned
+	int nblobs; // Objects tracked in the overhead view (--track)
+	struct blob blobs[MAX_BLOBS];
+};
+
+// A copy of a binned frame, passed from the binning thread to the render
+// thread when the capture pipeline is enabled.  The grids share geometry and
+// tables with the binning grids but have their own gridpop buffers.
+struct radar_frame {
+	struct frame_info info;
+	struct grid_info xgrid;
+	struct grid_info ygrid;
+	struct grid_info bands[MAX_BANDS];
+};
+
+// Coarsest level of the grid pyramid (-l and --serve ADDRESS@LEVEL)
+#define MAX_LEVELS 4
+
+// A level of the grid pyramid, see build_pyramid().  Each cell is the sum of
+// a 2x2 block of cells a level below, so every level halves the divisions,
+// rounding up.  The clipping planes and wmax are the binned grids'.
+struct grid_level {
+	struct grid_info xgrid;
+	struct grid_info ygrid;
+	struct grid_info bands[MAX_BANDS];
+};
+
+// Single-producer single-consumer ring of frame pointers.  The head is only
+// written by the producer, the tail only by the consumer.
+#define RING_SIZE 4 // Must be a power of two
+struct frame_ring {
+	atomic_uint head;
+	atomic_uint tail;
+	void *slots[RING_SIZE];
+};
+
+// A depth buffer owned by the capture pipeline
+struct depth_frame {
+	uint16_t *buf;
+	uint32_t timestamp;
+	int64_t in_ns; // now_ns() when the frame arrived from libfreenect
+};
+
+// Enough depth buffers for a full capture ring plus the one libfreenect is
+// filling.  The free ring holds the rest, so neither ring can overflow.
+#define DEPTH_FRAMES RING_SIZE
+
+// Set in radar_frame indices passed through view_latest when the frame has
+// not been displayed yet
+#define VIEW_FRESH 4
+
+// Headless output record header (-o).  Each frame is written as this
+// header followed by xgrid's cells, ygrid's cells, and then the cells of each
+// row band's overhead grid, each as int32_t in [v][u] order, in host byte
+// order.  All records in a stream have the same record_size, so a reader can
+// mmap() a recorded file and find frame n at n * record_size.  With --track
+// a blob_record follows each grid_record, which record_size doesn't count, so
+// frames are record_size + sizeof(struct blob_record) apart.
+#define GRID_MAGIC "KRGR"
+#define GRID_VERSION 1
+#define GRID_VERSION_BANDS 2
+#define BAND_SLICE 0x1 // A height slice of the voxels rather than image rows
+struct grid_record {
+	char magic[4]; // GRID_MAGIC
+	uint16_t version; // GRID_VERSION
+	uint16_t header_size; // Bytes before the cells, see record_header_size()
+	uint32_t record_size; // Header plus cells, in bytes
+	uint32_t frame;
+	int64_t time_ns; // CLOCK_REALTIME nanoseconds when the frame was binned
+	uint32_t timestamp; // libfreenect timestamp
+	uint32_t oor_total; // Out of range samples, scaled up to the whole frame with --stride
+	int32_t xudiv, xvdiv, xpopmax; // Overhead view
+	int32_t yudiv, yvdiv, ypopmax; // Side view
+	uint32_t device; // Kinect index, or the number of Kinects for a fused grid
+	uint32_t flags; // DELTA_* for delta-encoded records, otherwise 0
+
+	// Version 2 only, which is written when there are row bands (--band) or
+	// height slices (--slice).  Version 1 headers end here.
+	uint32_t nbands;
+	uint32_t reserved;
+	struct {
+		int32_t top; // First image row, or lowest height in mm (BAND_SLICE)
+		int32_t bottom; // Image row after the last, or highest height in mm
+		int32_t popmax;
+		uint32_t flags; // BAND_*
+	} bands[MAX_BANDS];
+};
+
+// Tracked objects of a headless frame (--track), written right after the
+// frame's grid_record.  The record always holds MAX_BLOBS blobs so every
+// frame's records are the same size; only the first nblobs are valid.
+#define BLOB_MAGIC "KRBL"
+#define BLOB_VERSION 1
+struct blob_record {
+	char magic[4]; // BLOB_MAGIC
+	uint16_t version; // BLOB_VERSION
+	uint16_t header_size; // Bytes before the blobs
+	uint32_t record_size; // Header plus MAX_BLOBS blobs, in bytes
+	uint32_t frame; // Same as the grid_record's
+	uint32_t nblobs;
+	uint32_t reserved;
+	struct blob blobs[MAX_BLOBS];
+};
+
+// Delta-encoded grid record sent to --serve subscribers.  The header is a
+// grid_record with DELTA_MAGIC, followed by runs that update the subscriber's
+// copy of the cells, which are in the same order as in a headless record.  Each run
+// is a uint16_t count of unchanged cells to skip, a uint16_t count of new
+// values, and that many uint16_t cell values.  Cells after the last run are
+// unchanged.  A DELTA_KEY record applies to all-zero grids, so it can be
+// decoded on its own.
+#define DELTA_MAGIC "KRGD"
+#define DELTA_KEY 0x1
+
+// Grid history file (--record-grids and --replay-grids): a
+// grid_history_header, then every frame's grids as a delta-encoded record
+// (see DELTA_MAGIC) against the frame before it, with a DELTA_KEY keyframe
+// every key_interval frames.  When recording stops, a history_key for each
+// keyframe and then a history_tail are appended, so that replay can seek
+// without reading the whole file.  A file without a tail was cut short, and
+// its keyframes are found by walking the records instead.
+#define HISTORY_MAGIC "KRGH"
+#define HISTORY_VERSION 1
+#define HISTORY_INDEX_MAGIC "KRGI"
+#define HISTORY_KEY_INTERVAL 300 // 10 seconds at 30 frames per second
+struct grid_history_header {
+	char magic[4]; // HISTORY_MAGIC
+	uint16_t version; // HISTORY_VERSION
+	uint16_t header_size; // Bytes before the first record
+	float zmin; // Depth range of the grids, in meters
+	float zmax;
+	float xwmax; // wmax of the overhead and side views
+	float ywmax;
+	uint32_t key_interval; // Frames from one keyframe to the next
+	uint32_t reserved;
+};
+
+struct history_key {
+	int64_t time_ns; // time_ns of the keyframe
+	uint64_t offset; // File offset of the keyframe's record
+	uint32_t frame;
+	uint32_t reserved;
+};
+
+struct history_tail {
+	char magic[4]; // HISTORY_INDEX_MAGIC
+	uint32_t nkeys; // history_keys right before the tail
+	uint64_t reserved;
+};
+
+// Raw depth capture file (--record and --replay): a depth_file_header, then
+// one depth_file_frame header and FREENECT_FRAME_PIX uint16_t depth values
+// per frame.  Frames are frame_size bytes apart, so a truncated final frame
+// is ignored on replay.
+#define DEPTH_MAGIC "KRDP"
+#define DEPTH_VERSION 1
+struct depth_file_header {
+	char magic[4]; // DEPTH_MAGIC
+	uint16_t version; // DEPTH_VERSION
+	uint16_t header_size; // sizeof(struct depth_file_header)
+	uint16_t width;
+	uint16_t height;
+	uint32_t frame_size; // Frame header plus depth values, in bytes
+};
+
+struct depth_file_frame {
+	int64_t time_ns; // CLOCK_MONOTONIC nanoseconds when captured
+	uint32_t timestamp; // libfreenect timestamp
+	uint32_t reserved;
+};
+
+// Stages timed for every frame, see record_stage()
+enum {
+	STAGE_QUEUE, // Depth callback to the start of binning
+	STAGE_CLEAR, // Clearing the grids and histograms
+	STAGE_FILL, // Fill kernel and merge
+	STAGE_TRACK, // Finding objects (--track)
+	STAGE_RENDER, // Formatting a frame for output
+	STAGE_FLUSH, // Writing a formatted frame
+	STAGE_TOTAL, // Depth callback to the end of the write
+	NSTAGES
+};
+
+static const char *const stage_names[NSTAGES] = {
+	"queue", "clear", "fill", "track", "render", "flush", "total",
+};
+
+// Number of recent samples kept for each stage's percentiles.  Must be a
+// power of two.
+#define STAT_SAMPLES 256
+
+// Recent timings of one stage.  Each stage is only recorded by one thread,
+// but may be read from any thread.
+struct stage_stats {
+	atomic_uint count; // Samples recorded so far
+	atomic_uint ns[STAT_SAMPLES]; // Most recent samples, in nanoseconds
+};
+
+// libfreenect timestamp ticks per depth frame (60MHz at 30fps), used to
+// count frames lost before they reached kinradar
+#define FRAME_TICKS 2000000
+
+// Maximum number of Kinects (-n)
+#define MAX_KINECTS 8
+
+// Placement of a Kinect in the fused overhead grid (--pose).  A point at
+// (x, z) relative to the Kinect is at (pose.x + x * cos(yaw) + z * sin(yaw),
+// pose.z - x * sin(yaw) + z * cos(yaw)) in the fused grid.
+struct pose {
+	float x; // Meters
+	float z; // Meters
+	float yaw; // Radians, positive turns the Kinect from +Z toward +X
+};
+
+// Network subscribers (--serve), see serve_thread()
+#define MAX_SERVE 8 // Addresses to serve on
+#define SERVE_KEY_INTERVAL 30 // Frames between UDP keyframes
+
+// The records of one pyramid level, shared by everyone served that level
+struct serve_stream {
+	int level;
+	size_t ncells; // Cells of every grid in a record
+
+	// Protected by the server's lock
+	uint16_t *next; // Newest binned cells, in record order
+	struct grid_record next_hdr;
+
+	// Owned by the server thread
+	uint16_t *cur; // Cells being sent
+	uint16_t *prev; // Cells last sent, the base of each delta
+	uint16_t *zero; // Base of keyframes
+	char *key; // Encoded keyframe of cur, if key_len is nonzero
+	char *delta; // Encoded delta of cur against prev
+	size_t key_len;
+	size_t delta_len;
+};
+
+// A TCP or Unix socket subscriber
+struct serve_client {
+	struct serve_client *next;
+	struct serve_stream *stream;
+	int fd;
+	int need_key; // Send a keyframe next, set on joining or missing a frame
+	char *buf; // Unsent end of the last record
+	size_t size;
+	size_t len;
+	size_t off;
+};
+
+// A UDP destination.  Records are sent whether or not anyone is listening.
+struct serve_udp {
+	struct serve_stream *stream;
+	int fd; // Connected to the destination
+	int need_key;
+	unsigned int since_key; // Frames since the last keyframe
+	int warned; // Set after reporting a record too large for a datagram
+};
+
+struct server {
+	int epfd;
+	int event_fd; // Counts frames posted by serve_frame()
+	int listen_fds[MAX_SERVE];
+	struct serve_stream *listen_streams[MAX_SERVE]; // Level served to each socket's subscribers
+	int nlisten;
+	char *unix_paths[MAX_SERVE]; // Unix socket files to remove on exit
+	int npaths;
+	struct serve_udp udp[MAX_SERVE];
+	int nudp;
+	struct serve_client *clients;
+	pthread_t thread;
+	int started;
+	atomic_int quit;
+
+	struct serve_stream streams[MAX_SERVE]; // One for each level served
+	int nstreams;
+	pthread_mutex_t lock; // Protects the streams' next and next_hdr, and have_next
+	int have_next;
+	int have_prev; // Owned by the server thread
+};
+
+// Background writer of a grid history (--record-grids).  The binning thread
+// leaves each frame's cells in next, and the history thread encodes and
+// writes them, so a slow disk never holds up binning.
+struct grid_history {
+	const char *path;
+	int fd;
+	pthread_t thread;
+	int started;
+
+	size_t ncells; // Cells of every grid in a record
+	pthread_mutex_t lock; // Protects next, next_hdr, have_next, and quit
+	pthread_cond_t cond; // Broadcast when have_next or quit changes
+	uint16_t *next; // Newest binned cells, in record order
+	struct grid_record next_hdr;
+	int have_next;
+	int quit;
+	int wait; // Wait for the history thread instead of dropping frames (--replay)
+	unsigned int dropped; // Frames replaced before the history thread took them
+
+	// Owned by the history thread
+	uint16_t *cur; // Cells being written
+	uint16_t *prev; // Cells last written, the base of each delta
+	uint16_t *zero; // Base of keyframes
+	char *rec; // Encoded record of cur
+	unsigned int since_key; // Frames written since the last keyframe
+	unsigned int written;
+	uint64_t offset; // Bytes written to the file
+	struct history_key *keys;
+	size_t nkeys;
+	size_t keys_size;
+	int failed; // Set after a write error stops the recording
+};
+
+// Settings that can be changed while running (--control), in the same units
+// as their command line options
+struct control_params {
+	int xudiv; // -g
+	int xvdiv; // -G
+	int yudiv; // -G, the side view's height
+	int yvdiv; // -g, the side view's depth divisions
+	int ytop; // -y
+	int ybot; // -Y
+	float zmin; // -z
+	float zmax; // -Z
+	int disp_mode; // -h, -v, or neither
+	int level; // -l
+};
+
+// A reconfiguration, built by the control thread and swapped in by the
+// binning thread between frames, see apply_config().  grids holds the new
+// grids and everything sized by them, and after the swap the old ones.
+struct grid_config {
+	struct kinradar_data *grids; // Only the grid settings and buffers are used
+	struct control_params params;
+};
+
+// Line-based command channel (--control), read by its own thread
+#define CONTROL_LINE 256 // Longest command line
+#define CONTROL_MAX_DIVS 1024 // Most grid divisions a command may ask for
+struct control {
+	int listen_fd; // Unix socket accepting a client, or -1 when reading stdin
+	int fd; // Client or stdin, or -1 while waiting for a client
+	int quit_fd; // eventfd written by stop_control()
+	char *unix_path; // Socket file to remove on exit
+	pthread_t thread;
+	int started;
+	struct control_params params; // Settings after the last command
+	char line[CONTROL_LINE];
+	size_t len;
+};
+
+// Number of distinct cell characters/styles, see print_cell()
+#define NCLASSES 8
+
+// Cell classes of the cone borders, after the count classes 0 through 5
+#define CLASS_BORDER_LEFT 6
+#define CLASS_BORDER_RIGHT 7
+
+// Overlay entry of a cell drawn from its count, see init_overlay()
+#define OVERLAY_COUNT 0xff
+
+// Terminal style after reset_color(), used as a row of style_esc
+#define STYLE_RESET NCLASSES
+
+// Terminal state is unknown, so every attribute must be sent
+#define STYLE_UNKNOWN (NCLASSES + 1)
+
+// Frame-sized arena for terminal output.  Each frame is formatted into buf
+// and sent with a single write() by write_output().
+struct out_buf {
+	int fd; // Where output is written, normally stdout
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t last_len; // Bytes written for the previous frame
+	int64_t write_ns; // Time spent in write() for the previous frame
+	unsigned long backlog_req; // ioctl() for stdout's queued bytes, 0 if none
+	int style; // Cell class whose style the terminal is in, or STYLE_*
+
+	// Differential rendering (-d)
+	int refresh_interval; // Frames between full redraws, 0 to always redraw
+	unsigned int refresh_count; // Frames since the last full redraw
+	int refresh; // Set while rendering a full redraw
+	uint8_t *shadow[2 + MAX_BANDS]; // Last rendered cell classes of each view, then each band
+
+	// Grids the arena is sized for, see output_frame()
+	unsigned int config; // frame_info's config
+	int clear; // Set to clear the screen before the next frame
 };
 
 struct kinradar_data {
@@ -57,19 +720,263 @@ struct kinradar_data {
 		SHOW_VERT,
 	} disp_mode;
 
-	unsigned int out_of_range:1; // Whether to flash the LED
+	atomic_int out_of_range; // Whether to flash the LED (set by the binning thread)
+	int led_fd; // eventfd written when out_of_range changes, or -1, see run_kinect()
 	unsigned int done:1; // Set to 1 to break the main loop
 
 	struct grid_info xgrid; // Overhead view
 	struct grid_info ygrid; // Side view
 	int ytop; // Top image Y coordinate to consider
 	int ybot; // Bottom image Y coordinate to consider
+	int wanted; // WANT_* products used by any consumer, see want_products()
+
+	// Grid pyramid (-l and --serve ADDRESS@LEVEL).  levels[l - 1] holds
+	// level l, reduced from the grids above after every frame; level 0 is
+	// the binned grids themselves.
+	int level; // Level displayed or written with -o
+	int nlevels; // Coarsest level built, see want_level()
+	struct grid_level levels[MAX_LEVELS];
+
+	// Extra row bands (--band), each binned into its own overhead grid in
+	// the same pass over the frame as the main grids.  The band grids share
+	// xgrid's geometry and lookup tables.
+	int nbands;
+	int band_top[MAX_BANDS]; // First row, or lowest height in mm for a slice
+	int band_bot[MAX_BANDS]; // Row after the last, or highest height in mm
+	int band_slice[MAX_BANDS]; // Nonzero if the band is a height slice of the voxels
+	int nslices;
+	struct grid_info bands[MAX_BANDS];
+	uint16_t **bmerge[MAX_BANDS]; // Every worker's histogram of each band
+	uint8_t row_mask[FREENECT_FRAME_H]; // ROW_* bits of each image row
+	int scan_top; // First row with any ROW_* bits
+	int scan_bot; // Row after the last with any ROW_* bits
+
+	// Pixel mask (--mask, --learn-mask) and decimation (--stride), compiled
+	// into runs of active pixels for each row.  The fill kernels only visit
+	// the runs.  With --interleave, each frame samples the next of nphases
+	// offsets of the stride, each with its own row index.
+	uint8_t *pixel_mask; // Nonzero for active pixels, or NULL for all active
+	struct pixel_span *spans;
+	int *span_index; // nphases tables of each row's first run, plus the end
+	const int *row_spans; // span_index table of the phase being binned
+	int stride; // Bin every stride-th row and column
+	int interleave; // Nonzero to move to the next phase every frame
+	int nphases;
+	int phase;
+	int learn_frames; // Frames left to learn the mask from, 0 if not learning
+	uint16_t *learn_min; // Lowest raw depth of each pixel while learning
+	uint16_t *learn_max; // Highest raw depth of each pixel while learning
+	const char *mask_save; // Where to write the learned mask, or NULL
+
+	// Background subtraction (--background).  Both buffers are one
+	// cache-aligned allocation, and are walked together a row at a time.
+	uint16_t *bg_model; // Background depth of each pixel, or NULL if not subtracting
+	uint16_t *fg_frame; // Depth frame with background pixels set to DEPTH_IGNORED
+	int bg_learn; // Frames left to learn the model from before subtracting
+	int bg_learned; // Frames the model has been learned from
+	uint16_t bg_threshold; // Foreground depth change, with BG_FRAC fraction bits
+
+	// Calibrated projection (--calibration), binned by fill_rays()
+	struct pixel_ray *rays; // Each pixel's ray, or NULL for the ideal 70 degree camera
+	float ray_xmax; // Largest ray X and Y either way, which set the grids'
+	float ray_ymax; // extent like the ideal camera's edges
+	float ray_xlo, ray_xhi; // Ray X of the rightmost and leftmost pixels, and
+	float ray_ylo, ray_yhi; // ray Y of the lowest and highest, for the borders
+
+	// Object tracking (--track), see track_blobs().  Labels and slots are
+	// per xgrid cell; slots carry each blob from one frame to the next.
+	int track_min; // Samples for an occupied cell, or 0 if not tracking
+	uint32_t *blob_label; // Union-find label of each cell, 0 if empty
+	uint32_t *blob_parent; // Each label's parent, then its component
+	struct blob_comp *blob_comps;
+	uint8_t *blob_slot; // Each cell's blob in the last frame + 1, 0 for none
+	uint32_t blob_next_id;
+	uint32_t blob_timestamp; // Timestamp of the last tracked frame
+
+	const struct fill_kernel *kernel; // Selected by find_kernel()
+	float decay; // Fraction of each cell's history kept per frame, 0 for none (-e)
+
+	// Binning thread pool, see fill_grids()
+	int nworkers;
+	struct bin_worker *workers;
+	uint16_t **xmerge; // Every worker's xgrid histograms, xmerge[0] is xgrid's
+	uint16_t **ymerge; // Every worker's ygrid histograms
+	int nmerge;
+	pthread_mutex_t pool_lock;
+	pthread_cond_t pool_cond; // Signaled when pool_gen changes
+	pthread_barrier_t pool_barrier; // Separates the fill and merge steps
+	unsigned int pool_gen; // Incremented for each frame given to the pool
+	int pool_quit; // Set to make the pool threads exit
+	const uint16_t *pool_buf; // Frame being binned
+
+	// Capture pipeline (-p).  depth() swaps filled depth buffers into
+	// capture_ring, bin_thread() bins them and publishes a copy of the grids
+	// through a triple buffer of views, and render_thread() displays the
+	// newest view.  libfreenect fills the buffers in place, so frames are
+	// never copied.
+	int pipeline;
+	struct depth_frame frames[DEPTH_FRAMES];
+	void *depth_pool; // Locked mapping holding every frame's buffer, see alloc_depth_pool()
+	size_t depth_pool_size;
+	struct depth_frame *capture_frame; // Frame libfreenect is filling
+	struct frame_ring capture_ring; // Filled frames, capture to binning
+	struct frame_ring free_ring; // Binned frames, binning to capture
+	sem_t capture_sem; // Posted for each frame put in capture_ring
+	struct radar_frame views[3];
+	atomic_int view_latest; // Most recently published view, maybe | VIEW_FRESH
+	int view_back; // View being filled by the binning thread
+	int view_front; // View being displayed by the render thread
+	sem_t view_sem; // Posted for each published view
+	pthread_t bin_thread;
+	pthread_t render_thread;
+	int pipe_started; // Set once the pipeline threads are running
+	atomic_int pipe_quit; // 1 stops the binning thread, 2 the render thread
+	atomic_uint dropped; // Frames dropped because binning fell behind
+
+	struct frame_info info; // Most recently binned frame
+
+	struct out_buf out; // Owned by whichever thread renders
+
+	int headless; // Write grid_records to out.fd instead of drawing (-o)
+	struct server *server; // Publishes binned grids to subscribers, or NULL (--serve)
+	struct grid_history *history; // Writes binned grids to a file, or NULL (--record-grids)
+
+	// Runtime reconfiguration (--control).  The control thread builds a
+	// grid_config and leaves it in config_next, and the binning thread
+	// swaps it in before the next frame and leaves it in config_done for
+	// the control thread to free.
+	struct control *control; // Reads commands, or NULL
+	_Atomic(struct grid_config *) config_next; // Newest unapplied reconfiguration
+	_Atomic(struct grid_config *) config_done; // Applied, holding the old grids
+	unsigned int config; // Reconfigurations applied so far
+	int record_fd; // Raw depth frames are appended here if >= 0 (--record)
+
+	// Render pacing (-r and -a), see render_due()
+	int render_rate; // Maximum frames rendered per second, 0 for no limit
+	int adaptive; // Skip frames while the terminal is behind
+	int64_t next_render; // Earliest time for the next render
+	unsigned int rendered; // Number of frames rendered
+	int render_fd; // timerfd for a frame held back by -r without -p, or -1
+	int render_pending; // Set while the last frame binned without -p hasn't been output
+
+	// Latency statistics, see record_stage()
+	struct stage_stats stages[NSTAGES];
+	atomic_uint lost; // Frames missing from the libfreenect timestamps
+	uint32_t last_timestamp; // Timestamp of the previous frame from libfreenect
+	int have_timestamp; // Set once last_timestamp is valid
+	int show_stats; // Show a line of latency statistics (-s)
+
+	// Multiple Kinects (-n).  Each Kinect has its own kinradar_data, with
+	// its own grids, binning threads, and capture pipeline.  With --fuse, an
+	// extra kinradar_data renders their overhead views merged into one grid.
+	int device; // Index of this Kinect, or the number of Kinects if fused
+	int row0; // Screen row where this Kinect's display starts
+	int cpu; // CPU for the binning thread, or -1 to leave it unpinned
+	struct pose pose; // Placement in the fused grid
+	struct kinradar_data *fuse; // Instance fusing this Kinect's views, or NULL
+	int *fuse_map; // Fused grid cell of each xgrid cell
+	struct kinradar_data *fuse_devs; // Kinects fused by this instance, or NULL
+	int nfuse;
 
 	unsigned int frame; // Frame count
 };
 
 struct kinradar_data *sigdata;
 
+// Set by SIGUSR1 to have the thread running the main loop print statistics
+static atomic_int stats_requested;
+
+// Returns the monotonic clock in nanoseconds.
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Adds a timing sample to a latency stage.
+static void record_stage(struct kinradar_data *data, int stage, int64_t ns)
+{
+	struct stage_stats *st = &data->stages[stage];
+	unsigned int n = atomic_load_explicit(&st->count, memory_order_relaxed);
+
+	if(ns < 0) {
+		ns = 0;
+	} else if(ns > UINT32_MAX) {
+		ns = UINT32_MAX;
+	}
+
+	atomic_store_explicit(&st->ns[n % STAT_SAMPLES], ns, memory_order_relaxed);
+	atomic_store_explicit(&st->count, n + 1, memory_order_release);
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+	return (x > y) - (x < y);
+}
+
+// Finds the median and 99th percentile of a stage's recent samples.  Both are
+// 0 if nothing has been recorded.
+static void stage_percentiles(struct stage_stats *st, unsigned int *p50, unsigned int *p99)
+{
+	unsigned int samples[STAT_SAMPLES];
+	unsigned int n = atomic_load_explicit(&st->count, memory_order_acquire);
+	unsigned int i;
+
+	if(n > STAT_SAMPLES) {
+		n = STAT_SAMPLES;
+	}
+	if(n == 0) {
+		*p50 = 0;
+		*p99 = 0;
+		return;
+	}
+
+	for(i = 0; i < n; i++) {
+		samples[i] = atomic_load_explicit(&st->ns[i], memory_order_relaxed);
+	}
+	qsort(samples, n, sizeof(samples[0]), cmp_uint);
+
+	*p50 = samples[n / 2];
+	*p99 = samples[n * 99 / 100];
+}
+
+// Prints every stage's percentiles and the frame counters to stderr as one
+// line of key=value pairs, with times in nanoseconds.
+static void dump_stats(struct kinradar_data *data)
+{
+	unsigned int binned = atomic_load(&data->stages[STAGE_FILL].count);
+	unsigned int output = atomic_load(&data->stages[STAGE_TOTAL].count);
+	unsigned int p50, p99;
+	int i;
+
+	fprintf(stderr, "stats device=%d binned=%u output=%u skipped=%u lost=%u dropped=%u",
+			data->device, binned, output, binned - output, atomic_load(&data->lost),
+			atomic_load(&data->dropped));
+	for(i = 0; i < NSTAGES; i++) {
+		stage_percentiles(&data->stages[i], &p50, &p99);
+		fprintf(stderr, " %s_p50=%u %s_p99=%u", stage_names[i], p50, stage_names[i], p99);
+	}
+	fprintf(stderr, "\n");
+}
+
+// Prints stats for the n instances in data if SIGUSR1 has been received
+// since the last call.
+static void check_stats_request(struct kinradar_data *data, int n)
+{
+	int i;
+
+	if(atomic_exchange(&stats_requested, 0)) {
+		for(i = 0; i < n; i++) {
+			dump_stats(&data[i]);
+		}
+	}
+}
+
 static float xworld(int x, float z)
 {
 	// tan 35 ~= .70021
@@ -86,6 +993,38 @@ static int xyworld_to_grid(struct grid_info *grid, float w)
 	return (int)((w + grid->wmax) * grid->udiv / (2.0f * grid->wmax));
 }
 
+// Sets the overhead view's wmax for a far plane at z, and its cone edges:
+// the widest rays of a --calibration, or the edges of the ideal camera.
+static void xgrid_extent(const struct kinradar_data *data, struct grid_info *grid, float z)
+{
+	if(data->rays == NULL) {
+		grid->wmax = xworld(0, z);
+		grid->edge_lo = -1.0f;
+		grid->edge_hi = 1.0f;
+		return;
+	}
+
+	grid->wmax = data->ray_xmax * z;
+	grid->edge_lo = data->ray_xlo / data->ray_xmax;
+	grid->edge_hi = data->ray_xhi / data->ray_xmax;
+}
+
+// Sets the side view's wmax and cone edges.  wmax is negative so that up is
+// drawn at the top.
+static void ygrid_extent(const struct kinradar_data *data, struct grid_info *grid, float z)
+{
+	if(data->rays == NULL) {
+		grid->wmax = yworld(FREENECT_FRAME_H - 1, z);
+		grid->edge_lo = -1.0f;
+		grid->edge_hi = 1.0f;
+		return;
+	}
+
+	grid->wmax = -data->ray_ymax * z;
+	grid->edge_lo = -data->ray_yhi / data->ray_ymax;
+	grid->edge_hi = -data->ray_ylo / data->ray_ymax;
+}
+
 static int zworld_to_grid(struct grid_info *grid, float z)
 {
 	int val = (int)((z - grid->zmin) * grid->vdiv / (grid->zmax - grid->zmin));
@@ -103,44 +1042,56 @@ static float zgrid_to_world(struct grid_info *grid, int zg)
 	return zg * (grid->zmax - grid->zmin) / grid->vdiv + grid->zmin;
 }
 
-static void set_bold(int bold)
-{
-	static int last_bold = -1;
+// Escape sequence and character for each cell class, indexed by the class
+// whose style the terminal is currently in (or STYLE_RESET/STYLE_UNKNOWN).
+// Built by init_styles().
+struct esc_seq {
+	uint8_t len;
+	char str[23]; // Longest is 16: bold, foreground, background, character
+};
+static struct esc_seq style_esc[NCLASSES + 2][NCLASSES];
 
-	if(last_bold != !!bold) {
-		if(!!bold) {
-			printf("\e[1m");
-		} else {
-			printf("\e[22m");
-		}
-		last_bold = !!bold;
+static const char cell_charset[] = " .-+%8/\\";
+static const int cell_fg[] = { 0, 0, 7, 7, 7, 7, 2, 2 };
+static const int cell_bold[] = { 1, 1, 0, 0, 1, 1, 0, 0 };
+
+// Terminal attributes, -1 if unknown
+struct term_style {
+	int bold;
+	int fg;
+	int bg;
+};
+
+static void set_bold(char **out, struct term_style *st, int bold)
+{
+	if(st->bold != !!bold) {
+		*out += sprintf(*out, "%s", bold ? "\e[1m" : "\e[22m");
+		st->bold = !!bold;
 	}
 }
 
-static void set_fgcolor(int fg)
+static void set_fgcolor(char **out, struct term_style *st, int fg)
 {
-	static int last_fg = -1;
 	int new_fg = fg % 8 + 30;
 
-	if(new_fg != last_fg) {
-		printf("\e[%dm", new_fg);
-		last_fg = new_fg;
+	if(new_fg != st->fg) {
+		*out += sprintf(*out, "\e[%dm", new_fg);
+		st->fg = new_fg;
 	}
 }
 
-static void set_bgcolor(int bg)
+static void set_bgcolor(char **out, struct term_style *st, int bg)
 {
-	static int last_bg = -1;
 	int new_bg = bg % 8 + 40;
 
-	if(new_bg != last_bg) {
-		printf("\e[%dm", new_bg);
-		last_bg = new_bg;
+	if(new_bg != st->bg) {
+		*out += sprintf(*out, "\e[%dm", new_bg);
+		st->bg = new_bg;
 	}
 }
 
 // Prevents having the same foreground and background
-static void set_color(int bold, int fgcolor, int bgcolor)
+static void set_color(char **out, struct term_style *st, int bold, int fgcolor, int bgcolor)
 {
 	if(!bold && bgcolor == fgcolor) {
 		if(bgcolor == 0) {
@@ -149,61 +1100,247 @@ static void set_color(int bold, int fgcolor, int bgcolor)
 			fgcolor = 0;
 		}
 	}
-	set_bold(bold);
-	set_fgcolor(fgcolor);
-	set_bgcolor(bgcolor);
+	set_bold(out, st, bold);
+	set_fgcolor(out, st, fgcolor);
+	set_bgcolor(out, st, bgcolor);
+}
+
+// Fills style_esc with the shortest escape sequence that switches the
+// terminal from each starting style to each cell class's style.
+static void init_styles(void)
+{
+	struct term_style from[NCLASSES + 2];
+	struct term_style st;
+	char buf[64], *out;
+	int i, c;
+
+	for(i = 0; i < NCLASSES; i++) {
+		out = buf;
+		from[i] = (struct term_style){ -1, -1, -1 };
+		set_color(&out, &from[i], cell_bold[i], cell_fg[i], 0);
+	}
+	from[STYLE_RESET] = (struct term_style){ 1, 30, -1 };
+	from[STYLE_UNKNOWN] = (struct term_style){ -1, -1, -1 };
+
+	for(i = 0; i < NCLASSES + 2; i++) {
+		for(c = 0; c < NCLASSES; c++) {
+			st = from[i];
+			out = buf;
+			set_color(&out, &st, cell_bold[c], cell_fg[c], 0);
+			*out++ = cell_charset[c];
+
+			style_esc[i][c].len = out - buf;
+			memcpy(style_esc[i][c].str, buf, out - buf);
+		}
+	}
+}
+
+// Appends a string to the output arena.  Output past the end of the arena is
+// discarded.
+static void out_str(struct out_buf *ob, const char *str)
+{
+	size_t len = strlen(str);
+
+	if(len > ob->size - ob->len) {
+		len = ob->size - ob->len;
+	}
+	memcpy(ob->buf + ob->len, str, len);
+	ob->len += len;
 }
 
-static void reset_color()
+// Appends formatted text to the output arena.
+static void out_printf(struct out_buf *ob, const char *fmt, ...)
 {
-	printf("\e[0;1;30m");
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(ob->buf + ob->len, ob->size - ob->len, fmt, args);
+	va_end(args);
+
+	if(len > 0) {
+		ob->len += (size_t)len < ob->size - ob->len ? (size_t)len : ob->size - ob->len - 1;
+	}
 }
 
-// This should really be done with curses or something
-static void putchar_color(int bold, int fgcolor, int bgcolor, int c)
+// INFO_OUT() into an output arena
+#define INFO_BUF(ob, ...) {\
+	out_printf((ob), "%s:%d: %s():\t", __FILE__, __LINE__, __FUNCTION__);\
+	out_printf((ob), __VA_ARGS__);\
+}
+
+static void reset_color(struct out_buf *ob)
 {
-	set_color(bold, fgcolor, bgcolor);
-	putchar(c);
+	out_str(ob, "\e[0;1;30m");
+	ob->style = STYLE_RESET;
 }
 
-// Prints a single grid cell's character
-inline void print_cell(struct kinradar_data *data, int val, int scale)
+// Bytes needed in the output arena for a grid's cells, beyond those for the
+// per-line prefix and suffix
+#define CELL_BYTES sizeof(struct esc_seq)
+
+// Bytes needed for the cursor movement before a changed cell
+#define MOVE_BYTES 16
+
+// Differential rendering reprints up to this many unchanged cells rather
+// than moving the cursor past them
+#define MAX_SKIP 3
+
+// Converts a grid cell to its cell class (index into cell_charset).
+static inline int cell_class(int val, int scale)
 {
 	int c = val * 20 / scale;
-	const char charset[] = " .-+%8/\\";
-	const int fg[] = { 0, 0, 7, 7, 7, 7, 2, 2 };
-	const int bold[] = { 1, 1, 0, 0, 1, 1, 0, 0 };
 
 	if(c > 5) {
 		c = 5;
 	}
 
-	// Special values for borders
-	if(val == -1) {
-		c = 6;
-	} else if(val == -2) {
-		c = 7;
+	return c;
+}
+
+// Converts cell i of a grid to its cell class, unless overlay forces one.
+// overlay may be NULL.
+static inline int overlay_class(const uint16_t *pop, const uint8_t *overlay, int i, int scale)
+{
+	if(overlay != NULL && overlay[i] != OVERLAY_COUNT) {
+		return overlay[i];
+	}
+
+	return cell_class(pop[i], scale);
+}
+
+// Appends a character of the given cell class.  The caller must have
+// reserved CELL_BYTES in the arena for it.
+static inline void out_cell(struct out_buf *ob, int c)
+{
+	// Always copy the whole entry; only len bytes of it are kept
+	memcpy(ob->buf + ob->len, style_esc[ob->style][c].str, sizeof(style_esc[0][0].str));
+	ob->len += style_esc[ob->style][c].len;
+	ob->style = c;
+}
+
+// Appends a single grid cell's character.  The caller must have reserved
+// CELL_BYTES in the arena for it.
+static inline void print_cell(struct out_buf *ob, int val, int scale)
+{
+	out_cell(ob, cell_class(val, scale));
+}
+
+// Appends a decimal number to the output arena.  The caller must have
+// reserved space for it.
+static inline void out_uint(struct out_buf *ob, unsigned int val)
+{
+	char tmp[10];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while(val);
+
+	while(n) {
+		ob->buf[ob->len++] = tmp[--n];
 	}
+}
+
+// Moves the cursor to the given zero-based row and column.  The caller must
+// have reserved MOVE_BYTES in the arena for it.
+static inline void out_move(struct out_buf *ob, int row, int col)
+{
+	ob->buf[ob->len++] = '\e';
+	ob->buf[ob->len++] = '[';
+	out_uint(ob, row + 1);
+	ob->buf[ob->len++] = ';';
+	out_uint(ob, col + 1);
+	ob->buf[ob->len++] = 'H';
+}
+
+// Appends the n cells starting at pop and overlay, stride cells apart, that
+// differ from the last rendered cell classes in shadow, and updates shadow.
+// The cells are displayed at the given zero-based row, starting at column
+// col.
+static void print_changed(struct out_buf *ob, const uint16_t *pop, const uint8_t *overlay,
+		int stride, int n, int scale, uint8_t *shadow, int row, int col)
+{
+	int i, c, cur = -1; // cur is the cell the cursor is over, -1 if elsewhere
+
+	for(i = 0; i < n; i++) {
+		c = overlay_class(pop, overlay, i * stride, scale);
+		if(c == shadow[i]) {
+			continue;
+		}
+
+		if(cur >= 0 && i - cur <= MAX_SKIP) {
+			for(; cur < i; cur++) {
+				out_cell(ob, shadow[cur]);
+			}
+		} else {
+			out_move(ob, row, col + i);
+		}
 
-	putchar_color(bold[c], fg[c], 0, charset[c]);
+		out_cell(ob, c);
+		shadow[i] = c;
+		cur = i + 1;
+	}
 }
 
-// Displays the given grid of characters at the given zero-based cursor
-// position.  If x < 0, the grid is printed without horizontal positioning.  If
-// y < 0, the grid is printed at the cursor's current vertical position.  Grid
-// cells are converted to character values by multiplying by 20 then dividing
-// by popmax.  If clear is nonzero, then the remainder of each line to the
-// right of the grid is cleared.  If transpose is nonzero, then u and v are
-// swapped.
-void print_grid(struct kinradar_data *data, struct grid_info *grid, int x, int y, int clear, int transpose)
+// Appends the given grid of characters at the given zero-based cursor
+// position to the output arena.  If x < 0, the grid is printed without
+// horizontal positioning.  If y < 0, the grid is printed at the cursor's
+// current vertical position.  Grid cells are converted to character values by
+// multiplying by 20 then dividing by popmax, except where the grid's overlay
+// forces a border or blank cell.  If clear is nonzero, then the
+// remainder of each line to the right of the grid is cleared.  If transpose
+// is nonzero, then u and v are swapped.
+//
+// If shadow is not NULL, it holds the cell classes last rendered for this
+// grid, in display order, and is updated.  Unless the arena's refresh flag is
+// set, only cells that changed are then sent, the cursor is left anywhere,
+// and x and y must both be given.
+void print_grid(struct kinradar_data *data, struct grid_info *grid, int x, int y, int clear,
+		int transpose, uint8_t *shadow)
 {
+	struct out_buf *ob = &data->out;
+	const uint8_t *overlay;
 	char prefix[16];
-	char *suffix;
-	int u, v;
+	const char *suffix;
+	int rows, cols, stride, step;
+	int u, v, c;
 	int scale;
 
+	if(grid->popmax) {
+		scale = grid->popmax;
+	} else {
+		scale = 1;
+	}
+
+	// Walk the grid in display order
+	if(transpose) {
+		rows = grid->udiv;
+		cols = grid->vdiv;
+		stride = grid->vstride;
+		step = grid->ustride;
+	} else {
+		rows = grid->vdiv;
+		cols = grid->udiv;
+		stride = grid->ustride;
+		step = grid->vstride;
+	}
+
+	if(shadow != NULL && !ob->refresh) {
+		for(v = 0; v < rows; v++) {
+			if(ob->size - ob->len < cols * (CELL_BYTES + MOVE_BYTES)) {
+				return;
+			}
+			overlay = grid->overlay != NULL ? grid->overlay + v * step : NULL;
+			print_changed(ob, grid->gridpop + v * step, overlay, stride, cols, scale,
+					shadow + v * cols, y + v, x);
+		}
+		return;
+	}
+
 	if(y >= 0) {
-		printf("\e[%dH", y + 1);
+		out_printf(ob, "\e[%dH", y + 1);
 	}
 
 	if(x >= 0) {
@@ -212,234 +1349,6430 @@ void print_grid(struct kinradar_data *data, struct grid_info *grid, int x, int y
 		prefix[0] = 0;
 	}
 
-	if(grid->popmax) {
-		scale = grid->popmax;
-	} else {
-		scale = 1;
-	}
+	if(clear) {
+		suffix = "\e[K\n";
+	} else {
+		suffix = "\n";
+	}
+
+	for(v = 0; v < rows; v++) {
+		out_str(ob, prefix);
+		if(ob->size - ob->len < cols * CELL_BYTES) {
+			return;
+		}
+		for(u = 0; u < cols; u++) {
+			c = overlay_class(grid->gridpop, grid->overlay, v * step + u * stride, scale);
+			if(shadow != NULL) {
+				shadow[v * cols + u] = c;
+			}
+			out_cell(ob, c);
+		}
+		out_str(ob, suffix);
+	}
+}
+
+// Chooses how to find the number of bytes written to stdout that haven't
+// been consumed yet: TIOCOUTQ for terminals and sockets, FIONREAD for pipes.
+static void init_backlog(struct out_buf *ob)
+{
+	struct stat st;
+
+	ob->backlog_req = 0;
+	if(fstat(ob->fd, &st)) {
+		return;
+	}
+
+	if(S_ISCHR(st.st_mode) || S_ISSOCK(st.st_mode)) {
+		ob->backlog_req = TIOCOUTQ;
+	} else if(S_ISFIFO(st.st_mode)) {
+		ob->backlog_req = FIONREAD;
+	}
+}
+
+// Returns the number of bytes written to the output that haven't been consumed
+// by the terminal or reader yet, or 0 if unknown.
+static int output_backlog(struct out_buf *ob)
+{
+	int queued;
+
+	if(ob->backlog_req == 0 || ioctl(ob->fd, ob->backlog_req, &queued)) {
+		return 0;
+	}
+
+	return queued;
+}
+
+// Sends everything in the output arena to its fd, retrying partial writes,
+// then empties the arena.  Returns the number of bytes written, or -1 on
+// error.
+static ssize_t write_output(struct out_buf *ob)
+{
+	size_t off = 0;
+	ssize_t ret;
+	int64_t start;
+
+	// Anything printed with stdio must go first
+	fflush(stdout);
+
+	start = now_ns();
+	while(off < ob->len) {
+		ret = write(ob->fd, ob->buf + off, ob->len - off);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			ob->len = 0;
+			return -1;
+		}
+		off += ret;
+	}
+
+	ob->write_ns = now_ns() - start;
+	ob->last_len = off;
+	ob->len = 0;
+
+	return off;
+}
+
+void clear_grid(struct grid_info *grid)
+{
+	memset(grid->gridpop, 0, grid->bufsize);
+	grid->popmax = 0;
+}
+
+// Finds the cells of grid row v that init_overlay() marks as borders.
+static void border_cells(struct grid_info *grid, int v, int *left, int *right)
+{
+	float inc = (grid->zmax - grid->zmin) / grid->vdiv;
+	float zw = zgrid_to_world(grid, v) + inc;
+	int u;
+
+	u = xyworld_to_grid(grid, grid->edge_hi * grid->wmax * zw / grid->zmax);
+
+	if(u >= grid->udiv) {
+		u = grid->udiv - 1;
+	}
+
+	*right = u;
+
+	u = xyworld_to_grid(grid, grid->edge_lo * grid->wmax * zw / grid->zmax);
+
+	if(u < 0 || u >= grid->udiv) {
+		ERROR_OUT("u %d out of range\n", u);
+		abort();
+	}
+
+	*left = u;
+}
+
+// Builds a grid's overlay of the cone borders, which only depend on its
+// geometry.  Cells outside the cone can't hold samples, so they are always
+// drawn blank without looking at their counts.
+static int init_overlay(struct grid_info *grid)
+{
+	int u, v, left, right;
+
+	grid->overlay = malloc(grid->udiv * grid->vdiv);
+	if(grid->overlay == NULL) {
+		ERRNO_OUT("Error allocating cone border overlay");
+		return -1;
+	}
+
+	for(v = 0; v < grid->vdiv; v++) {
+		border_cells(grid, v, &left, &right);
+		for(u = 0; u < grid->udiv; u++) {
+			grid->overlay[CELL(grid, u, v)] = (u < left || u > right) ? 0 : OVERLAY_COUNT;
+		}
+		grid->overlay[CELL(grid, right, v)] = CLASS_BORDER_RIGHT;
+		grid->overlay[CELL(grid, left, v)] = CLASS_BORDER_LEFT;
+	}
+
+	return 0;
+}
+
+// Gives a grid its own copy of another grid's overlay, for the same geometry.
+static int copy_overlay(struct grid_info *grid, const uint8_t *overlay)
+{
+	grid->overlay = malloc(grid->udiv * grid->vdiv);
+	if(grid->overlay == NULL) {
+		ERRNO_OUT("Error allocating cone border overlay");
+		return -1;
+	}
+	memcpy(grid->overlay, overlay, grid->udiv * grid->vdiv);
+
+	return 0;
+}
+
+// Builds the overlay of a pyramid level's grid from src's, the grid a level
+// below, block by block like reduce_grid().  A block with any border cell is
+// a border, so the cone stays outlined, and one with any cell inside the cone
+// is drawn from its count.
+static int reduce_overlay(const struct grid_info *src, struct grid_info *dst)
+{
+	int cols = src->ustride != 1 ? src->vdiv : src->udiv;
+	int rows = src->udiv * src->vdiv / cols;
+	int ocols = (cols + 1) / 2;
+	int r, c, o, cls;
+	uint8_t *out;
+
+	dst->overlay = calloc(dst->udiv * dst->vdiv, 1);
+	if(dst->overlay == NULL) {
+		ERRNO_OUT("Error allocating cone border overlay");
+		return -1;
+	}
+
+	for(r = 0; r < rows; r++) {
+		for(c = 0; c < cols; c++) {
+			cls = src->overlay[r * cols + c];
+			out = &dst->overlay[r / 2 * ocols + c / 2];
+			o = *out;
+			if(cls == CLASS_BORDER_LEFT || (cls == CLASS_BORDER_RIGHT && o != CLASS_BORDER_LEFT) ||
+					(cls == OVERLAY_COUNT && o == 0)) {
+				*out = cls;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Zeroes the cells listed in touched and empties the list.
+static void clear_touched(uint16_t *pop, const int *touched, int *ntouched)
+{
+	int i;
+
+	for(i = 0; i < *ntouched; i++) {
+		pop[touched[i]] = 0;
+	}
+	*ntouched = 0;
+}
+
+// Adds one to an overhead cell of each band histogram in mask (ROW_* bits).
+static inline void bin_bands(struct bin_scratch *s, int mask, int cell)
+{
+	int b;
+
+	for(b = 0, mask = (mask & ROW_BANDS) / ROW_BAND(0); mask; b++, mask >>= 1) {
+		if(mask & 1) {
+			CELL_INC(s->bpop[b][cell]);
+		}
+	}
+}
+
+// Starts using a brick at position key for the first time this frame, taking
+// the next cleared spare.  There is a spare for every position, so it can't
+// run out.  Returns its index in bricks.
+__attribute__((noinline))
+static int voxel_brick(struct voxel_map *vm, int key)
+{
+	vm->nfree--;
+	vm->keys[vm->nused] = key;
+	vm->dir[key] = vm->nused;
+
+	return vm->nused++;
+}
+
+// Adds one to voxel (u, h, v).
+static inline void bin_voxel(struct voxel_map *vm, int u, int h, int v)
+{
+	int key = ((h >> BRICK_SHIFT) * vm->bv + (v >> BRICK_SHIFT)) * vm->bu + (u >> BRICK_SHIFT);
+	int b = vm->dir[key];
+
+	if(b < 0) {
+		b = voxel_brick(vm, key);
+	}
+	CELL_INC(vm->bricks[b][BRICK_VOXEL(u, h, v)]);
+}
+
+// Adds one sample with overhead bin (u, v) and side view U bin h to
+// sub-histogram sub of each grid in mask, and to the histograms of the row's
+// bands.  u and h only need to be valid for the grids in mask.
+static inline void bin_cells(const struct kinradar_data *data, struct bin_scratch *s, int sub,
+		int mask, int u, int h, int d, int v)
+{
+	const struct grid_info *xgrid = &data->xgrid;
+	const struct grid_info *ygrid = &data->ygrid;
+	int cell = CELL(xgrid, u, v);
+
+	if(mask & ROW_XGRID) {
+		CELL_INC(s->xpop[sub][cell]);
+	}
+	if(mask & ROW_YGRID) {
+		CELL_INC(s->ypop[sub][CELL(ygrid, h, ygrid->zbin[d])]);
+	}
+	if(mask & ROW_VOXELS) {
+		bin_voxel(s->voxels, u, h, v);
+	}
+	if(mask & ROW_BANDS) {
+		bin_bands(s, mask, cell);
+	}
+}
+
+// Adds one sample to sub-histogram sub of each grid in its row's mask, and
+// to the histograms of the row's bands.  Bins only needed by grids outside
+// the mask aren't looked up.  The caller must have already rejected
+// out-of-range samples and samples outside the clipping planes.  The side
+// view's clipping planes are the same as the overhead view's, so the side
+// view's bins are always valid for such a sample.
+static inline void bin_sample(const struct kinradar_data *data, struct bin_scratch *s, int sub,
+		int mask, int x, int y, int d, int v)
+{
+	int u = 0, h = 0;
+
+	if(mask & (ROW_XGRID | ROW_VOXELS | ROW_BANDS)) {
+		u = UBIN(&data->xgrid, x, d);
+	}
+	if(mask & (ROW_YGRID | ROW_VOXELS)) {
+		h = UBIN(&data->ygrid, y, d);
+	}
+
+	bin_cells(data, s, sub, mask, u, h, d, v);
+}
+
+// Bins pixels x0 through x1 - 1 of image row y, whose depth values are at
+// row, one at a time.  mask is the row's row_mask bits.  Used by the vector
+// kernels for span ends too short for a vector.
+static inline void fill_pixels(const struct kinradar_data *data, const uint16_t *row,
+		int y, int x0, int x1, int mask, struct bin_scratch *s)
+{
+	int x, d, v;
+
+	for(x = x0; x < x1; x++) {
+		if(row[x] == 2047) {
+			s->oor += mask & ROW_MAIN;
+			continue;
+		}
+
+		d = row[x] & 2047;
+		v = data->xgrid.zbin[d];
+		if(v < 0) {
+			continue;
+		}
+
+		bin_sample(data, s, 0, mask, x, y, d, v);
+	}
+}
+
+// Reference fill kernel.  Bins image rows y0 through y1 - 1 one pixel at a
+// time.  Like every kernel, it skips rows without a row_mask bit, only visits
+// the row's active pixel spans, only bins into the grids in the row's mask,
+// and only counts out of range samples in rows with ROW_MAIN.
+static void fill_scalar(const struct kinradar_data *data, const uint16_t *buf,
+		int y0, int y1, struct bin_scratch *s)
+{
+	const struct pixel_span *sp;
+	int y, mask;
+
+	for(y = y0; y < y1; y++) {
+		mask = data->row_mask[y];
+		if(!mask) {
+			continue;
+		}
+
+		for(sp = SPAN_FIRST(data, y); sp < SPAN_END(data, y); sp++) {
+			fill_pixels(data, &DPT(buf, 0, y), y, sp->x0, sp->x1, mask, s);
+		}
+	}
+}
+
+// Scalar kernel that lists each cell the first time it is incremented, so
+// that clearing, merging, and finding popmax only visit occupied cells.  For
+// large grids that are mostly empty, this saves more than the extra branch
+// costs.
+static void fill_sparse(const struct kinradar_data *data, const uint16_t *buf,
+		int y0, int y1, struct bin_scratch *s)
+{
+	const struct grid_info *xgrid = &data->xgrid;
+	const struct grid_info *ygrid = &data->ygrid;
+	uint16_t *xpop = s->xpop[0];
+	uint16_t *ypop = s->ypop[0];
+	const struct pixel_span *sp;
+	int x, y, d, u, h, v, i, mask;
+
+	for(y = y0; y < y1; y++) {
+		mask = data->row_mask[y];
+		if(!mask) {
+			continue;
+		}
+
+		for(sp = SPAN_FIRST(data, y); sp < SPAN_END(data, y); sp++) {
+			for(x = sp->x0; x < sp->x1; x++) {
+				if(DPT(buf, x, y) == 2047) {
+					s->oor += mask & ROW_MAIN;
+					continue;
+				}
+
+				d = DPT(buf, x, y) & 2047;
+				v = xgrid->zbin[d];
+				if(v < 0) {
+					continue;
+				}
+
+				// Bands are kept dense
+				u = UBIN(xgrid, x, d);
+				i = CELL(xgrid, u, v);
+				if(mask & ROW_BANDS) {
+					bin_bands(s, mask, i);
+				}
+				if(mask & ROW_XGRID) {
+					if(xpop[i] == 0) {
+						s->xtouched[s->nxtouched++] = i;
+					}
+					CELL_INC(xpop[i]);
+				}
+				if(!(mask & (ROW_YGRID | ROW_VOXELS))) {
+					continue;
+				}
+
+				h = UBIN(ygrid, y, d);
+				if(mask & ROW_YGRID) {
+					i = CELL(ygrid, h, ygrid->zbin[d]);
+					if(ypop[i] == 0) {
+						s->ytouched[s->nytouched++] = i;
+					}
+					CELL_INC(ypop[i]);
+				}
+				if(mask & ROW_VOXELS) {
+					bin_voxel(s->voxels, u, h, v);
+				}
+			}
+		}
+	}
+}
+
+// Returns the U bin of a sample at raw depth d along a ray with slope r,
+// found like init_grid_lut() would if every pixel saw its own direction.
+static inline int ray_bin(const struct grid_info *grid, float r, int d)
+{
+	int u = (int)(r * grid->wscale[d] + grid->udiv * 0.5f);
+
+	if(u < 0) {
+		return 0;
+	}
+	if(u >= grid->udiv) {
+		return grid->udiv - 1;
+	}
+
+	return u;
+}
+
+// Kernel for --calibration.  The U tables assume every pixel of a column (or
+// row) points the same way, which lens distortion breaks, so each sample's U
+// bins come from its pixel's ray instead: one multiply per view.
+static void fill_rays(const struct kinradar_data *data, const uint16_t *buf,
+		int y0, int y1, struct bin_scratch *s)
+{
+	const struct pixel_span *sp;
+	const struct pixel_ray *ray;
+	int x, y, d, u, h, v, mask;
+
+	for(y = y0; y < y1; y++) {
+		mask = data->row_mask[y];
+		if(!mask) {
+			continue;
+		}
+
+		for(sp = SPAN_FIRST(data, y); sp < SPAN_END(data, y); sp++) {
+			ray = data->rays + y * FREENECT_FRAME_W;
+			for(x = sp->x0; x < sp->x1; x++) {
+				if(DPT(buf, x, y) == 2047) {
+					s->oor += mask & ROW_MAIN;
+					continue;
+				}
+
+				d = DPT(buf, x, y) & 2047;
+				v = data->xgrid.zbin[d];
+				if(v < 0) {
+					continue;
+				}
+
+				u = h = 0;
+				if(mask & (ROW_XGRID | ROW_VOXELS | ROW_BANDS)) {
+					u = ray_bin(&data->xgrid, ray[x].x, d);
+				}
+				if(mask & (ROW_YGRID | ROW_VOXELS)) {
+					h = ray_bin(&data->ygrid, ray[x].y, d);
+				}
+				bin_cells(data, s, 0, mask, u, h, d, v);
+			}
+		}
+	}
+}
+
+// Sums each pair of neighboring cells of row a with the pair below it in row
+// b into one of n cells of out, saturating at CELL_MAX, for the grid pyramid.
+// Returns the largest sum.  Each fill kernel has a reducer for its
+// instruction set.
+static int reduce_scalar(const uint16_t *a, const uint16_t *b, uint16_t *out, int n)
+{
+	int i, sum, max = 0;
+
+	for(i = 0; i < n; i++) {
+		sum = a[2 * i] + a[2 * i + 1] + b[2 * i] + b[2 * i + 1];
+		out[i] = sum < CELL_MAX ? sum : CELL_MAX;
+		if(out[i] > max) {
+			max = out[i];
+		}
+	}
+
+	return max;
+}
+
+// The vector kernels below reject whole vectors of pixels using the raw depth
+// range covered by the U tables ([dlo, dlo + ndepth)), then look up the bins
+// for the remaining lanes.  Raw 2047 is never inside that range, nor is
+// DEPTH_IGNORED once masked to 11 bits.
+#if KINRADAR_X86
+static int cpu_has_sse4(void)
+{
+	return __builtin_cpu_supports("sse4.1");
+}
+
+static int cpu_has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+// Checks 8 pixels at a time, looking up bins for in-range lanes only.
+__attribute__((target("sse4.1")))
+static void fill_sse4(const struct kinradar_data *data, const uint16_t *buf,
+		int y0, int y1, struct bin_scratch *s)
+{
+	const __m128i dmask = _mm_set1_epi16(2047);
+	const __m128i oor = _mm_set1_epi16(2047);
+	const __m128i dlo = _mm_set1_epi16(data->xgrid.dlo);
+	const __m128i dspan = _mm_set1_epi16(data->xgrid.ndepth - 1);
+	const uint16_t *row;
+	const struct pixel_span *sp;
+	__m128i raw, d, rel, in;
+	int x, y, lane, bits, dd, v, mask;
+
+	for(y = y0; y < y1; y++) {
+		mask = data->row_mask[y];
+		if(!mask) {
+			continue;
+		}
+
+		row = &DPT(buf, 0, y);
+		for(sp = SPAN_FIRST(data, y); sp < SPAN_END(data, y); sp++) {
+			for(x = sp->x0; x + 8 <= sp->x1; x += 8) {
+				raw = _mm_loadu_si128((const __m128i *)(row + x));
+				d = _mm_and_si128(raw, dmask);
+				s->oor += (mask & ROW_MAIN) *
+					(__builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi16(raw, oor))) / 2);
+
+				rel = _mm_sub_epi16(d, dlo);
+				in = _mm_cmpeq_epi16(_mm_min_epu16(rel, dspan), rel);
+				bits = _mm_movemask_epi8(in) & 0x5555;
+
+				while(bits) {
+					lane = __builtin_ctz(bits) / 2;
+					bits &= bits - 1;
+
+					dd = row[x + lane] & 2047;
+					v = data->xgrid.zbin[dd];
+					if(v >= 0) {
+						bin_sample(data, s, lane & (NSUBHIST - 1), mask, x + lane, y, dd, v);
+					}
+				}
+			}
+			fill_pixels(data, row, y, x, sp->x1, mask, s);
+		}
+	}
+}
+
+// Computes the grid cells of 8 pixels at a time with table gathers, then
+// scatters the increments into per-lane sub-histograms.
+__attribute__((target("avx2")))
+static void fill_avx2(const struct kinradar_data *data, const uint16_t *buf,
+		int y0, int y1, struct bin_scratch *s)
+{
+	const struct grid_info *xgrid = &data->xgrid;
+	const struct grid_info *ygrid = &data->ygrid;
+	const __m256i dmask = _mm256_set1_epi32(2047);
+	const __m256i oor = _mm256_set1_epi32(2047);
+	const __m256i lo16 = _mm256_set1_epi32(0xffff);
+	const __m256i neg1 = _mm256_set1_epi32(-1);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i xdlo = _mm256_set1_epi32(xgrid->dlo);
+	const __m256i ydlo = _mm256_set1_epi32(ygrid->dlo);
+	const __m256i xustride = _mm256_set1_epi32(xgrid->ustride);
+	const __m256i xvstride = _mm256_set1_epi32(xgrid->vstride);
+	const __m256i yustride = _mm256_set1_epi32(ygrid->ustride);
+	const __m256i yvstride = _mm256_set1_epi32(ygrid->vstride);
+	const __m256i xstride = _mm256_set1_epi32(FREENECT_FRAME_W);
+	const int *xzbin = (const int *)xgrid->zbin;
+	const int *yzbin = (const int *)ygrid->zbin;
+	const int *xubin = (const int *)xgrid->ubin;
+	const int *yubin = (const int *)ygrid->ubin;
+	int xcell[8] __attribute__((aligned(32)));
+	int ycell[8] __attribute__((aligned(32)));
+	int vox_u[8] __attribute__((aligned(32))); // Voxel coordinates, with slices
+	int vox_h[8] __attribute__((aligned(32)));
+	int vox_v[8] __attribute__((aligned(32)));
+	const uint16_t *row;
+	const struct pixel_span *sp;
+	__m256i raw, d, out, xv, yv, u, valid, xidx, yidx, yrow;
+	int x, y, lane, bits, lanes_left, mask;
+
+	if(xgrid->ndepth == 0) {
+		// Nothing can be binned, but out of range pixels are still counted
+		for(y = y0; y < y1; y++) {
+			if(!(data->row_mask[y] & ROW_MAIN)) {
+				continue;
+			}
+			for(sp = SPAN_FIRST(data, y); sp < SPAN_END(data, y); sp++) {
+				for(x = sp->x0; x < sp->x1; x++) {
+					s->oor += DPT(buf, x, y) == 2047;
+				}
+			}
+		}
+		return;
+	}
+
+	for(y = y0; y < y1; y++) {
+		mask = data->row_mask[y];
+		if(!mask) {
+			continue;
+		}
+
+		row = &DPT(buf, 0, y);
+		yrow = _mm256_set1_epi32(y * ygrid->ndepth);
+		for(sp = SPAN_FIRST(data, y); sp < SPAN_END(data, y); sp++) {
+			for(x = sp->x0; x + 8 <= sp->x1; x += 8) {
+				raw = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(row + x)));
+				d = _mm256_and_si256(raw, dmask);
+				out = _mm256_cmpeq_epi32(raw, oor);
+				s->oor += (mask & ROW_MAIN) *
+					__builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(out)));
+
+				// V bins, gathered as 32 bits and sign-extended from 16
+				xv = _mm256_mask_i32gather_epi32(neg1, xzbin, d, _mm256_xor_si256(out, neg1), 2);
+				xv = _mm256_srai_epi32(_mm256_slli_epi32(xv, 16), 16);
+				valid = _mm256_cmpgt_epi32(xv, neg1);
+				bits = _mm256_movemask_ps(_mm256_castsi256_ps(valid));
+				if(bits == 0) {
+					continue;
+				}
+
+				// Overhead view U bins are indexed [depth][x]
+				if(mask & (ROW_XGRID | ROW_VOXELS | ROW_BANDS)) {
+					xidx = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(d, xdlo), xstride),
+							_mm256_add_epi32(_mm256_set1_epi32(x), lanes));
+					u = _mm256_mask_i32gather_epi32(zero, xubin, xidx, valid, 2);
+					u = _mm256_and_si256(u, lo16);
+					_mm256_store_si256((__m256i *)xcell,
+							_mm256_add_epi32(_mm256_mullo_epi32(xv, xvstride),
+								_mm256_mullo_epi32(u, xustride)));
+					if(mask & ROW_VOXELS) {
+						_mm256_store_si256((__m256i *)vox_u, u);
+						_mm256_store_si256((__m256i *)vox_v, xv);
+					}
+				}
+
+				// Side view U bins are indexed [y][depth]
+				if(mask & (ROW_YGRID | ROW_VOXELS)) {
+					yv = _mm256_mask_i32gather_epi32(zero, yzbin, d, valid, 2);
+					yv = _mm256_srai_epi32(_mm256_slli_epi32(yv, 16), 16);
+					yidx = _mm256_add_epi32(yrow, _mm256_sub_epi32(d, ydlo));
+					u = _mm256_mask_i32gather_epi32(zero, yubin, yidx, valid, 2);
+					u = _mm256_and_si256(u, lo16);
+					_mm256_store_si256((__m256i *)ycell,
+							_mm256_add_epi32(_mm256_mullo_epi32(yv, yvstride),
+								_mm256_mullo_epi32(u, yustride)));
+					if(mask & ROW_VOXELS) {
+						_mm256_store_si256((__m256i *)vox_h, u);
+					}
+				}
+
+				if(mask & ROW_VOXELS) {
+					for(lanes_left = bits; lanes_left; lanes_left &= lanes_left - 1) {
+						lane = __builtin_ctz(lanes_left);
+						bin_voxel(s->voxels, vox_u[lane], vox_h[lane], vox_v[lane]);
+					}
+				}
+
+				// Both main views and nothing else is the common case
+				if((mask & ~ROW_MAIN) == (ROW_XGRID | ROW_YGRID)) {
+					while(bits) {
+						lane = __builtin_ctz(bits);
+						bits &= bits - 1;
+						CELL_INC(s->xpop[lane & (NSUBHIST - 1)][xcell[lane]]);
+						CELL_INC(s->ypop[lane & (NSUBHIST - 1)][ycell[lane]]);
+					}
+					continue;
+				}
+
+				while(bits) {
+					lane = __builtin_ctz(bits);
+					bits &= bits - 1;
+					if(mask & ROW_XGRID) {
+						CELL_INC(s->xpop[lane & (NSUBHIST - 1)][xcell[lane]]);
+					}
+					if(mask & ROW_YGRID) {
+						CELL_INC(s->ypop[lane & (NSUBHIST - 1)][ycell[lane]]);
+					}
+					if(mask & ROW_BANDS) {
+						bin_bands(s, mask, xcell[lane]);
+					}
+				}
+			}
+			fill_pixels(data, row, y, x, sp->x1, mask, s);
+		}
+	}
+}
+
+// Reduces 8 blocks at a time.  The rows are added with saturation, then each
+// pair in a 32-bit lane, and the sums are packed back down with saturation,
+// which matches the scalar sum.
+__attribute__((target("sse4.1")))
+static int reduce_sse4(const uint16_t *a, const uint16_t *b, uint16_t *out, int n)
+{
+	const __m128i low = _mm_set1_epi32(0xffff);
+	__m128i s0, s1, vmax = _mm_setzero_si128();
+	uint16_t lanes[8];
+	int i, lane, max;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		s0 = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(a + 2 * i)),
+				_mm_loadu_si128((const __m128i *)(b + 2 * i)));
+		s1 = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(a + 2 * i + 8)),
+				_mm_loadu_si128((const __m128i *)(b + 2 * i + 8)));
+		s0 = _mm_add_epi32(_mm_and_si128(s0, low), _mm_srli_epi32(s0, 16));
+		s1 = _mm_add_epi32(_mm_and_si128(s1, low), _mm_srli_epi32(s1, 16));
+		s0 = _mm_packus_epi32(s0, s1);
+		_mm_storeu_si128((__m128i *)(out + i), s0);
+		vmax = _mm_max_epu16(vmax, s0);
+	}
+
+	max = reduce_scalar(a + 2 * i, b + 2 * i, out + i, n - i);
+	_mm_storeu_si128((__m128i *)lanes, vmax);
+	for(lane = 0; lane < 8; lane++) {
+		if(lanes[lane] > max) {
+			max = lanes[lane];
+		}
+	}
+
+	return max;
+}
+#endif /* KINRADAR_X86 */
+
+#if KINRADAR_NEON
+// Checks 8 pixels at a time, looking up bins for in-range lanes only.
+static void fill_neon(const struct kinradar_data *data, const uint16_t *buf,
+		int y0, int y1, struct bin_scratch *s)
+{
+	const uint16x8_t dmask = vdupq_n_u16(2047);
+	const uint16x8_t dlo = vdupq_n_u16(data->xgrid.dlo);
+	const uint16x8_t dspan = vdupq_n_u16(data->xgrid.ndepth - 1);
+	uint16_t in_lanes[8];
+	const uint16_t *row;
+	const struct pixel_span *sp;
+	uint16x8_t raw, d, in;
+	int x, y, lane, dd, v, mask;
+
+	for(y = y0; y < y1; y++) {
+		mask = data->row_mask[y];
+		if(!mask) {
+			continue;
+		}
+
+		row = &DPT(buf, 0, y);
+		for(sp = SPAN_FIRST(data, y); sp < SPAN_END(data, y); sp++) {
+			for(x = sp->x0; x + 8 <= sp->x1; x += 8) {
+				raw = vld1q_u16(row + x);
+				d = vandq_u16(raw, dmask);
+				s->oor += (mask & ROW_MAIN) * vaddvq_u16(vshrq_n_u16(vceqq_u16(raw, dmask), 15));
+
+				in = vcleq_u16(vsubq_u16(d, dlo), dspan);
+				if(vmaxvq_u16(in) == 0) {
+					continue;
+				}
+
+				vst1q_u16(in_lanes, in);
+				for(lane = 0; lane < 8; lane++) {
+					if(!in_lanes[lane]) {
+						continue;
+					}
+
+					dd = row[x + lane] & 2047;
+					v = data->xgrid.zbin[dd];
+					if(v >= 0) {
+						bin_sample(data, s, lane & (NSUBHIST - 1), mask, x + lane, y, dd, v);
+					}
+				}
+			}
+			fill_pixels(data, row, y, x, sp->x1, mask, s);
+		}
+	}
+}
+
+// Reduces 8 blocks at a time with pairwise widening adds, then narrows with
+// saturation.
+static int reduce_neon(const uint16_t *a, const uint16_t *b, uint16_t *out, int n)
+{
+	uint16x8_t sums, vmax = vdupq_n_u16(0);
+	uint32x4_t lo, hi;
+	int i, max;
+
+	for(i = 0; i + 8 <= n; i += 8) {
+		lo = vpadalq_u16(vpaddlq_u16(vld1q_u16(a + 2 * i)), vld1q_u16(b + 2 * i));
+		hi = vpadalq_u16(vpaddlq_u16(vld1q_u16(a + 2 * i + 8)), vld1q_u16(b + 2 * i + 8));
+		sums = vcombine_u16(vqmovn_u32(lo), vqmovn_u32(hi));
+		vst1q_u16(out + i, sums);
+		vmax = vmaxq_u16(vmax, sums);
+	}
+
+	max = reduce_scalar(a + 2 * i, b + 2 * i, out + i, n - i);
+
+	return max > vmaxvq_u16(vmax) ? max : vmaxvq_u16(vmax);
+}
+#endif /* KINRADAR_NEON */
+
+// Fill kernels in order of preference
+#define KERNEL_RAYS "rays"
+static const struct fill_kernel fill_kernels[] = {
+#if KINRADAR_X86
+	{ "avx2", fill_avx2, NSUBHIST, cpu_has_avx2, 0, reduce_sse4 },
+	{ "sse4", fill_sse4, NSUBHIST, cpu_has_sse4, 0, reduce_sse4 },
+#endif
+#if KINRADAR_NEON
+	{ "neon", fill_neon, NSUBHIST, NULL, 0, reduce_neon },
+#endif
+	{ "scalar", fill_scalar, 1, NULL, 0, reduce_scalar },
+	{ "sparse", fill_sparse, 1, NULL, 1, reduce_scalar }, // Never chosen automatically
+	{ KERNEL_RAYS, fill_rays, 1, NULL, 0, reduce_scalar }, // Only with --calibration
+};
+
+// Returns the named fill kernel, or the best one supported by this CPU if
+// name is NULL or "auto".  Returns NULL if the kernel doesn't exist or isn't
+// supported.
+static const struct fill_kernel *find_kernel(const char *name)
+{
+	const struct fill_kernel *k;
+	size_t i;
+
+	for(i = 0; i < sizeof(fill_kernels) / sizeof(fill_kernels[0]); i++) {
+		k = &fill_kernels[i];
+		if(name != NULL && strcmp(name, "auto") && strcmp(name, k->name)) {
+			continue;
+		}
+		if(k->supported == NULL || k->supported()) {
+			return k;
+		}
+		if(name != NULL && strcmp(name, "auto")) {
+			ERROR_OUT("The %s fill kernel is not supported by this CPU.\n", name);
+			return NULL;
+		}
+	}
+
+	ERROR_OUT("Unknown fill kernel %s.\n", name);
+	return NULL;
+}
+
+// Returns a comma-separated list of the fill kernels compiled in.
+static const char *fill_kernel_names(void)
+{
+	static char names[64];
+	size_t i;
+
+	names[0] = 0;
+	for(i = 0; i < sizeof(fill_kernels) / sizeof(fill_kernels[0]); i++) {
+		if(i) {
+			strcat(names, ", ");
+		}
+		strcat(names, fill_kernels[i].name);
+	}
+
+	return names;
+}
+
+// Blends a cell's new count into its decayed history and returns the value to
+// display, rounded to the nearest count.
+static inline int decay_cell(uint32_t *hist, int val, unsigned int keep)
+{
+	*hist = ((uint64_t)*hist * keep + ((uint64_t)val << 16) * (65536 - keep)) >> 16;
+
+	return (*hist + 0x8000) >> 16;
+}
+
+// Adds cells start through end - 1 of the histograms in bufs[1] through
+// bufs[nbufs - 1] into the grid's own buffer (bufs[0]), saturating at
+// CELL_MAX.  With persistence, each cell's sum is then decayed into its
+// history, skipping cells with neither.  Returns the largest resulting cell.
+static int merge_grid(struct grid_info *grid, uint16_t *const *bufs, int nbufs, int start, int end)
+{
+	uint16_t *pop = grid->gridpop;
+	uint32_t *hist = grid->history;
+	int i, j, val, popmax = 0;
+
+	if(nbufs == 1 && hist == NULL) {
+		for(i = start; i < end; i++) {
+			if(pop[i] > popmax) {
+				popmax = pop[i];
+			}
+		}
+		return popmax;
+	}
+
+	for(i = start; i < end; i++) {
+		val = pop[i];
+		for(j = 1; j < nbufs; j++) {
+			val += bufs[j][i];
+		}
+		if(val > CELL_MAX) {
+			val = CELL_MAX;
+		}
+		if(hist != NULL && (val | hist[i])) {
+			val = decay_cell(&hist[i], val, grid->keep);
+		}
+		pop[i] = val;
+		if(val > popmax) {
+			popmax = val;
+		}
+	}
+
+	return popmax;
+}
+
+// Adds the touched cells of a sparse histogram into another, listing cells
+// that become nonzero in the destination's touched list.  Sums saturate at
+// CELL_MAX.
+static void merge_sparse(uint16_t *pop, int *touched, int *ntouched,
+		const uint16_t *src, const int *src_touched, int nsrc)
+{
+	int i, c, val;
+
+	for(i = 0; i < nsrc; i++) {
+		c = src_touched[i];
+		if(pop[c] == 0) {
+			touched[(*ntouched)++] = c;
+		}
+		val = pop[c] + src[c];
+		pop[c] = val > CELL_MAX ? CELL_MAX : val;
+	}
+}
+
+// Decays the new counts of a sparse grid into the history of every active or
+// touched cell.  The cells that remain active replace the touched list, so
+// that their displayed values are cleared before the next frame.
+static void decay_sparse(struct grid_info *grid, int *touched, int *ntouched)
+{
+	uint16_t *pop = grid->gridpop;
+	uint32_t *hist = grid->history;
+	int i, c, n = 0;
+
+	// Cells that were touched before whose history hasn't decayed to zero
+	for(i = 0; i < grid->nactive; i++) {
+		c = grid->active[i];
+		pop[c] = decay_cell(&hist[c], pop[c], grid->keep);
+		if(hist[c]) {
+			grid->active[n++] = c;
+		}
+	}
+
+	// Cells touched for the first time.  Any touched cell handled above
+	// now has nonzero history.
+	for(i = 0; i < *ntouched; i++) {
+		c = touched[i];
+		if(hist[c] == 0) {
+			pop[c] = decay_cell(&hist[c], pop[c], grid->keep);
+			grid->active[n++] = c;
+		}
+	}
+
+	grid->nactive = n;
+	memcpy(touched, grid->active, sizeof(int) * n);
+	*ntouched = n;
+}
+
+// Returns the largest of the listed cells.
+static int sparse_popmax(const uint16_t *pop, const int *touched, int ntouched)
+{
+	int i, popmax = 0;
+
+	for(i = 0; i < ntouched; i++) {
+		if(pop[touched[i]] > popmax) {
+			popmax = pop[touched[i]];
+		}
+	}
+
+	return popmax;
+}
+
+// Clears the bricks in use, keeping their buffers as spares.
+static void clear_voxels(struct voxel_map *vm)
+{
+	int i;
+
+	for(i = 0; i < vm->nused; i++) {
+		memset(vm->bricks[i], 0, sizeof(uint16_t) * BRICK_VOXELS);
+		vm->dir[vm->keys[i]] = -1;
+	}
+	vm->nfree += vm->nused;
+	vm->nused = 0;
+}
+
+// Adds the bricks of another worker's voxels into vm, saturating at CELL_MAX.
+static void merge_voxels(struct voxel_map *vm, const struct voxel_map *o)
+{
+	const uint16_t *src;
+	uint16_t *dst;
+	int i, j, b, val;
+
+	for(i = 0; i < o->nused; i++) {
+		b = vm->dir[o->keys[i]];
+		if(b < 0) {
+			b = voxel_brick(vm, o->keys[i]);
+		}
+
+		src = o->bricks[i];
+		dst = vm->bricks[b];
+		for(j = 0; j < BRICK_VOXELS; j++) {
+			val = dst[j] + src[j];
+			dst[j] = val < CELL_MAX ? val : CELL_MAX;
+		}
+	}
+}
+
+// Sums the voxels of height bins hlo through hhi - 1 into an overhead grid,
+// visiting only the bricks in use.  With persistence, the sums are decayed
+// into the grid's history.  Returns the grid's popmax.
+static int slice_voxels(const struct voxel_map *vm, struct grid_info *grid, int hlo, int hhi)
+{
+	const uint16_t *brick;
+	int i, key, u0, h0, v0, u, h, v, c, val;
+
+	clear_grid(grid);
+	for(i = 0; i < vm->nused; i++) {
+		key = vm->keys[i];
+		u0 = key % vm->bu * BRICK_SIZE;
+		v0 = key / vm->bu % vm->bv * BRICK_SIZE;
+		h0 = key / vm->bu / vm->bv * BRICK_SIZE;
+		if(h0 + BRICK_SIZE <= hlo || h0 >= hhi) {
+			continue;
+		}
+
+		brick = vm->bricks[i];
+		for(h = h0 > hlo ? h0 : hlo; h < h0 + BRICK_SIZE && h < hhi; h++) {
+			for(v = v0; v < v0 + BRICK_SIZE && v < grid->vdiv; v++) {
+				for(u = u0; u < u0 + BRICK_SIZE && u < grid->udiv; u++) {
+					val = brick[BRICK_VOXEL(u, h, v)];
+					if(val) {
+						c = CELL(grid, u, v);
+						val += grid->gridpop[c];
+						grid->gridpop[c] = val < CELL_MAX ? val : CELL_MAX;
+					}
+				}
+			}
+		}
+	}
+
+	return merge_grid(grid, &grid->gridpop, 1, 0, grid->udiv * grid->vdiv);
+}
+
+// Finds the side view height bins covered by a height slice band, as hlo
+// through hhi - 1.  The side view's bins count down from the top (its wmax is
+// negative), so the slice's highest height has the lowest bin.
+static void slice_bins(struct kinradar_data *data, int b, int *hlo, int *hhi)
+{
+	struct grid_info *ygrid = &data->ygrid;
+	int top = xyworld_to_grid(ygrid, data->band_bot[b] / 1000.0f);
+	int bottom = xyworld_to_grid(ygrid, data->band_top[b] / 1000.0f);
+
+	*hlo = top < bottom ? top : bottom;
+	*hhi = (top < bottom ? bottom : top) + 1;
+	if(*hlo < 0) {
+		*hlo = 0;
+	}
+	if(*hhi > ygrid->udiv) {
+		*hhi = ygrid->udiv;
+	}
+}
+
+// Clears a worker's histograms and bins its share of the active rows of the
+// pool's current frame.
+static void worker_fill(struct bin_worker *w)
+{
+	struct kinradar_data *data = w->data;
+	struct bin_scratch *s = &w->scratch;
+	int nrows = data->scan_bot - data->scan_top;
+	int y0 = data->scan_top + nrows * w->index / data->nworkers;
+	int y1 = data->scan_top + nrows * (w->index + 1) / data->nworkers;
+	int i = 0, b;
+
+	w->clear_ns = now_ns();
+	if(data->kernel->sparse) {
+		clear_touched(s->xpop[0], s->xtouched, &s->nxtouched);
+		clear_touched(s->ypop[0], s->ytouched, &s->nytouched);
+		i = 1;
+	} else if(w->index == 0) {
+		if(data->wanted & WANT_XGRID) {
+			clear_grid(&data->xgrid);
+		}
+		if(data->wanted & WANT_YGRID) {
+			clear_grid(&data->ygrid);
+		}
+		i = 1;
+	}
+	for(; i < s->nsub; i++) {
+		if(data->wanted & WANT_XGRID) {
+			memset(s->xpop[i], 0, data->xgrid.bufsize);
+		}
+		if(data->wanted & WANT_YGRID) {
+			memset(s->ypop[i], 0, data->ygrid.bufsize);
+		}
+	}
+	for(b = 0; b < data->nbands && (data->wanted & WANT_BANDS); b++) {
+		if(data->band_slice[b]) {
+			continue;
+		}
+		if(w->index == 0) {
+			clear_grid(&data->bands[b]);
+		} else {
+			memset(s->bpop[b], 0, data->bands[b].bufsize);
+		}
+	}
+	if(s->voxels != NULL) {
+		clear_voxels(s->voxels);
+	}
+	s->oor = 0;
+	w->clear_ns = now_ns() - w->clear_ns;
+
+	data->kernel->fill(data, data->pool_buf, y0, y1, s);
+}
+
+// Merges a worker's share of the grid cells from all workers' histograms.
+static void worker_merge(struct bin_worker *w)
+{
+	struct kinradar_data *data = w->data;
+	int xcells = data->xgrid.udiv * data->xgrid.vdiv;
+	int ycells = data->ygrid.udiv * data->ygrid.vdiv;
+	int n = data->nworkers;
+	struct bin_scratch *s = &w->scratch, *o;
+	int i;
+
+	for(i = 0; i < data->nbands && (data->wanted & WANT_BANDS); i++) {
+		if(!data->band_slice[i]) {
+			w->bpopmax[i] = merge_grid(&data->bands[i], data->bmerge[i], n,
+					xcells * w->index / n, xcells * (w->index + 1) / n);
+		}
+	}
+
+	// Sparse histograms are merged by the first worker alone, in time
+	// proportional to the occupied cells
+	if(data->kernel->sparse) {
+		w->xpopmax = 0;
+		w->ypopmax = 0;
+		if(w->index != 0) {
+			return;
+		}
+
+		for(i = 1; i < n; i++) {
+			o = &data->workers[i].scratch;
+			merge_sparse(s->xpop[0], s->xtouched, &s->nxtouched,
+					o->xpop[0], o->xtouched, o->nxtouched);
+			merge_sparse(s->ypop[0], s->ytouched, &s->nytouched,
+					o->ypop[0], o->ytouched, o->nytouched);
+		}
+		if(data->xgrid.history != NULL && (data->wanted & WANT_XGRID)) {
+			decay_sparse(&data->xgrid, s->xtouched, &s->nxtouched);
+		}
+		if(data->ygrid.history != NULL && (data->wanted & WANT_YGRID)) {
+			decay_sparse(&data->ygrid, s->ytouched, &s->nytouched);
+		}
+		w->xpopmax = sparse_popmax(s->xpop[0], s->xtouched, s->nxtouched);
+		w->ypopmax = sparse_popmax(s->ypop[0], s->ytouched, s->nytouched);
+		return;
+	}
+
+	w->xpopmax = 0;
+	w->ypopmax = 0;
+	if(data->wanted & WANT_XGRID) {
+		w->xpopmax = merge_grid(&data->xgrid, data->xmerge, data->nmerge,
+				xcells * w->index / n, xcells * (w->index + 1) / n);
+	}
+	if(data->wanted & WANT_YGRID) {
+		w->ypopmax = merge_grid(&data->ygrid, data->ymerge, data->nmerge,
+				ycells * w->index / n, ycells * (w->index + 1) / n);
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct bin_worker *w = arg;
+	struct kinradar_data *data = w->data;
+	unsigned int gen = 0;
+	int quit;
+
+	for(;;) {
+		pthread_mutex_lock(&data->pool_lock);
+		while(data->pool_gen == gen && !data->pool_quit) {
+			pthread_cond_wait(&data->pool_cond, &data->pool_lock);
+		}
+		gen = data->pool_gen;
+		quit = data->pool_quit;
+		pthread_mutex_unlock(&data->pool_lock);
+
+		if(quit) {
+			break;
+		}
+
+		worker_fill(w);
+		pthread_barrier_wait(&data->pool_barrier);
+		worker_merge(w);
+		pthread_barrier_wait(&data->pool_barrier);
+	}
+
+	return NULL;
+}
+
+// Clears the grids in data->wanted, bins the active rows of the given frame
+// into them with the selected fill kernel on every worker, and finds each
+// grid's popmax.  Grids nobody wants are left alone.  Returns the number of
+// out of range samples.
+static int fill_grids(struct kinradar_data *data, const uint16_t *buf)
+{
+	struct voxel_map *vm;
+	int i, b, hlo, hhi, oor = 0;
+
+	if(data->nworkers > 1) {
+		pthread_mutex_lock(&data->pool_lock);
+		data->pool_buf = buf;
+		data->pool_gen++;
+		pthread_cond_broadcast(&data->pool_cond);
+		pthread_mutex_unlock(&data->pool_lock);
+
+		worker_fill(&data->workers[0]);
+		pthread_barrier_wait(&data->pool_barrier);
+		worker_merge(&data->workers[0]);
+		pthread_barrier_wait(&data->pool_barrier);
+	} else {
+		data->pool_buf = buf;
+		worker_fill(&data->workers[0]);
+		worker_merge(&data->workers[0]);
+	}
+
+	data->xgrid.popmax = 0;
+	data->ygrid.popmax = 0;
+	for(b = 0; b < data->nbands; b++) {
+		data->bands[b].popmax = 0;
+	}
+	for(i = 0; i < data->nworkers; i++) {
+		oor += data->workers[i].scratch.oor;
+		if(data->workers[i].xpopmax > data->xgrid.popmax) {
+			data->xgrid.popmax = data->workers[i].xpopmax;
+		}
+		if(data->workers[i].ypopmax > data->ygrid.popmax) {
+			data->ygrid.popmax = data->workers[i].ypopmax;
+		}
+		for(b = 0; b < data->nbands; b++) {
+			if(data->workers[i].bpopmax[b] > data->bands[b].popmax) {
+				data->bands[b].popmax = data->workers[i].bpopmax[b];
+			}
+		}
+	}
+
+	// Height slices come from every worker's voxels, merged into the first's
+	if(data->nslices && (data->wanted & WANT_BANDS)) {
+		vm = data->workers[0].scratch.voxels;
+		for(i = 1; i < data->nworkers; i++) {
+			merge_voxels(vm, data->workers[i].scratch.voxels);
+		}
+		for(b = 0; b < data->nbands; b++) {
+			if(data->band_slice[b]) {
+				slice_bins(data, b, &hlo, &hhi);
+				data->bands[b].popmax = slice_voxels(vm, &data->bands[b], hlo, hhi);
+			}
+		}
+	}
+
+	return oor;
+}
+
+// Stores the runs of one phase's active pixels in spans, starting at index n,
+// or only counts them if spans is NULL.  Returns the next index.  Phase p
+// samples columns p % stride and rows (p / stride + p) % stride of each
+// stride by stride block, so that with a stride of 2, consecutive frames form
+// a checkerboard.
+static int phase_spans(const struct kinradar_data *data, int p, struct pixel_span *spans,
+		int *index, int n)
+{
+	const uint8_t *m = NULL;
+	int px = p % data->stride;
+	int py = (p / data->stride + p) % data->stride;
+	int x, x0 = 0, y, end;
+
+	for(y = 0; y < FREENECT_FRAME_H; y++) {
+		index[y] = n;
+		if(y % data->stride != py) {
+			continue;
+		}
+
+		if(data->pixel_mask != NULL) {
+			m = data->pixel_mask + y * FREENECT_FRAME_W;
+		}
+		for(x = px, end = -1; x < FREENECT_FRAME_W; x += data->stride) {
+			if(m != NULL && !m[x]) {
+				continue;
+			}
+
+			// Neighbors only join a run without decimation
+			if(x != end) {
+				x0 = x;
+				n++;
+			}
+			end = x + 1;
+			if(spans != NULL) {
+				spans[n - 1] = (struct pixel_span){ x0, end };
+			}
+		}
+	}
+	index[FREENECT_FRAME_H] = n;
+
+	return n;
+}
+
+// Builds the runs of active pixels in each row from pixel_mask and the
+// stride, for every phase.  Only called from the thread that bins frames,
+// while the other binning workers are idle.
+static int compile_spans(struct kinradar_data *data)
+{
+	struct pixel_span *spans;
+	int *index;
+	int nphases = data->interleave ? data->stride * data->stride : 1;
+	int p, n;
+
+	index = malloc(sizeof(*index) * nphases * (FREENECT_FRAME_H + 1));
+	if(index == NULL) {
+		ERRNO_OUT("Error allocating pixel span index");
+		return -1;
+	}
+
+	// Count the runs so they can be stored in one exact allocation
+	for(p = 0, n = 0; p < nphases; p++) {
+		n = phase_spans(data, p, NULL, index + p * (FREENECT_FRAME_H + 1), n);
+	}
+
+	spans = malloc(sizeof(*spans) * (n + 1));
+	if(spans == NULL) {
+		ERRNO_OUT("Error allocating pixel spans");
+		free(index);
+		return -1;
+	}
+
+	for(p = 0, n = 0; p < nphases; p++) {
+		n = phase_spans(data, p, spans, index + p * (FREENECT_FRAME_H + 1), n);
+	}
+
+	free(data->spans);
+	free(data->span_index);
+	data->spans = spans;
+	data->span_index = index;
+	data->nphases = nphases;
+	data->phase %= nphases;
+	data->row_spans = index + data->phase * (FREENECT_FRAME_H + 1);
+
+	return 0;
+}
+
+// Moves to the next phase's pixels with --interleave.
+static void next_phase(struct kinradar_data *data)
+{
+	data->phase = (data->phase + 1) % data->nphases;
+	data->row_spans = data->span_index + data->phase * (FREENECT_FRAME_H + 1);
+}
+
+// Writes the pixel mask as a binary PGM, 255 for active pixels.
+static int save_mask(const struct kinradar_data *data, const char *path)
+{
+	FILE *f;
+	int i, ok;
+
+	f = fopen(path, "wb");
+	if(f == NULL) {
+		ERRNO_OUT("Error creating %s", path);
+		return -1;
+	}
+
+	ok = fprintf(f, "P5\n%d %d\n255\n", FREENECT_FRAME_W, FREENECT_FRAME_H) > 0;
+	for(i = 0; ok && i < FREENECT_FRAME_PIX; i++) {
+		ok = putc(data->pixel_mask == NULL || data->pixel_mask[i] ? 255 : 0, f) != EOF;
+	}
+	if(fclose(f) || !ok) {
+		ERRNO_OUT("Error writing %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Widens each pixel's depth range with a frame while learning the mask (see
+// --learn-mask).  After the last frame, pixels that always saw a surface within
+// MASK_LEARN_SLOP raw depth are masked out as static background, along with
+// any already masked out by --mask.
+static void learn_mask(struct kinradar_data *data, const uint16_t *buf)
+{
+	uint8_t *mask;
+	int i, d, active = 0;
+
+	for(i = 0; i < FREENECT_FRAME_PIX; i++) {
+		d = buf[i] & 2047;
+		if(d == 2047) {
+			// Nothing seen, so it can't be static background
+			d = 0;
+			data->learn_max[i] = 2047;
+		}
+		if(d < data->learn_min[i]) {
+			data->learn_min[i] = d;
+		}
+		if(d > data->learn_max[i]) {
+			data->learn_max[i] = d;
+		}
+	}
+
+	if(--data->learn_frames) {
+		return;
+	}
+
+	mask = data->pixel_mask;
+	if(mask == NULL) {
+		mask = malloc(FREENECT_FRAME_PIX);
+		if(mask == NULL) {
+			ERRNO_OUT("Error allocating learned mask");
+			return;
+		}
+		memset(mask, 1, FREENECT_FRAME_PIX);
+	}
+	for(i = 0; i < FREENECT_FRAME_PIX; i++) {
+		mask[i] = mask[i] && data->learn_max[i] - data->learn_min[i] > MASK_LEARN_SLOP;
+		active += mask[i];
+	}
+	data->pixel_mask = mask;
+
+	free(data->learn_min);
+	free(data->learn_max);
+	data->learn_min = NULL;
+	data->learn_max = NULL;
+
+	if(compile_spans(data)) {
+		return;
+	}
+	if(data->mask_save != NULL) {
+		save_mask(data, data->mask_save);
+	}
+	INFO_OUT("Learned mask leaves %d%% of pixels active.\n", active * 100 / FREENECT_FRAME_PIX);
+}
+
+// Averages a frame into the background model while learning it.
+static void learn_background(struct kinradar_data *data, const uint16_t *buf)
+{
+	uint16_t *bg = data->bg_model;
+	int i, d, n = ++data->bg_learned;
+
+	for(i = 0; i < FREENECT_FRAME_PIX; i++) {
+		d = buf[i] & 2047;
+		if(d == 2047) {
+			continue;
+		}
+
+		d <<= BG_FRAC;
+		if(bg[i] == BG_UNKNOWN) {
+			bg[i] = d;
+		} else {
+			bg[i] += (d - bg[i]) / n;
+		}
+	}
+}
+
+// Compares one image row with the background model, copying foreground
+// pixels and pixels without a reading to out and setting the rest to
+// DEPTH_IGNORED, then moves the model toward the row.  Everything is
+// branchless 16-bit arithmetic on whole rows so that the compiler can
+// vectorize it.
+static void subtract_row(const uint16_t *restrict in, uint16_t *restrict bg,
+		uint16_t *restrict out, uint16_t threshold)
+{
+	uint16_t raw, d, m, diff, step;
+	int x;
+
+	for(x = 0; x < FREENECT_FRAME_W; x++) {
+		raw = in[x] & 2047;
+		d = raw << BG_FRAC;
+		m = bg[x];
+		diff = d > m ? d - m : m - d;
+		step = diff >> BG_ADAPT_SHIFT;
+
+		out[x] = raw != 2047 && diff <= threshold ? DEPTH_IGNORED : raw;
+		bg[x] = raw == 2047 ? m : d > m ? m + step : m - step;
+	}
+}
+
+// Returns the pixels of a frame that differ from the background, learning
+// the background from the first frames instead (--background).  Only rows
+// that are binned are compared.
+static const uint16_t *subtract_background(struct kinradar_data *data, const uint16_t *buf)
+{
+	int y;
+
+	if(data->bg_learn) {
+		learn_background(data, buf);
+		if(!--data->bg_learn) {
+			INFO_OUT("Learned the background from %d frames.\n", data->bg_learned);
+		}
+		return buf;
+	}
+
+	for(y = data->scan_top; y < data->scan_bot; y++) {
+		if(data->row_mask[y]) {
+			subtract_row(&DPT(buf, 0, y), &DPT(data->bg_model, 0, y),
+					&DPT(data->fg_frame, 0, y), data->bg_threshold);
+		}
+	}
+
+	return data->fg_frame;
+}
+
+// Appends a depth frame to the --record file.  Recording stops on error.
+static void record_frame(struct kinradar_data *data, const uint16_t *buf, uint32_t timestamp)
+{
+	struct depth_file_frame hdr = {
+		.time_ns = now_ns(),
+		.timestamp = timestamp,
+	};
+	struct iovec iov[2] = {
+		{ &hdr, sizeof(hdr) },
+		{ (void *)buf, FREENECT_DEPTH_11BIT_SIZE },
+	};
+	ssize_t ret;
+	size_t len = sizeof(hdr) + FREENECT_DEPTH_11BIT_SIZE, off = 0;
+	int i = 0;
+
+	// The file is opened O_APPEND, so partial writes are only expected on
+	// full disks or signals.  Either way, finish or give up on this frame.
+	while(off < len) {
+		ret = writev(data->record_fd, iov + i, 2 - i);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			ERRNO_OUT("Error recording depth frame; recording stopped");
+			close(data->record_fd);
+			data->record_fd = -1;
+			return;
+		}
+
+		off += ret;
+		while(i < 2 && (size_t)ret >= iov[i].iov_len) {
+			ret -= iov[i].iov_len;
+			i++;
+		}
+		if(i < 2) {
+			iov[i].iov_base = (char *)iov[i].iov_base + ret;
+			iov[i].iov_len -= ret;
+		}
+	}
+}
+
+// Points *xgrid, *ygrid, and *bands at data's grids at a pyramid level.
+static void level_grids(struct kinradar_data *data, int level, struct grid_info **xgrid,
+		struct grid_info **ygrid, struct grid_info **bands)
+{
+	if(level == 0) {
+		*xgrid = &data->xgrid;
+		*ygrid = &data->ygrid;
+		*bands = data->bands;
+	} else {
+		*xgrid = &data->levels[level - 1].xgrid;
+		*ygrid = &data->levels[level - 1].ygrid;
+		*bands = data->levels[level - 1].bands;
+	}
+}
+
+// Cells in every grid of a pyramid level's records
+static size_t level_cells(struct kinradar_data *data, int level)
+{
+	struct grid_info *xgrid, *ygrid, *bands;
+
+	level_grids(data, level, &xgrid, &ygrid, &bands);
+
+	return (1 + data->nbands) * xgrid->udiv * xgrid->vdiv + ygrid->udiv * ygrid->vdiv;
+}
+
+// Fills dst from src, the grid a pyramid level below, with the sum of each
+// 2x2 block of cells.  The buffer's rows are reduced in pairs whatever its
+// layout, and an odd last row or column only adds what it has.
+static void reduce_grid(const struct kinradar_data *data, const struct grid_info *src,
+		struct grid_info *dst)
+{
+	int cols = src->ustride != 1 ? src->vdiv : src->udiv;
+	int rows = src->udiv * src->vdiv / cols;
+	int pairs = cols / 2;
+	const uint16_t *a, *b;
+	uint16_t *out = dst->gridpop;
+	int r, i, sum, max, popmax = 0;
+
+	for(r = 0; r < rows; r += 2) {
+		a = src->gridpop + r * cols;
+		b = r + 1 < rows ? a + cols : NULL;
+
+		if(b != NULL) {
+			max = data->kernel->reduce(a, b, out, pairs);
+		} else {
+			for(i = 0, max = 0; i < pairs; i++) {
+				sum = a[2 * i] + a[2 * i + 1];
+				out[i] = sum < CELL_MAX ? sum : CELL_MAX;
+				if(out[i] > max) {
+					max = out[i];
+				}
+			}
+		}
+		if(cols & 1) {
+			sum = a[cols - 1] + (b != NULL ? b[cols - 1] : 0);
+			out[pairs] = sum < CELL_MAX ? sum : CELL_MAX;
+			if(out[pairs] > max) {
+				max = out[pairs];
+			}
+		}
+
+		if(max > popmax) {
+			popmax = max;
+		}
+		out += (cols + 1) / 2;
+	}
+
+	dst->popmax = popmax;
+}
+
+// Reduces every level of the grid pyramid from the one below, starting with
+// the binned grids, so only the first level reads a full size grid.  Grids
+// nobody binned aren't reduced.
+static void build_pyramid(struct kinradar_data *data)
+{
+	struct grid_info *xgrid, *ygrid, *bands;
+	struct grid_level *lv;
+	int l, i;
+
+	for(l = 1; l <= data->nlevels; l++) {
+		level_grids(data, l - 1, &xgrid, &ygrid, &bands);
+		lv = &data->levels[l - 1];
+
+		if(data->wanted & WANT_XGRID) {
+			reduce_grid(data, xgrid, &lv->xgrid);
+		}
+		if(data->wanted & WANT_YGRID) {
+			reduce_grid(data, ygrid, &lv->ygrid);
+		}
+		for(i = 0; i < data->nbands && (data->wanted & WANT_BANDS); i++) {
+			reduce_grid(data, &bands[i], &lv->bands[i]);
+		}
+	}
+}
+
+// Size of data's grid record headers.  Records only have the version 2
+// fields if there are row bands.
+static size_t record_header_size(const struct kinradar_data *data)
+{
+	return data->nbands ? sizeof(struct grid_record) : offsetof(struct grid_record, nbands);
+}
+
+// Lists the grids stored in a record, in order.  Returns the number of grids.
+static int record_grids(const struct kinradar_data *data, struct grid_info **grids,
+		struct grid_info *xgrid, struct grid_info *ygrid, struct grid_info *bands)
+{
+	int i;
+
+	grids[0] = xgrid;
+	grids[1] = ygrid;
+	for(i = 0; i < data->nbands; i++) {
+		grids[2 + i] = &bands[i];
+	}
+
+	return 2 + data->nbands;
+}
+
+// Fills in everything but the record size of a grid record header.
+static void fill_record_header(struct grid_record *rec, struct kinradar_data *data,
+		struct grid_info *xgrid, struct grid_info *ygrid, struct grid_info *bands,
+		const struct frame_info *info)
+{
+	int i;
+
+	memset(rec, 0, sizeof(*rec));
+	memcpy(rec->magic, GRID_MAGIC, sizeof(rec->magic));
+	rec->version = data->nbands ? GRID_VERSION_BANDS : GRID_VERSION;
+	rec->header_size = record_header_size(data);
+	rec->frame = info->frame;
+	rec->time_ns = info->time_ns;
+	rec->timestamp = info->timestamp;
+	rec->oor_total = info->oor_total;
+	rec->xudiv = xgrid->udiv;
+	rec->xvdiv = xgrid->vdiv;
+	rec->xpopmax = xgrid->popmax;
+	rec->yudiv = ygrid->udiv;
+	rec->yvdiv = ygrid->vdiv;
+	rec->ypopmax = ygrid->popmax;
+	rec->device = data->device;
+
+	rec->nbands = data->nbands;
+	for(i = 0; i < data->nbands; i++) {
+		rec->bands[i].top = data->band_top[i];
+		rec->bands[i].bottom = data->band_bot[i];
+		rec->bands[i].popmax = bands[i].popmax;
+		rec->bands[i].flags = data->band_slice[i] ? BAND_SLICE : 0;
+	}
+}
+
+// Encodes n cells as runs against base (see DELTA_MAGIC) after the header at
+// the start of rec, and sets the header's record_size.  rec must have room
+// for a grid_record and 3 * n + 2 uint16_t.  Returns the record size.
+static size_t encode_delta(char *rec, const uint16_t *cells, const uint16_t *base, size_t n)
+{
+	uint16_t *out = (uint16_t *)(rec + ((struct grid_record *)rec)->header_size);
+	size_t i = 0, skip, run;
+
+	while(i < n) {
+		for(skip = 0; i < n && skip < 0xffff && cells[i] == base[i]; skip++, i++) {
+		}
+		if(i == n) {
+			break;
+		}
+
+		// Single unchanged cells are cheaper to send than a new run
+		for(run = 0; i + run < n && run < 0xffff; run++) {
+			if(cells[i + run] == base[i + run] &&
+					(i + run + 1 == n || cells[i + run + 1] == base[i + run + 1])) {
+				break;
+			}
+		}
+
+		*out++ = skip;
+		*out++ = run;
+		memcpy(out, cells + i, run * sizeof(*out));
+		out += run;
+		i += run;
+	}
+
+	((struct grid_record *)rec)->record_size = (char *)out - rec;
+
+	return (char *)out - rec;
+}
+
+// Applies the runs of a delta-encoded record (see DELTA_MAGIC), the len
+// bytes at runs, to n cells.  Returns -1 if the runs don't fit the cells.
+static int decode_delta(uint16_t *cells, size_t n, const uint16_t *runs, size_t len)
+{
+	const uint16_t *end = runs + len / sizeof(*runs);
+	size_t i = 0, run;
+
+	while(end - runs >= 2) {
+		i += runs[0];
+		run = runs[1];
+		runs += 2;
+		if(i + run > n || (size_t)(end - runs) < run) {
+			return -1;
+		}
+
+		memcpy(cells + i, runs, run * sizeof(*runs));
+		runs += run;
+		i += run;
+	}
+
+	return runs == end ? 0 : -1;
+}
+
+// Copies the cells of data's grids at a pyramid level to out, in record
+// order.
+static void copy_cells(struct kinradar_data *data, int level, uint16_t *out)
+{
+	struct grid_info *grids[2 + MAX_BANDS], *xgrid, *ygrid, *bands;
+	int i, n, u, v;
+
+	level_grids(data, level, &xgrid, &ygrid, &bands);
+	n = record_grids(data, grids, xgrid, ygrid, bands);
+	for(i = 0; i < n; i++) {
+		for(v = 0; v < grids[i]->vdiv; v++) {
+			for(u = 0; u < grids[i]->udiv; u++) {
+				*out++ = grids[i]->gridpop[CELL(grids[i], u, v)];
+			}
+		}
+	}
+}
+
+// Hands the newest binned grids to the server thread.  Never blocks on a
+// subscriber; if the server thread hasn't taken the previous frame yet, it
+// is replaced.
+static void serve_frame(struct kinradar_data *data)
+{
+	struct server *sv = data->server;
+	struct serve_stream *st;
+	struct grid_info *xgrid, *ygrid, *bands;
+	uint64_t one = 1;
+	int i;
+
+	pthread_mutex_lock(&sv->lock);
+
+	for(i = 0; i < sv->nstreams; i++) {
+		st = &sv->streams[i];
+		level_grids(data, st->level, &xgrid, &ygrid, &bands);
+		fill_record_header(&st->next_hdr, data, xgrid, ygrid, bands, &data->info);
+		memcpy(st->next_hdr.magic, DELTA_MAGIC, sizeof(st->next_hdr.magic));
+		copy_cells(data, st->level, st->next);
+	}
+	sv->have_next = 1;
+
+	pthread_mutex_unlock(&sv->lock);
+
+	if(write(sv->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		ERRNO_OUT("Error waking server thread");
+	}
+}
+
+// Hands the newest binned grids to the history thread (--record-grids).  If
+// it hasn't taken the previous frame yet, that frame is dropped from the
+// recording rather than waited for, except during a replay.
+static void history_frame(struct kinradar_data *data)
+{
+	struct grid_history *h = data->history;
+
+	pthread_mutex_lock(&h->lock);
+
+	while(h->have_next && h->wait) {
+		pthread_cond_wait(&h->cond, &h->lock);
+	}
+	if(h->have_next) {
+		h->dropped++;
+	}
+	fill_record_header(&h->next_hdr, data, &data->xgrid, &data->ygrid, data->bands, &data->info);
+	memcpy(h->next_hdr.magic, DELTA_MAGIC, sizeof(h->next_hdr.magic));
+	copy_cells(data, 0, h->next);
+	h->have_next = 1;
+	pthread_cond_broadcast(&h->cond);
+
+	pthread_mutex_unlock(&h->lock);
+}
+
+// Returns the root of label l's set in parent, halving the path to it.
+static uint32_t blob_root(uint32_t *parent, uint32_t l)
+{
+	while(parent[l] != l) {
+		parent[l] = parent[parent[l]];
+		l = parent[l];
+	}
+	return l;
+}
+
+// Joins the sets of labels a and b.  The smaller root is kept, so every
+// label's parent is a smaller label.
+static uint32_t blob_union(uint32_t *parent, uint32_t a, uint32_t b)
+{
+	a = blob_root(parent, a);
+	b = blob_root(parent, b);
+	if(a < b) {
+		parent[b] = a;
+		return a;
+	}
+	parent[a] = b;
+	return b;
+}
+
+// Finds the objects in xgrid (--track): 8-connected components of cells
+// with at least track_min samples.  Each component that overlaps a blob of
+// the last frame more than any other component does keeps that blob's id,
+// and the rest get new ids.  The blobs are left in data->info.
+static void track_blobs(struct kinradar_data *data, uint32_t timestamp)
+{
+	struct grid_info *grid = &data->xgrid;
+	uint32_t *label = data->blob_label, *parent = data->blob_parent;
+	struct blob_comp *comps = data->blob_comps, *k;
+	struct blob blobs[MAX_BLOBS], *b;
+	const struct blob *prev;
+	int claim[MAX_BLOBS];
+	uint32_t nlabels = 0, ncomps = 0, l, n, i;
+	float dt = (float)(uint32_t)(timestamp - data->blob_timestamp) / (FRAME_TICKS * 30.0f);
+	float cu, cv, vx, vz;
+	int u, v, c, nblobs = 0;
+
+	// Label occupied cells, joining labels that touch
+	for(v = 0; v < grid->vdiv; v++) {
+		for(u = 0; u < grid->udiv; u++) {
+			c = CELL(grid, u, v);
+			if(grid->gridpop[c] < data->track_min) {
+				label[c] = 0;
+				continue;
+			}
+
+			l = 0;
+			if(u > 0 && label[c - grid->ustride]) {
+				l = label[c - grid->ustride];
+			}
+			if(v > 0) {
+				n = u > 0 ? label[c - grid->vstride - grid->ustride] : 0;
+				if(n) {
+					l = l ? blob_union(parent, l, n) : n;
+				}
+				n = label[c - grid->vstride];
+				if(n) {
+					l = l ? blob_union(parent, l, n) : n;
+				}
+				n = u < grid->udiv - 1 ? label[c - grid->vstride + grid->ustride] : 0;
+				if(n) {
+					l = l ? blob_union(parent, l, n) : n;
+				}
+			}
+			if(!l) {
+				l = ++nlabels;
+				parent[l] = l;
+			}
+			label[c] = l;
+		}
+	}
+
+	// Replace each label's parent with its component.  Parents come first,
+	// so they already hold their component.
+	for(l = 1; l <= nlabels; l++) {
+		if(parent[l] == l) {
+			parent[l] = ncomps;
+			comps[ncomps++] = (struct blob_comp){
+				.umin = UINT16_MAX, .vmin = UINT16_MAX, .slot = -1,
+			};
+		} else {
+			parent[l] = parent[parent[l]];
+		}
+	}
+
+	// Totals, and a majority vote of the slots each component covers
+	for(v = 0; v < grid->vdiv; v++) {
+		for(u = 0; u < grid->udiv; u++) {
+			c = CELL(grid, u, v);
+			if(!label[c]) {
+				continue;
+			}
+
+			k = &comps[parent[label[c]]];
+			k->cells++;
+			k->count += grid->gridpop[c];
+			k->usum += (uint64_t)u * grid->gridpop[c];
+			k->vsum += (uint64_t)v * grid->gridpop[c];
+			k->umin = u < k->umin ? u : k->umin;
+			k->umax = u > k->umax ? u : k->umax;
+			k->vmin = v < k->vmin ? v : k->vmin;
+			k->vmax = v > k->vmax ? v : k->vmax;
+
+			if(data->blob_slot[c]) {
+				if(!k->votes) {
+					k->vote = data->blob_slot[c];
+					k->votes = 1;
+				} else if(k->vote == data->blob_slot[c]) {
+					k->votes++;
+				} else {
+					k->votes--;
+				}
+			}
+		}
+	}
+
+	// The largest component voting for a blob inherits it
+	for(i = 0; i < MAX_BLOBS; i++) {
+		claim[i] = -1;
+	}
+	for(i = 0; i < ncomps; i++) {
+		k = &comps[i];
+		if(k->cells < BLOB_MIN_CELLS || !k->votes) {
+			continue;
+		}
+		if(claim[k->vote - 1] < 0 || comps[claim[k->vote - 1]].cells < k->cells) {
+			claim[k->vote - 1] = i;
+		}
+	}
+
+	for(i = 0; i < ncomps && nblobs < MAX_BLOBS; i++) {
+		k = &comps[i];
+		if(k->cells < BLOB_MIN_CELLS) {
+			continue;
+		}
+
+		k->slot = nblobs;
+		b = &blobs[nblobs++];
+		cu = (float)k->usum / k->count + 0.5f;
+		cv = (float)k->vsum / k->count + 0.5f;
+		*b = (struct blob){
+			.cells = k->cells,
+			.count = k->count,
+			.x = cu * 2.0f * grid->wmax / grid->udiv - grid->wmax,
+			.z = grid->zmin + cv * (grid->zmax - grid->zmin) / grid->vdiv,
+			.umin = k->umin,
+			.umax = k->umax,
+			.vmin = k->vmin,
+			.vmax = k->vmax,
+		};
+
+		if(!k->votes || claim[k->vote - 1] != (int)i) {
+			b->id = data->blob_next_id++;
+			continue;
+		}
+
+		// A blob's first velocity is taken as is, later ones smoothed
+		prev = &data->info.blobs[k->vote - 1];
+		b->id = prev->id;
+		b->age = prev->age + 1;
+		b->vx = prev->vx;
+		b->vz = prev->vz;
+		if(dt > 0.0f) {
+			vx = (b->x - prev->x) / dt;
+			vz = (b->z - prev->z) / dt;
+			b->vx = prev->age ? prev->vx + BLOB_SMOOTHING * (vx - prev->vx) : vx;
+			b->vz = prev->age ? prev->vz + BLOB_SMOOTHING * (vz - prev->vz) : vz;
+		}
+	}
+
+	// Remember which blob covered each cell for the next frame
+	for(v = 0; v < grid->vdiv; v++) {
+		for(u = 0; u < grid->udiv; u++) {
+			c = CELL(grid, u, v);
+			data->blob_slot[c] = label[c] ? comps[parent[label[c]]].slot + 1 : 0;
+		}
+	}
+
+	memcpy(data->info.blobs, blobs, nblobs * sizeof(blobs[0]));
+	data->info.nblobs = nblobs;
+	data->blob_timestamp = timestamp;
+}
+
+// Grid setup used while running, defined with the rest of it below
+static void apply_config(struct kinradar_data *data, struct grid_config *cfg);
+static int alloc_view(struct kinradar_data *data, struct radar_frame *view);
+static int alloc_output(struct kinradar_data *data, struct grid_info *xgrid, struct grid_info *ygrid);
+
+// Bins a depth frame that arrived at in_ns into data's grids, passes them to
+// any --serve subscribers, and updates data->info.  A reconfiguration from
+// --control is applied first.
+static void bin_frame(struct kinradar_data *data, const uint16_t *buf, uint32_t timestamp,
+		int64_t in_ns)
+{
+	int oor_total; // Out of range count
+	int oor;
+	uint64_t one = 1;
+	struct timespec ts;
+	int64_t start, filled, tracked;
+
+	if(atomic_load(&data->config_next) != NULL) {
+		apply_config(data, atomic_exchange(&data->config_next, NULL));
+	}
+
+	if(data->record_fd >= 0) {
+		record_frame(data, buf, timestamp);
+	}
+	if(data->learn_frames) {
+		learn_mask(data, buf);
+	}
+
+	// Fill in cone
+	start = now_ns();
+	if(data->bg_model != NULL) {
+		buf = subtract_background(data, buf);
+	}
+	oor_total = fill_grids(data, buf);
+	if(data->nlevels) {
+		build_pyramid(data); // Counted as part of filling
+	}
+	filled = now_ns();
+	tracked = filled;
+	if(data->track_min) {
+		track_blobs(data, timestamp);
+		tracked = now_ns();
+	}
+	if(data->nphases > 1) {
+		next_phase(data);
+	}
+
+	// Decimated frames only sample one pixel of every stride by stride block
+	oor_total *= data->stride * data->stride;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	data->info.time_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	data->info.in_ns = in_ns;
+	data->info.timestamp = timestamp;
+	data->info.frame = data->frame;
+	data->info.oor_total = oor_total;
+	data->info.ytop = data->ytop;
+	data->info.ybot = data->ybot;
+	data->info.disp_mode = data->disp_mode;
+	data->info.config = data->config;
+	data->info.level = data->level;
+
+	if(data->server != NULL) {
+		serve_frame(data);
+	}
+	if(data->history != NULL) {
+		history_frame(data);
+	}
+
+	record_stage(data, STAGE_QUEUE, start - in_ns);
+	record_stage(data, STAGE_CLEAR, data->workers[0].clear_ns);
+	record_stage(data, STAGE_FILL, filled - start - data->workers[0].clear_ns);
+	if(data->track_min) {
+		record_stage(data, STAGE_TRACK, tracked - filled);
+	}
+
+	oor = oor_total > FREENECT_FRAME_PIX * 35 / 100;
+	if(oor != atomic_exchange(&data->out_of_range, oor) && data->led_fd >= 0 &&
+			write(data->led_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		ERRNO_OUT("Error signaling LED change");
+	}
+	data->frame++;
+}
+
+// Nanoseconds between renders at the -r rate limit, 0 for no limit
+static int64_t render_interval(struct kinradar_data *data)
+{
+	return data->render_rate ? 1000000000 / data->render_rate : 0;
+}
+
+// Returns the time until the next frame may be rendered, or 0 if a frame
+// may be rendered now.  Binning continues regardless, so skipped frames only
+// reduce the display rate.  Frames arriving slightly early for their slot are
+// allowed, so that jitter doesn't push every render back a frame.
+static int64_t render_due(struct kinradar_data *data)
+{
+	int64_t wait = data->next_render - now_ns() - render_interval(data) / 10;
+
+	if(wait > 0) {
+		return wait;
+	}
+
+	// Don't add to output the terminal hasn't caught up with.  The
+	// backlog is checked again at the next frame.
+	if(data->adaptive && output_backlog(&data->out) > 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+// Sets the earliest time for the next render after one that started at
+// start.  With -a, a frame whose write() blocked delays the next frame by
+// as long again, so the terminal is sent at most half as much as it can take.
+static void render_done(struct kinradar_data *data, int64_t start)
+{
+	int64_t interval = render_interval(data);
+	int64_t next = data->next_render + interval;
+	int64_t now = now_ns();
+
+	// Keep a fixed schedule unless a whole slot was missed
+	if(next < start) {
+		next = start + interval;
+	}
+	if(data->adaptive && now + data->out.write_ns > next) {
+		next = now + data->out.write_ns;
+	}
+
+	data->next_render = next;
+	data->rendered++;
+}
+
+// Adds a line of latency percentiles and lost frame counts to the output.
+// Autowrap is turned off so that a narrow terminal cuts the line short
+// instead of pushing the grids down.
+static void render_stats(struct kinradar_data *data)
+{
+	struct out_buf *ob = &data->out;
+	unsigned int p50, p99;
+	int i;
+
+	out_str(ob, "\e[?7l\e[Kus p50/p99:");
+	for(i = 0; i < NSTAGES; i++) {
+		stage_percentiles(&data->stages[i], &p50, &p99);
+		out_printf(ob, " %s %u/%u", stage_names[i], p50 / 1000, p99 / 1000);
+	}
+	out_printf(ob, " lost: %u dropped: %u\e[?7h\n",
+			atomic_load(&data->lost), atomic_load(&data->dropped));
+}
+
+// Displays the status lines and grids of a binned frame.
+static void render_frame(struct kinradar_data *data, struct grid_info *xgrid,
+		struct grid_info *ygrid, struct grid_info *bands, const struct frame_info *info)
+{
+	struct out_buf *ob = &data->out;
+	int top = data->row0 + 2 + data->show_stats;
+	int bottom = top;
+	int i;
+
+	// Display scene info
+	if(data->row0) {
+		out_move(ob, data->row0, 0);
+	} else {
+		out_str(ob, "\e[H");
+	}
+	if(ob->clear) {
+		out_str(ob, "\e[2J");
+		ob->clear = 0;
+	}
+	INFO_BUF(ob, "\e[Ktime: %u frame: %d top: %d bottom: %d\n",
+			info->timestamp, info->frame, info->ytop, info->ybot);
+	INFO_BUF(ob, "\e[Kxpopmax: %d ypopmax: %d out: %d%% bytes: %zu skipped: %u",
+			xgrid->popmax, ygrid->popmax,
+			info->oor_total * 100 / FREENECT_FRAME_PIX, ob->last_len,
+			info->frame - data->rendered);
+	if(info->level) {
+		out_printf(ob, " level: %d", info->level);
+	}
+	if(data->track_min) {
+		out_printf(ob, " blobs: %d", info->nblobs);
+	}
+	out_str(ob, "\n");
+	if(data->show_stats) {
+		render_stats(data);
+	}
+
+	// Display grid
+	ob->refresh = !ob->refresh_interval || !ob->refresh_count;
+	if(ob->refresh_interval && ++ob->refresh_count >= (unsigned int)ob->refresh_interval) {
+		ob->refresh_count = 0;
+	}
+
+	reset_color(ob);
+	if(info->disp_mode == SHOW_BOTH || info->disp_mode == SHOW_HORIZ) {
+		print_grid(data, xgrid, ob->refresh ? -1 : 0, top, info->disp_mode == SHOW_HORIZ, 0,
+				ob->refresh_interval ? ob->shadow[0] : NULL);
+		bottom = top + xgrid->vdiv;
+	}
+	if(info->disp_mode == SHOW_BOTH || info->disp_mode == SHOW_VERT) {
+		print_grid(data, ygrid,
+				info->disp_mode == SHOW_VERT ? (ob->refresh ? -1 : 0) : xgrid->udiv + 1, top,
+				1, 1, ob->refresh_interval ? ob->shadow[1] : NULL);
+		if(top + ygrid->udiv > bottom) {
+			bottom = top + ygrid->udiv;
+		}
+	}
+	if(data->nbands && info->disp_mode != SHOW_VERT) {
+		// Row bands go side by side below, each under its rows and popmax
+		out_move(ob, bottom, 0);
+		out_str(ob, "\e[m\e[K");
+		for(i = 0; i < data->nbands; i++) {
+			out_move(ob, bottom, i * (xgrid->udiv + 1));
+			if(data->band_slice[i]) {
+				out_printf(ob, "height %.2f-%.2fm: %d", data->band_top[i] / 1000.0,
+						data->band_bot[i] / 1000.0, bands[i].popmax);
+			} else {
+				out_printf(ob, "rows %d-%d: %d", data->band_top[i], data->band_bot[i],
+						bands[i].popmax);
+			}
+		}
+		reset_color(ob);
+		bottom++;
+
+		for(i = 0; i < data->nbands; i++) {
+			print_grid(data, &bands[i], i * (xgrid->udiv + 1), bottom, i == data->nbands - 1, 0,
+					ob->refresh_interval ? ob->shadow[2 + i] : NULL);
+		}
+		bottom += xgrid->vdiv;
+		out_move(ob, bottom, 0);
+	} else if(!ob->refresh) {
+		// The cursor was left anywhere; clear below the grids as usual
+		out_move(ob, bottom, 0);
+	}
+	out_str(ob, "\e[m\e[K");
+	ob->style = STYLE_UNKNOWN;
+
+	write_output(ob);
+}
+
+// Bytes in a headless output record for the given grids and data's bands,
+// which are the size of xgrid
+static size_t record_size(const struct kinradar_data *data, struct grid_info *xgrid,
+		struct grid_info *ygrid)
+{
+	return record_header_size(data) + sizeof(int32_t) *
+		((1 + data->nbands) * xgrid->udiv * xgrid->vdiv + ygrid->udiv * ygrid->vdiv);
+}
+
+// Writes a binned frame as a headless output record.
+static void write_record(struct kinradar_data *data, struct grid_info *xgrid,
+		struct grid_info *ygrid, struct grid_info *bands, const struct frame_info *info)
+{
+	struct out_buf *ob = &data->out;
+	struct grid_record hdr;
+	struct blob_record *blobs;
+	struct grid_info *grids[2 + MAX_BANDS], *grid;
+	int32_t *cells = (int32_t *)(ob->buf + record_header_size(data));
+	int i, n, u, v;
+
+	// A version 1 header is shorter than the struct
+	fill_record_header(&hdr, data, xgrid, ygrid, bands, info);
+	hdr.record_size = record_size(data, xgrid, ygrid);
+	memcpy(ob->buf, &hdr, hdr.header_size);
+
+	// Records keep [v][u] order and 32-bit cells whatever the grid's layout
+	n = record_grids(data, grids, xgrid, ygrid, bands);
+	for(i = 0; i < n; i++) {
+		grid = grids[i];
+		for(v = 0; v < grid->vdiv; v++) {
+			for(u = 0; u < grid->udiv; u++) {
+				*cells++ = grid->gridpop[CELL(grid, u, v)];
+			}
+		}
+	}
+	ob->len = hdr.record_size;
+
+	// Blobs go in the same write, so a reader never sees half a frame
+	if(data->track_min) {
+		blobs = (struct blob_record *)(ob->buf + ob->len);
+		memset(blobs, 0, sizeof(*blobs));
+		memcpy(blobs->magic, BLOB_MAGIC, sizeof(blobs->magic));
+		blobs->version = BLOB_VERSION;
+		blobs->header_size = offsetof(struct blob_record, blobs);
+		blobs->record_size = sizeof(*blobs);
+		blobs->frame = info->frame;
+		blobs->nblobs = info->nblobs;
+		memcpy(blobs->blobs, info->blobs, info->nblobs * sizeof(info->blobs[0]));
+		ob->len += sizeof(*blobs);
+	}
+
+	if(write_output(ob) < 0) {
+		ERRNO_OUT("Error writing grid record");
+		sigdata->done = 1;
+	}
+}
+
+// Displays a binned frame, or writes it as a record in headless mode.  bands
+// holds data->nbands band grids.
+static void output_frame(struct kinradar_data *data, struct grid_info *xgrid,
+		struct grid_info *ygrid, struct grid_info *bands, const struct frame_info *info)
+{
+	int64_t start = now_ns(), end;
+
+	// After a reconfiguration, the arena and shadows are resized for the new
+	// grids, and the screen is cleared of anything larger
+	if(info->config != data->out.config) {
+		if(alloc_output(data, xgrid, ygrid)) {
+			ERROR_OUT("Error resizing output for new grids.\n");
+			exit(1);
+		}
+		data->out.config = info->config;
+		data->out.clear = 1;
+	}
+
+	data->out.write_ns = 0;
+	if(data->headless) {
+		write_record(data, xgrid, ygrid, bands, info);
+	} else {
+		render_frame(data, xgrid, ygrid, bands, info);
+	}
+	end = now_ns();
+
+	record_stage(data, STAGE_RENDER, end - start - data->out.write_ns);
+	record_stage(data, STAGE_FLUSH, data->out.write_ns);
+	record_stage(data, STAGE_TOTAL, end - info->in_ns);
+}
+
+// Adds a frame to a ring.  Returns -1 if the ring is full.
+static int ring_push(struct frame_ring *r, void *frame)
+{
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if(head - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SIZE) {
+		return -1;
+	}
+
+	r->slots[head % RING_SIZE] = frame;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+	return 0;
+}
+
+// Removes the oldest frame from a ring.  Returns NULL if the ring is empty.
+static void *ring_pop(struct frame_ring *r)
+{
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	void *frame;
+
+	if(tail == atomic_load_explicit(&r->head, memory_order_acquire)) {
+		return NULL;
+	}
+
+	frame = r->slots[tail % RING_SIZE];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+	return frame;
+}
+
+// Waits for a semaphore, returning early on signals.
+static void sem_wait_intr(sem_t *sem)
+{
+	while(sem_wait(sem) && errno == EINTR) {
+	}
+}
+
+// Copies the most recently binned frame into the back view and swaps it
+// into view_latest for the render thread.
+static void publish_view(struct kinradar_data *data)
+{
+	struct radar_frame *view = &data->views[data->view_back];
+	struct grid_info *xgrid, *ygrid, *bands;
+	int i;
+
+	// The binning thread owns the back view, so it can follow new grids
+	if(view->info.config != data->config && alloc_view(data, view)) {
+		ERROR_OUT("Error resizing view for new grids.\n");
+		exit(1);
+	}
+
+	// Only the level that is displayed is copied
+	level_grids(data, data->level, &xgrid, &ygrid, &bands);
+	view->info = data->info;
+	if(data->wanted & WANT_XGRID) {
+		memcpy(view->xgrid.gridpop, xgrid->gridpop, xgrid->bufsize);
+	}
+	if(data->wanted & WANT_YGRID) {
+		memcpy(view->ygrid.gridpop, ygrid->gridpop, ygrid->bufsize);
+	}
+	view->xgrid.popmax = xgrid->popmax;
+	view->ygrid.popmax = ygrid->popmax;
+	for(i = 0; i < data->nbands && (data->wanted & WANT_BANDS); i++) {
+		memcpy(view->bands[i].gridpop, bands[i].gridpop, bands[i].bufsize);
+		view->bands[i].popmax = bands[i].popmax;
+	}
+
+	data->view_back = atomic_exchange(&data->view_latest, data->view_back | VIEW_FRESH) & ~VIEW_FRESH;
+	sem_post(data->fuse != NULL ? &data->fuse->view_sem : &data->view_sem);
+}
+
+// Returns the newest view that hasn't been displayed yet, or NULL if there
+// isn't one.  Any older views that were never displayed are skipped.
+static struct radar_frame *take_view(struct kinradar_data *data)
+{
+	if(!(atomic_load(&data->view_latest) & VIEW_FRESH)) {
+		return NULL;
+	}
+
+	data->view_front = atomic_exchange(&data->view_latest, data->view_front) & ~VIEW_FRESH;
+
+	return &data->views[data->view_front];
+}
+
+// Adds the newest view of every fused Kinect into a fused instance's grid.
+// Kinects without a new view contribute their previous one.  Returns the
+// fused frame, or NULL if no Kinect has a new view.
+static struct radar_frame *fuse_views(struct kinradar_data *data)
+{
+	struct radar_frame *out = &data->views[0];
+	struct grid_info *grid = &out->xgrid;
+	int cells = grid->udiv * grid->vdiv;
+	struct kinradar_data *dev;
+	struct radar_frame *view;
+	const uint16_t *src;
+	int i, c, val, ncells, fresh = 0, oor = 0;
+
+	memset(grid->gridpop, 0, grid->bufsize);
+	out->info.in_ns = 0;
+
+	for(i = 0; i < data->nfuse; i++) {
+		dev = &data->fuse_devs[i];
+		view = take_view(dev);
+		if(view != NULL) {
+			fresh = 1;
+		} else {
+			view = &dev->views[dev->view_front];
+		}
+
+		src = view->xgrid.gridpop;
+		ncells = view->xgrid.udiv * view->xgrid.vdiv;
+		for(c = 0; c < ncells; c++) {
+			if(src[c]) {
+				val = grid->gridpop[dev->fuse_map[c]] + src[c];
+				grid->gridpop[dev->fuse_map[c]] = val > CELL_MAX ? CELL_MAX : val;
+			}
+		}
+
+		if(view->info.in_ns > out->info.in_ns) {
+			out->info.in_ns = view->info.in_ns;
+			out->info.time_ns = view->info.time_ns;
+			out->info.timestamp = view->info.timestamp;
+		}
+		oor += view->info.oor_total;
+	}
+
+	if(!fresh) {
+		return NULL;
+	}
+
+	grid->popmax = 0;
+	for(c = 0; c < cells; c++) {
+		if(grid->gridpop[c] > grid->popmax) {
+			grid->popmax = grid->gridpop[c];
+		}
+	}
+
+	out->info.frame = data->frame++;
+	out->info.oor_total = oor / data->nfuse;
+	out->info.ytop = data->ytop;
+	out->info.ybot = data->ybot;
+	out->info.disp_mode = data->disp_mode;
+
+	return out;
+}
+
+// Returns the next frame for the render thread: the newest unseen view, or a
+// new fusion of the views of fused Kinects.
+static struct radar_frame *next_view(struct kinradar_data *data)
+{
+	if(data->fuse_devs != NULL) {
+		return fuse_views(data);
+	}
+
+	return take_view(data);
+}
+
+static void *bin_thread(void *arg)
+{
+	struct kinradar_data *data = arg;
+	struct depth_frame *frame;
+
+	while(!atomic_load(&data->pipe_quit)) {
+		sem_wait_intr(&data->capture_sem);
+
+		while((frame = ring_pop(&data->capture_ring)) != NULL) {
+			bin_frame(data, frame->buf, frame->timestamp, frame->in_ns);
+			ring_push(&data->free_ring, frame);
+			publish_view(data);
+		}
+	}
+
+	return NULL;
+}
+
+static void *render_thread(void *arg)
+{
+	struct kinradar_data *data = arg;
+	struct radar_frame *view;
+	struct timespec ts;
+	int64_t start, wait;
+
+	while(atomic_load(&data->pipe_quit) < 2) {
+		sem_wait_intr(&data->view_sem);
+
+		// Sleep off the rate limit, then show whatever is newest
+		wait = render_due(data);
+		if(wait > 1) {
+			ts.tv_sec = wait / 1000000000;
+			ts.tv_nsec = wait % 1000000000;
+			while(nanosleep(&ts, &ts) && errno == EINTR) {
+			}
+			wait = render_due(data);
+		}
+		if(wait) {
+			continue;
+		}
+
+		// Collapse any backlog of posts into one redraw
+		while(!sem_trywait(&data->view_sem)) {
+		}
+
+		view = next_view(data);
+		if(view != NULL) {
+			start = now_ns();
+			output_frame(data, &view->xgrid, &view->ygrid, view->bands, &view->info);
+			render_done(data, start);
+		}
+	}
+
+	// Show the final frame when shutting down
+	view = next_view(data);
+	if(view != NULL) {
+		output_frame(data, &view->xgrid, &view->ygrid, view->bands, &view->info);
+	}
+
+	return NULL;
+}
+
+// Outputs the last frame binned without the capture pipeline if it is due.
+// If -r holds it back and there is an event loop, its render timer is set
+// for when it is due, unless a newer frame replaces it first.  A frame held
+// back by a busy terminal (-a) is just replaced by the next one.
+static void output_pending(struct kinradar_data *data)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	struct grid_info *xgrid, *ygrid, *bands;
+	int64_t start, wait;
+
+	if(!data->render_pending) {
+		return;
+	}
+
+	wait = render_due(data);
+	if(!wait) {
+		start = now_ns();
+		level_grids(data, data->level, &xgrid, &ygrid, &bands);
+		output_frame(data, xgrid, ygrid, bands, &data->info);
+		render_done(data, start);
+		data->render_pending = 0;
+	} else if(data->render_fd >= 0 && wait > 1) {
+		its.it_value.tv_sec = wait / 1000000000;
+		its.it_value.tv_nsec = wait % 1000000000;
+		if(timerfd_settime(data->render_fd, 0, &its, NULL)) {
+			ERRNO_OUT("Error setting render timer");
+		}
+	}
+}
+
+// Passes a depth frame to the binning stage.  Without the capture pipeline,
+// the frame is binned and output right away.  With it, the frame is queued for
+// the binning thread.  If dev is not NULL, buf must be the buffer libfreenect
+// just filled, and dev is given an empty one.  Otherwise buf is copied.
+// Returns -1 if the frame was dropped because binning is behind.
+static int frame_in(struct kinradar_data *data, freenect_device *dev,
+		const uint16_t *buf, uint32_t timestamp)
+{
+	struct depth_frame *next;
+	int64_t in_ns = now_ns();
+	uint32_t gap;
+
+	// Count frames missing between this one and the last one
+	if(data->have_timestamp) {
+		gap = (timestamp - data->last_timestamp + FRAME_TICKS / 2) / FRAME_TICKS;
+		if(gap > 1) {
+			atomic_fetch_add(&data->lost, gap - 1);
+		}
+	}
+	data->last_timestamp = timestamp;
+	data->have_timestamp = 1;
+
+	if(!data->pipeline) {
+		bin_frame(data, buf, timestamp, in_ns);
+		data->render_pending = 1;
+		output_pending(data);
+		return 0;
+	}
+
+	// Hand the filled buffer to the binning thread and give libfreenect an
+	// empty one.  If binning has fallen behind, drop this frame and let
+	// libfreenect overwrite it.
+	next = ring_pop(&data->free_ring);
+	if(next == NULL) {
+		return -1;
+	}
+
+	if(dev == NULL) {
+		memcpy(data->capture_frame->buf, buf, FREENECT_DEPTH_11BIT_SIZE);
+	}
+	data->capture_frame->timestamp = timestamp;
+	data->capture_frame->in_ns = in_ns;
+	ring_push(&data->capture_ring, data->capture_frame);
+	sem_post(&data->capture_sem);
+
+	data->capture_frame = next;
+	if(dev != NULL) {
+		freenect_set_depth_buffer(dev, next->buf);
+	}
+
+	return 0;
+}
+
+void depth(freenect_device *kn_dev, void *depthbuf, uint32_t timestamp)
+{
+	struct kinradar_data *data = freenect_get_user(kn_dev);
+
+	if(frame_in(data, kn_dev, depthbuf, timestamp)) {
+		data->dropped++;
+	}
+}
+
+// http://groups.google.com/group/openkinect/browse_thread/thread/31351846fd33c78/e98a94ac605b9f21#e98a94ac605b9f21
+static void init_lut(float depth_lut[])
+{
+	int i;
+
+	for(i = 0; i < 2048; i++) {
+		depth_lut[i] = 0.1236 * tanf(i / 2842.5 + 1.1863);
+	}
+}
+
+static void init_data(struct kinradar_data *data)
+{
+	memset(data, 0, sizeof(struct kinradar_data));
+
+	init_lut(data->depth_lut);
+	init_styles();
+	data->out.fd = STDOUT_FILENO;
+
+	data->disp_mode = SHOW_BOTH;
+
+	data->xgrid.udiv = 65;
+	data->xgrid.vdiv = 32;
+	data->xgrid.zmin = 0.0f;
+	data->xgrid.zmax = 6.0f;
+	data->xgrid.wmax = xworld(0, data->xgrid.zmax);
+	data->xgrid.edge_lo = -1.0f;
+	data->xgrid.edge_hi = 1.0f;
+
+	data->ygrid.udiv = 32;
+	data->ygrid.vdiv = 80;
+	data->ygrid.zmin = 0.0f;
+	data->ygrid.zmax = 6.0f;
+	data->ygrid.wmax = yworld(FREENECT_FRAME_H - 1, data->ygrid.zmax);
+	data->ygrid.edge_lo = -1.0f;
+	data->ygrid.edge_hi = 1.0f;
+
+	data->ytop = 0;
+	data->ybot = FREENECT_FRAME_H;
+
+	data->nworkers = 1;
+	data->record_fd = -1;
+	data->led_fd = -1;
+	data->render_fd = -1;
+	data->cpu = -1;
+	data->stride = 1;
+}
+
+static void free_grid(struct grid_info *grid)
+{
+	free(grid->gridpop);
+	free(grid->history);
+	free(grid->active);
+	grid->gridpop = NULL;
+	grid->history = NULL;
+	grid->active = NULL;
+}
+
+// Returns a zeroed, cache-aligned buffer of size bytes, which must be a
+// multiple of CACHE_LINE, or NULL on error.
+static void *alloc_cells(size_t size)
+{
+	void *buf = aligned_alloc(CACHE_LINE, size);
+
+	if(buf != NULL) {
+		memset(buf, 0, size);
+	}
+
+	return buf;
+}
+
+// Allocates a grid's cell buffer, laid out [u][v] if transposed is nonzero
+// or [v][u] otherwise.
+static int alloc_grid(struct grid_info *grid, int transposed)
+{
+	size_t cells = grid->udiv * grid->vdiv;
+
+	if(transposed) {
+		grid->ustride = grid->vdiv;
+		grid->vstride = 1;
+	} else {
+		grid->ustride = 1;
+		grid->vstride = grid->udiv;
+	}
+
+	grid->bufsize = (sizeof(uint16_t) * cells + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+
+	grid->gridpop = alloc_cells(grid->bufsize);
+	if(grid->gridpop == NULL) {
+		ERRNO_OUT("Error allocating grid population buffer");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Allocates a grid's persistence history, keeping the given fraction of it
+// each frame.  Sparse kernels also need a list of the active cells.
+static int alloc_history(struct grid_info *grid, float keep, int sparse)
+{
+	size_t cells = grid->udiv * grid->vdiv;
+
+	grid->keep = lrintf(keep * 65536.0f);
+	if(grid->keep > 65535) {
+		grid->keep = 65535;
+	}
+
+	grid->history = alloc_cells((sizeof(uint32_t) * cells + CACHE_LINE - 1) & ~(CACHE_LINE - 1));
+	if(grid->history == NULL) {
+		ERRNO_OUT("Error allocating grid history");
+		return -1;
+	}
+
+	grid->nactive = 0;
+	if(sparse) {
+		grid->active = malloc(sizeof(int) * cells);
+		if(grid->active == NULL) {
+			ERRNO_OUT("Error allocating active cell list");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Builds the tables that map a raw depth value to a V bin, and an image
+// coordinate and raw depth value to a U bin, so that depth() doesn't have to
+// do any floating point math per sample.  Must be called again if the grid's
+// divisions or clipping planes change.  If coord_major is nonzero, the U
+// table is indexed by coordinate first (see UBIN()).
+static int init_grid_lut(struct grid_info *grid, const float depth_lut[],
+		int ncoord, int coord_major, float (*world)(int, float))
+{
+	int i, d, u;
+	float zw;
+
+	grid->dlo = -1;
+	grid->ndepth = 0;
+	for(d = 0; d < 2048; d++) {
+		zw = depth_lut[d];
+		if(d == 2047 || zw < grid->zmin || zw > grid->zmax) {
+			grid->zbin[d] = -1;
+			continue;
+		}
+
+		grid->zbin[d] = zworld_to_grid(grid, zw);
+		grid->wscale[d] = zw * grid->udiv / (2.0f * grid->wmax);
+		if(grid->dlo < 0) {
+			grid->dlo = d;
+		}
+		grid->ndepth = d - grid->dlo + 1;
+	}
+
+	free(grid->ubin);
+	grid->ubin = NULL;
+	grid->ubin_major = coord_major;
+	if(grid->ndepth == 0) {
+		grid->dlo = 0;
+		return 0;
+	}
+
+	// One extra entry so vector kernels can gather it as 32 bits
+	grid->ubin = malloc(sizeof(uint16_t) * (ncoord * grid->ndepth + 1));
+	if(grid->ubin == NULL) {
+		ERRNO_OUT("Error allocating grid U bin table");
+		return -1;
+	}
+
+	for(d = grid->dlo; d < grid->dlo + grid->ndepth; d++) {
+		zw = depth_lut[d];
+		for(i = 0; i < ncoord; i++) {
+			u = xyworld_to_grid(grid, world(i, zw));
+			if(u < 0) {
+				u = 0;
+			} else if(u >= grid->udiv) {
+				u = grid->udiv - 1;
+			}
+			UBIN(grid, i, d) = u;
+		}
+	}
+
+	return 0;
+}
+
+// Allocates an empty voxel map covering the overhead view's cells and the
+// side view's heights, with all of its bricks cleared as spares.  Returns NULL
+// on error.
+static struct voxel_map *alloc_voxels(struct kinradar_data *data)
+{
+	size_t brick_size = sizeof(uint16_t) * BRICK_VOXELS;
+	struct voxel_map *vm;
+	int i, n;
+
+	vm = calloc(1, sizeof(*vm));
+	if(vm == NULL) {
+		return NULL;
+	}
+
+	vm->bu = (data->xgrid.udiv + BRICK_SIZE - 1) >> BRICK_SHIFT;
+	vm->bv = (data->xgrid.vdiv + BRICK_SIZE - 1) >> BRICK_SHIFT;
+	vm->bh = (data->ygrid.udiv + BRICK_SIZE - 1) >> BRICK_SHIFT;
+	n = vm->bu * vm->bv * vm->bh;
+	vm->dir = malloc(sizeof(*vm->dir) * n);
+	vm->keys = malloc(sizeof(*vm->keys) * n);
+	vm->bricks = malloc(sizeof(*vm->bricks) * n);
+	vm->pool = aligned_alloc(CACHE_LINE, brick_size * n);
+	if(vm->dir == NULL || vm->keys == NULL || vm->bricks == NULL || vm->pool == NULL) {
+		free(vm->dir);
+		free(vm->keys);
+		free(vm->bricks);
+		free(vm->pool);
+		free(vm);
+		return NULL;
+	}
+	memset(vm->dir, 0xff, sizeof(*vm->dir) * n);
+	memset(vm->pool, 0, brick_size * n);
+	for(i = 0; i < n; i++) {
+		vm->bricks[i] = vm->pool + i * BRICK_VOXELS;
+	}
+	vm->nfree = n;
+
+	return vm;
+}
+
+static void free_voxels(struct voxel_map *vm)
+{
+	if(vm == NULL) {
+		return;
+	}
+
+	free(vm->pool);
+	free(vm->dir);
+	free(vm->keys);
+	free(vm->bricks);
+	free(vm);
+}
+
+// Allocates each binning worker's histograms.  Worker 0's first histograms
+// are the grids themselves.
+static int alloc_scratch(struct kinradar_data *data)
+{
+	struct bin_scratch *s;
+	int i, j;
+
+	data->workers = calloc(data->nworkers, sizeof(struct bin_worker));
+	data->nmerge = data->nworkers * data->kernel->nsub;
+	data->xmerge = calloc(data->nmerge, sizeof(uint16_t *));
+	data->ymerge = calloc(data->nmerge, sizeof(uint16_t *));
+	if(data->workers == NULL || data->xmerge == NULL || data->ymerge == NULL) {
+		ERRNO_OUT("Error allocating binning workers");
+		return -1;
+	}
+	for(j = 0; j < data->nbands; j++) {
+		data->bmerge[j] = calloc(data->nworkers, sizeof(uint16_t *));
+		if(data->bmerge[j] == NULL) {
+			ERRNO_OUT("Error allocating band merge list");
+			return -1;
+		}
+	}
+
+	for(i = 0; i < data->nworkers; i++) {
+		data->workers[i].data = data;
+		data->workers[i].index = i;
+
+		s = &data->workers[i].scratch;
+		s->nsub = data->kernel->nsub;
+		for(j = 0; j < s->nsub; j++) {
+			if(i == 0 && j == 0) {
+				s->xpop[j] = data->xgrid.gridpop;
+				s->ypop[j] = data->ygrid.gridpop;
+			} else {
+				s->xpop[j] = alloc_cells(data->xgrid.bufsize);
+				s->ypop[j] = alloc_cells(data->ygrid.bufsize);
+				if(s->xpop[j] == NULL || s->ypop[j] == NULL) {
+					ERRNO_OUT("Error allocating sub-histogram buffers");
+					return -1;
+				}
+			}
+
+			data->xmerge[i * s->nsub + j] = s->xpop[j];
+			data->ymerge[i * s->nsub + j] = s->ypop[j];
+		}
+
+		for(j = 0; j < data->nbands; j++) {
+			if(data->band_slice[j]) {
+				// Sliced from the voxels instead
+				continue;
+			}
+			if(i == 0) {
+				s->bpop[j] = data->bands[j].gridpop;
+			} else {
+				s->bpop[j] = alloc_cells(data->bands[j].bufsize);
+				if(s->bpop[j] == NULL) {
+					ERRNO_OUT("Error allocating band histogram");
+					return -1;
+				}
+			}
+			data->bmerge[j][i] = s->bpop[j];
+		}
+
+		if(data->kernel->sparse) {
+			s->xtouched = malloc(sizeof(int) * data->xgrid.udiv * data->xgrid.vdiv);
+			s->ytouched = malloc(sizeof(int) * data->ygrid.udiv * data->ygrid.vdiv);
+			if(s->xtouched == NULL || s->ytouched == NULL) {
+				ERRNO_OUT("Error allocating touched cell lists");
+				return -1;
+			}
+		}
+
+		if(data->nslices) {
+			s->voxels = alloc_voxels(data);
+			if(s->voxels == NULL) {
+				ERRNO_OUT("Error allocating voxel map");
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Starts a thread with all signals blocked, so they are handled by the main
+// thread.
+static int start_thread(pthread_t *thread, void *(*func)(void *), void *arg)
+{
+	sigset_t all, old;
+	int ret;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(thread, NULL, func, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return ret;
+}
+
+// Starts binning workers 1 through nworkers - 1.
+static int start_workers(struct kinradar_data *data)
+{
+	int i, ret;
+
+	if(data->nworkers <= 1) {
+		return 0;
+	}
+
+	data->pool_gen = 0;
+	data->pool_quit = 0;
+	pthread_mutex_init(&data->pool_lock, NULL);
+	pthread_cond_init(&data->pool_cond, NULL);
+	pthread_barrier_init(&data->pool_barrier, NULL, data->nworkers);
+
+	for(i = 1; i < data->nworkers; i++) {
+		ret = start_thread(&data->workers[i].thread, worker_thread, &data->workers[i]);
+		if(ret) {
+			errno = ret;
+			ERRNO_OUT("Error starting binning thread %d", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void stop_workers(struct kinradar_data *data)
+{
+	int i;
+
+	if(data->nworkers <= 1) {
+		return;
+	}
+
+	pthread_mutex_lock(&data->pool_lock);
+	data->pool_quit = 1;
+	pthread_cond_broadcast(&data->pool_cond);
+	pthread_mutex_unlock(&data->pool_lock);
+
+	for(i = 1; i < data->nworkers; i++) {
+		pthread_join(data->workers[i].thread, NULL);
+	}
+
+	pthread_barrier_destroy(&data->pool_barrier);
+	pthread_cond_destroy(&data->pool_cond);
+	pthread_mutex_destroy(&data->pool_lock);
+}
+
+// Sizes the output arena for the largest possible frame with the current
+// grids: every cell changing style and needing a cursor movement, plus line
+// prefixes, suffixes, and status lines.  Also allocates the shadow buffers
+// for differential rendering, and forces the next frame to be a full redraw.
+static int alloc_output(struct kinradar_data *data, struct grid_info *xgrid, struct grid_info *ygrid)
+{
+	struct out_buf *ob = &data->out;
+	size_t cells = (1 + data->nbands) * xgrid->udiv * xgrid->vdiv + ygrid->udiv * ygrid->vdiv;
+	size_t lines = (1 + data->nbands) * xgrid->vdiv + ygrid->udiv + 1;
+	size_t size = cells * (CELL_BYTES + MOVE_BYTES) + lines * 32 + 1024;
+	char *buf;
+	int i;
+
+	if(size < record_size(data, xgrid, ygrid) + sizeof(struct blob_record)) {
+		size = record_size(data, xgrid, ygrid) + sizeof(struct blob_record);
+	}
+
+	buf = realloc(ob->buf, size);
+	if(buf == NULL) {
+		ERRNO_OUT("Error allocating output buffer");
+		return -1;
+	}
+
+	for(i = 0; i < 2 + data->nbands; i++) {
+		free(ob->shadow[i]);
+		ob->shadow[i] = malloc(1 + (i == 1 ? ygrid->udiv * ygrid->vdiv : xgrid->udiv * xgrid->vdiv));
+		if(ob->shadow[i] == NULL) {
+			ERRNO_OUT("Error allocating shadow buffer");
+			return -1;
+		}
+	}
+	ob->refresh_count = 0;
+
+	ob->buf = buf;
+	ob->size = size;
+	ob->len = 0;
+	ob->style = STYLE_UNKNOWN;
+
+	return 0;
+}
+
+// Marks the rows of the main grids and each band in row_mask, and finds the
+// rows that need to be scanned.  Grids that aren't in data->wanted get no
+// rows.
+static void init_row_mask(struct kinradar_data *data)
+{
+	int y, b, mask = ROW_MAIN;
+
+	if(data->wanted & WANT_XGRID) {
+		mask |= ROW_XGRID;
+	}
+	if(data->wanted & WANT_YGRID) {
+		mask |= ROW_YGRID;
+	}
+	if(data->nslices && (data->wanted & WANT_BANDS)) {
+		mask |= ROW_VOXELS;
+	}
+
+	data->scan_top = FREENECT_FRAME_H;
+	data->scan_bot = 0;
+	for(y = 0; y < FREENECT_FRAME_H; y++) {
+		data->row_mask[y] = (y >= data->ytop && y < data->ybot) ? mask : 0;
+		for(b = 0; b < data->nbands && (data->wanted & WANT_BANDS); b++) {
+			if(!data->band_slice[b] && y >= data->band_top[b] && y < data->band_bot[b]) {
+				data->row_mask[y] |= ROW_BAND(b);
+			}
+		}
+
+		if(data->row_mask[y]) {
+			if(y < data->scan_top) {
+				data->scan_top = y;
+			}
+			data->scan_bot = y + 1;
+		}
+	}
+	if(data->scan_top > data->scan_bot) {
+		data->scan_top = data->scan_bot;
+	}
+}
+
+// Registers a consumer of the WANT_* products in wants, so that they are
+// binned from now on.  Must only be called while no frame is being binned.
+static void want_products(struct kinradar_data *data, int wants)
+{
+	data->wanted |= wants;
+	init_row_mask(data);
+}
+
+// Returns the WANT_* products used by output_frame(): everything in a record
+// in headless mode, otherwise whatever the display mode shows.
+static int output_products(const struct kinradar_data *data)
+{
+	if(data->headless) {
+		return WANT_RECORD;
+	}
+
+	switch(data->disp_mode) {
+		case SHOW_HORIZ:
+			return WANT_XGRID | WANT_BANDS | WANT_BORDERS;
+		case SHOW_VERT:
+			return WANT_YGRID | WANT_BORDERS;
+		default:
+			return WANT_RECORD | WANT_BORDERS;
+	}
+}
+
+// Allocates the --track state for xgrid's size, forgetting any blobs from
+// before.
+static int alloc_tracker(struct kinradar_data *data)
+{
+	size_t cells = data->xgrid.udiv * data->xgrid.vdiv;
+	size_t labels = (data->xgrid.udiv + 1) / 2 * data->xgrid.vdiv + 1;
+
+	data->blob_label = malloc(cells * sizeof(*data->blob_label));
+	data->blob_parent = malloc(labels * sizeof(*data->blob_parent));
+	data->blob_comps = malloc(labels * sizeof(*data->blob_comps));
+	data->blob_slot = calloc(cells, sizeof(*data->blob_slot));
+	if(data->blob_label == NULL || data->blob_parent == NULL || data->blob_comps == NULL ||
+			data->blob_slot == NULL) {
+		ERRNO_OUT("Error allocating object tracker");
+		return -1;
+	}
+	data->info.nblobs = 0;
+
+	return 0;
+}
+
+// Sets up a pyramid level's grid with half the divisions of src, the grid a
+// level below, and its layout.
+static int alloc_level_grid(const struct grid_info *src, struct grid_info *grid)
+{
+	*grid = *src;
+	grid->udiv = (src->udiv + 1) / 2;
+	grid->vdiv = (src->vdiv + 1) / 2;
+	grid->gridpop = NULL;
+	grid->overlay = NULL;
+	grid->history = NULL;
+	grid->active = NULL;
+	grid->ubin = NULL;
+	grid->popmax = 0;
+
+	return alloc_grid(grid, src->ustride != 1);
+}
+
+// Allocates levels 1 through data->nlevels of the grid pyramid for data's
+// grids, which must already be allocated.
+static int alloc_levels(struct kinradar_data *data)
+{
+	struct grid_info *xgrid, *ygrid, *bands;
+	struct grid_level *lv;
+	int l, i;
+
+	for(l = 1; l <= data->nlevels; l++) {
+		level_grids(data, l - 1, &xgrid, &ygrid, &bands);
+		lv = &data->levels[l - 1];
+
+		if(alloc_level_grid(xgrid, &lv->xgrid) || alloc_level_grid(ygrid, &lv->ygrid)) {
+			return -1;
+		}
+		for(i = 0; i < data->nbands; i++) {
+			if(alloc_level_grid(&bands[i], &lv->bands[i])) {
+				return -1;
+			}
+		}
+
+		if(xgrid->overlay != NULL &&
+				(reduce_overlay(xgrid, &lv->xgrid) || reduce_overlay(ygrid, &lv->ygrid))) {
+			return -1;
+		}
+		for(i = 0; i < data->nbands; i++) {
+			lv->bands[i].overlay = lv->xgrid.overlay;
+		}
+	}
+
+	return 0;
+}
+
+// Frees what alloc_levels() allocated.
+static void free_levels(struct kinradar_data *data)
+{
+	struct grid_level *lv;
+	int l, i;
+
+	for(l = 1; l <= data->nlevels; l++) {
+		lv = &data->levels[l - 1];
+		free(lv->xgrid.overlay);
+		free(lv->ygrid.overlay);
+		lv->xgrid.overlay = NULL;
+		lv->ygrid.overlay = NULL;
+		free_grid(&lv->xgrid);
+		free_grid(&lv->ygrid);
+		for(i = 0; i < data->nbands; i++) {
+			free_grid(&lv->bands[i]);
+			lv->bands[i].overlay = NULL;
+		}
+	}
+}
+
+// Registers a consumer of a pyramid level, so that it and every level below
+// it are built from now on.  Must only be called while no frame is being
+// binned.
+static int want_level(struct kinradar_data *data, int level)
+{
+	if(level <= data->nlevels) {
+		return 0;
+	}
+
+	free_levels(data);
+	data->nlevels = level;
+
+	return data->xgrid.gridpop != NULL ? alloc_levels(data) : 0;
+}
+
+// Allocates the grids and everything sized by them, for the geometry in
+// data's xgrid and ygrid.  The lookup tables and output arena are left alone.
+static int alloc_grids(struct kinradar_data *data)
+{
+	int i;
+
+	// Bands are overhead grids that use xgrid's lookup tables
+	for(i = 0; i < data->nbands; i++) {
+		data->bands[i] = data->xgrid;
+		data->bands[i].gridpop = NULL;
+		data->bands[i].history = NULL;
+		data->bands[i].active = NULL;
+		data->bands[i].ubin = NULL;
+		if(alloc_grid(&data->bands[i], 0)) {
+			return -1;
+		}
+	}
+
+	// The side view is displayed transposed, so its cells are stored [u][v]
+	if(alloc_grid(&data->xgrid, 0) || alloc_grid(&data->ygrid, 1) || alloc_scratch(data)) {
+		return -1;
+	}
+	if(data->track_min && alloc_tracker(data)) {
+		return -1;
+	}
+
+	// Bands share the overhead view's border overlay
+	if(data->wanted & WANT_BORDERS) {
+		if(init_overlay(&data->xgrid) || init_overlay(&data->ygrid)) {
+			return -1;
+		}
+		for(i = 0; i < data->nbands; i++) {
+			data->bands[i].overlay = data->xgrid.overlay;
+		}
+	}
+
+	if(data->decay > 0.0f &&
+			(alloc_history(&data->xgrid, data->decay, data->kernel->sparse) ||
+			 alloc_history(&data->ygrid, data->decay, data->kernel->sparse))) {
+		return -1;
+	}
+	for(i = 0; i < data->nbands && data->decay > 0.0f; i++) {
+		if(alloc_history(&data->bands[i], data->decay, 0)) {
+			return -1;
+		}
+	}
+	if(alloc_levels(data)) {
+		return -1;
+	}
+	init_row_mask(data);
+
+	return 0;
+}
+
+static int init_grids(struct kinradar_data *data)
+{
+	if(alloc_grids(data) || alloc_output(data, &data->xgrid, &data->ygrid) || compile_spans(data)) {
+		return -1;
+	}
+
+	if(init_grid_lut(&data->xgrid, data->depth_lut, FREENECT_FRAME_W, 0, xworld) ||
+			init_grid_lut(&data->ygrid, data->depth_lut, FREENECT_FRAME_H, 1, yworld)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// Frees what alloc_grids() allocated.  The output arena and lookup tables
+// are reallocated by init_grids() or build_config().  Any binning workers
+// using the grids must be stopped.
+static void free_grids(struct kinradar_data *data)
+{
+	struct bin_scratch *s;
+	int i, j;
+
+	for(i = 0; i < data->nworkers && data->workers != NULL; i++) {
+		s = &data->workers[i].scratch;
+		for(j = (i == 0); j < s->nsub; j++) {
+			free(s->xpop[j]);
+			free(s->ypop[j]);
+		}
+		for(j = 0; j < data->nbands && i > 0; j++) {
+			free(s->bpop[j]);
+		}
+		free(s->xtouched);
+		free(s->ytouched);
+		free_voxels(s->voxels);
+	}
+	free(data->workers);
+	free(data->xmerge);
+	free(data->ymerge);
+	data->workers = NULL;
+	data->xmerge = NULL;
+	data->ymerge = NULL;
+
+	free_grid(&data->xgrid);
+	free_grid(&data->ygrid);
+	free(data->xgrid.overlay);
+	free(data->ygrid.overlay);
+	data->xgrid.overlay = NULL;
+	data->ygrid.overlay = NULL;
+	free(data->blob_label);
+	free(data->blob_parent);
+	free(data->blob_comps);
+	free(data->blob_slot);
+	data->blob_label = NULL;
+	data->blob_parent = NULL;
+	data->blob_comps = NULL;
+	data->blob_slot = NULL;
+	for(i = 0; i < data->nbands; i++) {
+		free(data->bmerge[i]);
+		data->bmerge[i] = NULL;
+		free_grid(&data->bands[i]);
+		data->bands[i].overlay = NULL;
+	}
+	free_levels(data);
+}
+
+// Frees a reconfiguration and the grids it holds.
+static void free_config(struct grid_config *cfg)
+{
+	if(cfg == NULL) {
+		return;
+	}
+
+	if(cfg->grids != NULL) {
+		free_grids(cfg->grids);
+		free(cfg->grids->xgrid.ubin);
+		free(cfg->grids->ygrid.ubin);
+		free(cfg->grids);
+	}
+	free(cfg);
+}
+
+// Exchanges the values of a and b, which have the same type
+#define SWAP(a, b) do {\
+	__typeof__(a) swap_tmp = (a);\
+	(a) = (b);\
+	(b) = swap_tmp;\
+} while(0)
+
+// Swaps the grids of a --control reconfiguration with data's.  Called by
+// whichever thread bins frames, between frames, so nothing is allocated or
+// freed here; the old grids go back to the control thread in cfg.  Outputs
+// and pipeline views resize themselves when they see a frame with the new
+// data->config.
+static void apply_config(struct kinradar_data *data, struct grid_config *cfg)
+{
+	struct kinradar_data *g = cfg->grids;
+	int i;
+
+	SWAP(data->xgrid, g->xgrid);
+	SWAP(data->ygrid, g->ygrid);
+	for(i = 0; i < data->nbands; i++) {
+		SWAP(data->bands[i], g->bands[i]);
+		SWAP(data->bmerge[i], g->bmerge[i]);
+	}
+	for(i = 0; i < MAX_LEVELS; i++) {
+		SWAP(data->levels[i], g->levels[i]);
+	}
+	SWAP(data->nlevels, g->nlevels);
+	SWAP(data->wanted, g->wanted);
+	SWAP(data->xmerge, g->xmerge);
+	SWAP(data->ymerge, g->ymerge);
+	SWAP(data->blob_label, g->blob_label);
+	SWAP(data->blob_parent, g->blob_parent);
+	SWAP(data->blob_comps, g->blob_comps);
+	SWAP(data->blob_slot, g->blob_slot);
+
+	// The pool threads are idle between frames, and find their new
+	// histograms when they are woken for the next one
+	for(i = 0; i < data->nworkers; i++) {
+		SWAP(data->workers[i].scratch, g->workers[i].scratch);
+	}
+
+	data->ytop = cfg->params.ytop;
+	data->ybot = cfg->params.ybot;
+	data->disp_mode = cfg->params.disp_mode;
+	data->level = cfg->params.level;
+	data->info.nblobs = 0;
+	init_row_mask(data);
+	data->config++;
+
+	// The control thread frees each retired config before building the
+	// next, so one is only left here if two were applied in between
+	free_config(atomic_exchange(&data->config_done, cfg));
+}
+
+// Pins a thread to a CPU.  Failure only costs performance, so it is just
+// reported.
+static void pin_thread(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+	int ret;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if(ret) {
+		errno = ret;
+		ERRNO_OUT("Error pinning binning thread to CPU %d", cpu);
+	}
+}
+
+// Moves a point relative to a Kinect into the fused grid's coordinates.
+static void pose_point(const struct pose *pose, float x, float z, float *fx, float *fz)
+{
+	*fx = pose->x + x * cosf(pose->yaw) + z * sinf(pose->yaw);
+	*fz = pose->z - x * sinf(pose->yaw) + z * cosf(pose->yaw);
+}
+
+// Sets up a fused instance for the n Kinects in devs, which must already have
+// their grids.  The fused overhead grid covers every Kinect's view cone, and
+// each Kinect's overhead cells are mapped to the fused cell under their
+// centers.  The fused instance has no side view.
+static int init_fusion(struct kinradar_data *data, struct kinradar_data *devs, int n)
+{
+	struct grid_info *grid = &data->xgrid;
+	struct grid_info *local = &devs[0].xgrid;
+	float xmin = INFINITY, xmax = -INFINITY, zmin = INFINITY, zmax = -INFINITY;
+	float cx[4], cz[4], x, z, fx, fz;
+	int i, j, u, v, fu, fv;
+
+	data->fuse_devs = devs;
+	data->nfuse = n;
+	data->device = n;
+	data->disp_mode = SHOW_HORIZ;
+	data->ygrid.udiv = 0;
+	data->ygrid.vdiv = 0;
+
+	// Corners of each Kinect's cone, clipped at zmin and zmax
+	cx[0] = -local->wmax * local->zmin / local->zmax;
+	cx[1] = -cx[0];
+	cx[2] = -local->wmax;
+	cx[3] = local->wmax;
+	cz[0] = cz[1] = local->zmin;
+	cz[2] = cz[3] = local->zmax;
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < 4; j++) {
+			pose_point(&devs[i].pose, cx[j], cz[j], &fx, &fz);
+			xmin = fminf(xmin, fx);
+			xmax = fmaxf(xmax, fx);
+			zmin = fminf(zmin, fz);
+			zmax = fmaxf(zmax, fz);
+		}
+	}
+
+	INFO_OUT("Fused grid covers x %f to %f, z %f to %f.\n", xmin, xmax, zmin, zmax);
+
+	if(alloc_grid(grid, 0) || alloc_output(data, grid, &data->ygrid)) {
+		return -1;
+	}
+	data->views[0].xgrid = *grid;
+	data->views[0].ygrid = data->ygrid;
+
+	for(i = 0; i < n; i++) {
+		devs[i].fuse = data;
+		devs[i].fuse_map = malloc(sizeof(int) * local->udiv * local->vdiv);
+		if(devs[i].fuse_map == NULL) {
+			ERRNO_OUT("Error allocating fused grid map");
+			return -1;
+		}
+
+		for(v = 0; v < local->vdiv; v++) {
+			for(u = 0; u < local->udiv; u++) {
+				x = (u + 0.5f) * 2.0f * local->wmax / local->udiv - local->wmax;
+				z = (v + 0.5f) * (local->zmax - local->zmin) / local->vdiv + local->zmin;
+				pose_point(&devs[i].pose, x, z, &fx, &fz);
+
+				fu = (fx - xmin) * grid->udiv / (xmax - xmin);
+				fv = (fz - zmin) * grid->vdiv / (zmax - zmin);
+				fu = fu < 0 ? 0 : fu >= grid->udiv ? grid->udiv - 1 : fu;
+				fv = fv < 0 ? 0 : fv >= grid->vdiv ? grid->vdiv - 1 : fv;
+				devs[i].fuse_map[CELL(local, u, v)] = CELL(grid, fu, fv);
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Starts a fused instance's render thread, which is woken by every fused
+// Kinect's binning thread.
+static int start_fusion(struct kinradar_data *data)
+{
+	int ret;
+
+	if(sem_init(&data->view_sem, 0, 0)) {
+		ERRNO_OUT("Error initializing fusion semaphore");
+		return -1;
+	}
+
+	ret = start_thread(&data->render_thread, render_thread, data);
+	if(ret) {
+		errno = ret;
+		ERRNO_OUT("Error starting fusion thread");
+		return -1;
+	}
+	data->pipe_started = 1;
+
+	return 0;
+}
+
+// (Re)allocates a pipeline view's grids to match data's.  Each view has its
+// own border overlays, so a view being displayed doesn't depend on any of
+// data's grids, which a reconfiguration may free.
+static int alloc_view(struct kinradar_data *data, struct radar_frame *view)
+{
+	struct grid_info *grids[3] = { &view->xgrid, &view->ygrid, view->bands };
+	struct grid_info *xgrid, *ygrid, *bands;
+	int i, b;
+
+	free(view->xgrid.overlay);
+	free(view->ygrid.overlay);
+	free_grid(&view->xgrid);
+	free_grid(&view->ygrid);
+	for(b = 0; b < data->nbands; b++) {
+		free_grid(&view->bands[b]);
+	}
+
+	// Views hold the displayed level of the pyramid
+	level_grids(data, data->level, &xgrid, &ygrid, &bands);
+	view->xgrid = *xgrid;
+	view->ygrid = *ygrid;
+	for(b = 0; b < data->nbands; b++) {
+		view->bands[b] = bands[b];
+	}
+	for(i = 0; i < 3; i++) {
+		for(b = 0; b < (i < 2 ? 1 : data->nbands); b++) {
+			grids[i][b].gridpop = NULL;
+			grids[i][b].history = NULL;
+			grids[i][b].active = NULL;
+			grids[i][b].ubin = NULL;
+			grids[i][b].overlay = NULL;
+		}
+	}
+
+	if(alloc_grid(&view->xgrid, 0) || alloc_grid(&view->ygrid, 1)) {
+		return -1;
+	}
+	if(xgrid->overlay != NULL && (copy_overlay(&view->xgrid, xgrid->overlay) ||
+				copy_overlay(&view->ygrid, ygrid->overlay))) {
+		return -1;
+	}
+	for(b = 0; b < data->nbands; b++) {
+		view->bands[b].overlay = view->xgrid.overlay;
+		if(alloc_grid(&view->bands[b], 0)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Depth buffer pools are mapped in multiples of this, the usual huge page size
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// Allocates the pipeline's depth buffers at once, from reserved huge pages if
+// possible or else transparent huge pages, and locks them into memory so that
+// neither libfreenect nor binning takes page faults or TLB misses on them.
+// Only failing to map the buffers is an error.
+static int alloc_depth_pool(struct kinradar_data *data)
+{
+	size_t size = (DEPTH_FRAMES * FREENECT_DEPTH_11BIT_SIZE + HUGE_PAGE_SIZE - 1) &
+		~(size_t)(HUGE_PAGE_SIZE - 1);
+	size_t off, page = sysconf(_SC_PAGESIZE);
+	uint8_t *pool;
+	int i;
+
+	pool = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB, -1, 0);
+	if(pool == MAP_FAILED) {
+		// Pages already faulted in stay small, so transparent huge pages
+		// are asked for before anything touches the pool
+		pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(pool == MAP_FAILED) {
+			ERRNO_OUT("Error allocating depth buffers");
+			return -1;
+		}
+		madvise(pool, size, MADV_HUGEPAGE);
+	}
+
+	// Locking faults the whole pool in, or else it is touched page by page,
+	// so capture never waits on a page fault
+	if(mlock(pool, size)) {
+		ERRNO_OUT("Error locking depth buffers into memory (see ulimit -l)");
+		for(off = 0; off < size; off += page) {
+			pool[off] = 0;
+		}
+	}
+
+	data->depth_pool = pool;
+	data->depth_pool_size = size;
+	for(i = 0; i < DEPTH_FRAMES; i++) {
+		data->frames[i].buf = (uint16_t *)(pool + i * FREENECT_DEPTH_11BIT_SIZE);
+	}
+
+	return 0;
+}
+
+// Allocates the capture pipeline's depth buffers and views, and starts its
+// threads.  Before depth is started, libfreenect must be given
+// data->capture_frame's buffer with freenect_set_depth_buffer().
+static int start_pipeline(struct kinradar_data *data)
+{
+	int i, ret;
+
+	if(data->fuse_devs != NULL) {
+		return start_fusion(data);
+	}
+	if(!data->pipeline) {
+		return 0;
+	}
+
+	if(alloc_depth_pool(data)) {
+		return -1;
+	}
+	for(i = 1; i < DEPTH_FRAMES; i++) {
+		ring_push(&data->free_ring, &data->frames[i]);
+	}
+	data->capture_frame = &data->frames[0];
+
+	for(i = 0; i < 3; i++) {
+		if(alloc_view(data, &data->views[i])) {
+			return -1;
+		}
+	}
+	data->view_back = 0;
+	atomic_store(&data->view_latest, 1);
+	data->view_front = 2;
+
+	if(sem_init(&data->capture_sem, 0, 0) || sem_init(&data->view_sem, 0, 0)) {
+		ERRNO_OUT("Error initializing pipeline semaphores");
+		return -1;
+	}
+
+	ret = start_thread(&data->bin_thread, bin_thread, data);
+	if(!ret && data->fuse == NULL) {
+		ret = start_thread(&data->render_thread, render_thread, data);
+	}
+	if(ret) {
+		errno = ret;
+		ERRNO_OUT("Error starting pipeline threads");
+		return -1;
+	}
+	data->pipe_started = 1;
+
+	if(data->cpu >= 0) {
+		pin_thread(data->bin_thread, data->cpu);
+	}
+
+	return 0;
+}
+
+static void stop_pipeline(struct kinradar_data *data)
+{
+	if(!data->pipe_started) {
+		return;
+	}
+
+	// Let the binning thread finish queued frames before the render
+	// thread exits.  Fused Kinects have no render thread, and the fused
+	// instance has no binning thread.
+	if(data->fuse_devs == NULL) {
+		atomic_store(&data->pipe_quit, 1);
+		sem_post(&data->capture_sem);
+		pthread_join(data->bin_thread, NULL);
+	}
+
+	if(data->fuse == NULL) {
+		atomic_store(&data->pipe_quit, 2);
+		sem_post(&data->view_sem);
+		pthread_join(data->render_thread, NULL);
+	}
+
+	if(data->fuse_devs == NULL) {
+		INFO_OUT("Dropped %u frames from Kinect %d while binning was behind.\n",
+				atomic_load(&data->dropped), data->device);
+	}
+
+	// libfreenect has been stopped, so nothing else uses the buffers
+	if(data->depth_pool != NULL) {
+		munmap(data->depth_pool, data->depth_pool_size);
+		data->depth_pool = NULL;
+	}
+	data->pipe_started = 0;
+}
+
+// Splits a HOST:PORT address into host, which may be empty, and *port.
+// Returns -1 if there is no port.
+static int split_host_port(const char *addr, char *host, size_t size, char **port)
+{
+	snprintf(host, size, "%s", addr);
+	*port = strrchr(host, ':');
+	if(*port == NULL) {
+		ERROR_OUT("No port given in %s.\n", addr);
+		return -1;
+	}
+	*(*port)++ = 0;
+
+	return 0;
+}
+
+// Removes a subscriber from the server and closes its socket.
+static void close_client(struct server *sv, struct serve_client *c)
+{
+	struct serve_client **p;
+
+	for(p = &sv->clients; *p != NULL; p = &(*p)->next) {
+		if(*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+
+	close(c->fd);
+	free(c->buf);
+	free(c);
+}
+
+// Watches a subscriber for writability only while it has unsent data.
+static void watch_client(struct server *sv, struct serve_client *c)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | (c->len ? EPOLLOUT : 0),
+		.data.ptr = c,
+	};
+
+	epoll_ctl(sv->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Sends as much of a subscriber's unsent data as its socket will take.
+// Returns -1 if the subscriber should be dropped.
+static int flush_client(struct server *sv, struct serve_client *c)
+{
+	ssize_t ret;
+
+	while(c->len) {
+		ret = send(c->fd, c->buf + c->off, c->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
+		}
+
+		c->off += ret;
+		c->len -= ret;
+	}
+
+	if(!c->len) {
+		watch_client(sv, c);
+	}
+
+	return 0;
+}
+
+// Queues a record for a subscriber and starts sending it.  Returns -1 if the
+// subscriber should be dropped.
+static int send_client(struct server *sv, struct serve_client *c, const char *rec, size_t len)
+{
+	char *buf;
+
+	if(c->size < len) {
+		buf = realloc(c->buf, len);
+		if(buf == NULL) {
+			ERRNO_OUT("Error allocating subscriber buffer");
+			return -1;
+		}
+		c->buf = buf;
+		c->size = len;
+	}
+
+	memcpy(c->buf, rec, len);
+	c->off = 0;
+	c->len = len;
+
+	if(flush_client(sv, c)) {
+		return -1;
+	}
+	if(c->len) {
+		watch_client(sv, c);
+	}
+
+	return 0;
+}
+
+// Accepts a new subscriber to a stream on a listening socket.
+static void accept_client(struct server *sv, int listen_fd, struct serve_stream *st)
+{
+	struct serve_client *c;
+	struct epoll_event ev;
+	int fd, one = 1;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if(fd < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+			ERRNO_OUT("Error accepting subscriber");
+		}
+		return;
+	}
+
+	// Fails harmlessly on Unix sockets
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	c = calloc(1, sizeof(*c));
+	if(c == NULL) {
+		ERRNO_OUT("Error allocating subscriber");
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->stream = st;
+	c->need_key = 1;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if(epoll_ctl(sv->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		ERRNO_OUT("Error watching subscriber");
+		close(fd);
+		free(c);
+		return;
+	}
+
+	c->next = sv->clients;
+	sv->clients = c;
+}
+
+// Reads and discards anything a subscriber sends.  Returns -1 when the
+// subscriber has hung up.
+static int read_client(struct serve_client *c)
+{
+	char buf[256];
+	ssize_t ret;
+
+	while((ret = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+	}
+
+	return (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) ? -1 : 0;
+}
+
+// Returns a stream's keyframe record of the frame being sent, encoding it
+// the first time it is needed.
+static const char *serve_key(struct serve_stream *st)
+{
+	if(!st->key_len) {
+		memcpy(st->key, st->delta, ((struct grid_record *)st->delta)->header_size);
+		((struct grid_record *)st->key)->flags = DELTA_KEY;
+		st->key_len = encode_delta(st->key, st->cur, st->zero, st->ncells);
+	}
+
+	return st->key;
+}
+
+// Sends the newest frame from serve_frame() to every subscriber.  TCP and
+// Unix subscribers still sending a previous record miss this frame and get a
+// keyframe next time.
+static void serve_publish(struct server *sv)
+{
+	struct serve_client *c, *next;
+	struct serve_stream *st;
+	struct serve_udp *u;
+	const char *rec;
+	uint16_t *tmp;
+	size_t len;
+	ssize_t ret;
+	uint64_t count;
+	int i;
+
+	if(read(sv->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		ERRNO_OUT("Error reading server event");
+	}
+
+	pthread_mutex_lock(&sv->lock);
+	if(!sv->have_next) {
+		pthread_mutex_unlock(&sv->lock);
+		return;
+	}
+	for(i = 0; i < sv->nstreams; i++) {
+		st = &sv->streams[i];
+		tmp = st->cur;
+		st->cur = st->next;
+		st->next = tmp;
+		memcpy(st->delta, &st->next_hdr, sizeof(st->next_hdr));
+	}
+	sv->have_next = 0;
+	pthread_mutex_unlock(&sv->lock);
+
+	// The first frame has nothing to be a delta of.  Keyframes are only
+	// encoded for levels that someone needs one of.
+	for(i = 0; i < sv->nstreams; i++) {
+		st = &sv->streams[i];
+		st->key_len = 0;
+		if(sv->have_prev) {
+			st->delta_len = encode_delta(st->delta, st->cur, st->prev, st->ncells);
+		} else {
+			st->delta_len = 0;
+		}
+	}
+
+	for(c = sv->clients; c != NULL; c = next) {
+		next = c->next;
+		st = c->stream;
+
+		if(c->len) {
+			c->need_key = 1;
+			continue;
+		}
+
+		if(c->need_key || !st->delta_len) {
+			rec = serve_key(st);
+			len = st->key_len;
+			c->need_key = 0;
+		} else {
+			rec = st->delta;
+			len = st->delta_len;
+		}
+
+		if(send_client(sv, c, rec, len)) {
+			close_client(sv, c);
+		}
+	}
+
+	for(i = 0; i < sv->nudp; i++) {
+		u = &sv->udp[i];
+		st = u->stream;
+
+		if(u->need_key || !st->delta_len || ++u->since_key >= SERVE_KEY_INTERVAL) {
+			rec = serve_key(st);
+			len = st->key_len;
+			u->since_key = 0;
+		} else {
+			rec = st->delta;
+			len = st->delta_len;
+		}
+
+		// Anything lost or refused means the next receiver needs a keyframe
+		ret = send(u->fd, rec, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		u->need_key = ret < 0;
+		if(ret < 0 && errno == EMSGSIZE && !u->warned) {
+			ERROR_OUT("A %zu byte record is too large for a UDP datagram; use smaller grids.\n", len);
+			u->warned = 1;
+		}
+	}
+
+	for(i = 0; i < sv->nstreams; i++) {
+		st = &sv->streams[i];
+		tmp = st->prev;
+		st->prev = st->cur;
+		st->cur = tmp;
+	}
+	sv->have_prev = 1;
+}
+
+// Accepts subscribers and sends them frames.  Runs until stop_server().
+static void *serve_thread(void *arg)
+{
+	struct server *sv = arg;
+	struct epoll_event ev[16];
+	struct serve_client *c;
+	int n, i, l;
+
+	while(!atomic_load(&sv->quit)) {
+		n = epoll_wait(sv->epfd, ev, sizeof(ev) / sizeof(ev[0]), -1);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			ERRNO_OUT("Error waiting for server events");
+			break;
+		}
+
+		for(i = 0; i < n; i++) {
+			// The event fd and listening sockets point at their fd
+			if(ev[i].data.ptr == &sv->event_fd) {
+				serve_publish(sv);
+				continue;
+			}
+			for(l = 0; l < sv->nlisten && ev[i].data.ptr != &sv->listen_fds[l]; l++) {
+			}
+			if(l < sv->nlisten) {
+				accept_client(sv, sv->listen_fds[l], sv->listen_streams[l]);
+				continue;
+			}
+
+			// serve_publish() may have closed a subscriber with an event
+			// later in this batch
+			for(c = sv->clients; c != NULL && c != ev[i].data.ptr; c = c->next) {
+			}
+			if(c == NULL) {
+				continue;
+			}
+
+			if(ev[i].events & (EPOLLERR | EPOLLHUP)) {
+				close_client(sv, c);
+			} else if((ev[i].events & EPOLLIN) && read_client(c)) {
+				close_client(sv, c);
+			} else if((ev[i].events & EPOLLOUT) && flush_client(sv, c)) {
+				close_client(sv, c);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+// Opens a listening socket or UDP destination for --serve, serving a stream.
+static int open_serve_addr(struct server *sv, const char *addr, struct serve_stream *stream)
+{
+	struct addrinfo hints, *addrs, *ai;
+	struct sockaddr_un sun;
+	struct stat st;
+	struct epoll_event ev;
+	char host[256], *port;
+	int fd = -1, udp, ret, one = 1;
+
+	if(!strncmp(addr, "unix:", 5)) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", addr + 5);
+
+		// Replace a socket left behind by an earlier run
+		if(!stat(sun.sun_path, &st) && S_ISSOCK(st.st_mode)) {
+			unlink(sun.sun_path);
+		}
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if(fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 16)) {
+			ERRNO_OUT("Error listening on %s", addr + 5);
+			if(fd >= 0) {
+				close(fd);
+			}
+			return -1;
+		}
+
+		sv->unix_paths[sv->npaths++] = strdup(sun.sun_path);
+	} else if(!strncmp(addr, "tcp:", 4) || !strncmp(addr, "udp:", 4)) {
+		udp = addr[0] == 'u';
+		if(split_host_port(addr + 4, host, sizeof(host), &port)) {
+			return -1;
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
+		hints.ai_flags = udp ? 0 : AI_PASSIVE;
+		ret = getaddrinfo(*host ? host : NULL, port, &hints, &addrs);
+		if(ret) {
+			ERROR_OUT("Error looking up %s: %s\n", addr + 4, gai_strerror(ret));
+			return -1;
+		}
+
+		// Bind TCP, or aim UDP at the destination so send() can be used
+		for(ai = addrs; ai != NULL; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					ai->ai_protocol);
+			if(fd < 0) {
+				continue;
+			}
+			if(udp) {
+				if(!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+					break;
+				}
+			} else {
+				setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+				if(!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 16)) {
+					break;
+				}
+			}
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(addrs);
+
+		if(fd < 0) {
+			ERRNO_OUT("Error %s %s", udp ? "sending to" : "listening on", addr + 4);
+			return -1;
+		}
+
+		if(udp) {
+			sv->udp[sv->nudp].fd = fd;
+			sv->udp[sv->nudp].stream = stream;
+			sv->udp[sv->nudp].need_key = 1;
+			sv->nudp++;
+			return 0;
+		}
+	} else {
+		ERROR_OUT("Invalid server address %s, expected tcp:[HOST]:PORT, udp:HOST:PORT, or unix:PATH.\n",
+				addr);
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &sv->listen_fds[sv->nlisten];
+	if(epoll_ctl(sv->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		ERRNO_OUT("Error watching %s", addr);
+		close(fd);
+		return -1;
+	}
+	sv->listen_streams[sv->nlisten] = stream;
+	sv->listen_fds[sv->nlisten++] = fd;
+
+	return 0;
+}
+
+// Stops the server thread, disconnects subscribers, and frees the server.
+static void stop_server(struct kinradar_data *data)
+{
+	struct server *sv = data->server;
+	uint64_t one = 1;
+	int i;
+
+	if(sv == NULL) {
+		return;
+	}
+	data->server = NULL;
+
+	if(sv->started) {
+		atomic_store(&sv->quit, 1);
+		if(write(sv->event_fd, &one, sizeof(one)) < 0) {
+			ERRNO_OUT("Error stopping server thread");
+		}
+		pthread_join(sv->thread, NULL);
+	}
+
+	while(sv->clients != NULL) {
+		close_client(sv, sv->clients);
+	}
+	for(i = 0; i < sv->nlisten; i++) {
+		close(sv->listen_fds[i]);
+	}
+	for(i = 0; i < sv->npaths; i++) {
+		unlink(sv->unix_paths[i]);
+		free(sv->unix_paths[i]);
+	}
+	for(i = 0; i < sv->nudp; i++) {
+		close(sv->udp[i].fd);
+	}
+	if(sv->event_fd >= 0) {
+		close(sv->event_fd);
+	}
+	if(sv->epfd >= 0) {
+		close(sv->epfd);
+	}
+
+	pthread_mutex_destroy(&sv->lock);
+	for(i = 0; i < sv->nstreams; i++) {
+		free(sv->streams[i].next);
+		free(sv->streams[i].cur);
+		free(sv->streams[i].prev);
+		free(sv->streams[i].zero);
+		free(sv->streams[i].key);
+		free(sv->streams[i].delta);
+	}
+	free(sv);
+}
+
+// Returns the server's stream of a pyramid level, adding one if there isn't
+// one yet.  The grids must already be allocated.  Returns NULL on error.
+static struct serve_stream *serve_stream(struct kinradar_data *data, int level)
+{
+	struct server *sv = data->server;
+	struct serve_stream *st;
+	size_t recsize;
+	int i;
+
+	for(i = 0; i < sv->nstreams; i++) {
+		if(sv->streams[i].level == level) {
+			return &sv->streams[i];
+		}
+	}
+
+	if(want_level(data, level)) {
+		return NULL;
+	}
+
+	st = &sv->streams[sv->nstreams++];
+	st->level = level;
+	st->ncells = level_cells(data, level);
+	recsize = sizeof(struct grid_record) + (3 * st->ncells + 2) * sizeof(uint16_t);
+	st->next = calloc(st->ncells, sizeof(uint16_t));
+	st->cur = calloc(st->ncells, sizeof(uint16_t));
+	st->prev = calloc(st->ncells, sizeof(uint16_t));
+	st->zero = calloc(st->ncells, sizeof(uint16_t));
+	st->key = malloc(recsize);
+	st->delta = malloc(recsize);
+	if(!st->next || !st->cur || !st->prev || !st->zero || !st->key || !st->delta) {
+		ERRNO_OUT("Error allocating level %d server buffers", level);
+		return NULL;
+	}
+
+	return st;
+}
+
+// Cuts the level off a --serve ADDRESS@LEVEL in place, and stores it in
+// *level, which is 0 if no level is given.  Returns -1 if the level is
+// invalid.
+static int split_serve_level(char *addr, int *level)
+{
+	char *at, *end;
+
+	*level = 0;
+
+	at = strrchr(addr, '@');
+	if(at == NULL) {
+		return 0;
+	}
+
+	*level = strtol(at + 1, &end, 10);
+	if(end == at + 1 || *end || *level < 0 || *level > MAX_LEVELS) {
+		ERROR_OUT("Invalid level in %s, expected ADDRESS@LEVEL with a level of 0 to %d.\n",
+				addr, MAX_LEVELS);
+		return -1;
+	}
+	*at = 0;
+
+	return 0;
+}
+
+// Starts publishing data's grids on each of the n --serve addresses, each
+// at the pyramid level given with it.  The grids must already be allocated.
+static int start_server(struct kinradar_data *data, char *const *addrs, int n)
+{
+	struct server *sv;
+	struct serve_stream *st;
+	struct epoll_event ev;
+	int i, level;
+
+	sv = calloc(1, sizeof(*sv));
+	if(sv == NULL) {
+		ERRNO_OUT("Error allocating server");
+		return -1;
+	}
+	data->server = sv;
+	sv->epfd = -1;
+	sv->event_fd = -1;
+	pthread_mutex_init(&sv->lock, NULL);
+
+	sv->epfd = epoll_create1(EPOLL_CLOEXEC);
+	sv->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(sv->epfd < 0 || sv->event_fd < 0) {
+		ERRNO_OUT("Error setting up server");
+		stop_server(data);
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &sv->event_fd;
+	if(epoll_ctl(sv->epfd, EPOLL_CTL_ADD, sv->event_fd, &ev)) {
+		ERRNO_OUT("Error watching server events");
+		stop_server(data);
+		return -1;
+	}
+
+	for(i = 0; i < n; i++) {
+		if(split_serve_level(addrs[i], &level) || (st = serve_stream(data, level)) == NULL ||
+				open_serve_addr(sv, addrs[i], st)) {
+			stop_server(data);
+			return -1;
+		}
+	}
+
+	if(start_thread(&sv->thread, serve_thread, sv)) {
+		ERROR_OUT("Error starting server thread.\n");
+		stop_server(data);
+		return -1;
+	}
+	sv->started = 1;
+
+	// Subscribers get every grid, whatever is displayed
+	want_products(data, WANT_RECORD);
+
+	return 0;
+}
+
+// Writes all len bytes of buf to a grid history.  Returns -1 on error.
+static int history_write(struct grid_history *h, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while(len) {
+		ret = write(h->fd, p, len);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+// Encodes and writes the frame in cur, as a keyframe if one is due.
+static void write_history_frame(struct grid_history *h)
+{
+	struct grid_record *hdr = (struct grid_record *)h->rec;
+	struct history_key *keys;
+	uint16_t *tmp;
+	size_t len;
+	int key = !h->written || h->since_key >= HISTORY_KEY_INTERVAL;
+
+	if(key) {
+		if(h->nkeys == h->keys_size) {
+			keys = realloc(h->keys, (h->keys_size * 2 + 64) * sizeof(*keys));
+			if(keys == NULL) {
+				ERRNO_OUT("Error growing %s's keyframe index; recording stopped", h->path);
+				h->failed = 1;
+				return;
+			}
+			h->keys = keys;
+			h->keys_size = h->keys_size * 2 + 64;
+		}
+		h->keys[h->nkeys++] = (struct history_key){
+			.time_ns = hdr->time_ns,
+			.offset = h->offset,
+			.frame = hdr->frame,
+		};
+		hdr->flags = DELTA_KEY;
+		h->since_key = 0;
+	}
+	len = encode_delta(h->rec, h->cur, key ? h->zero : h->prev, h->ncells);
+
+	if(history_write(h, h->rec, len)) {
+		ERRNO_OUT("Error writing %s; recording stopped", h->path);
+		h->failed = 1;
+		return;
+	}
+	h->offset += len;
+	h->since_key++;
+	h->written++;
+
+	tmp = h->prev;
+	h->prev = h->cur;
+	h->cur = tmp;
+}
+
+// Writes frames from history_frame() until stop_history().
+static void *history_thread(void *arg)
+{
+	struct grid_history *h = arg;
+	uint16_t *tmp;
+
+	pthread_mutex_lock(&h->lock);
+	for(;;) {
+		while(!h->have_next && !h->quit) {
+			pthread_cond_wait(&h->cond, &h->lock);
+		}
+
+		// The last frame is written before quitting
+		if(!h->have_next) {
+			break;
+		}
+		tmp = h->cur;
+		h->cur = h->next;
+		h->next = tmp;
+		memcpy(h->rec, &h->next_hdr, sizeof(h->next_hdr));
+		h->have_next = 0;
+		pthread_cond_broadcast(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+
+		if(!h->failed) {
+			write_history_frame(h);
+		}
+
+		pthread_mutex_lock(&h->lock);
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	return NULL;
+}
+
+// Stops the history thread, appends the keyframe index, and closes the grid
+// history.
+static void stop_history(struct kinradar_data *data)
+{
+	struct grid_history *h = data->history;
+	struct history_tail tail = {
+		.magic = HISTORY_INDEX_MAGIC,
+	};
+
+	if(h == NULL) {
+		return;
+	}
+	data->history = NULL;
+
+	if(h->started) {
+		pthread_mutex_lock(&h->lock);
+		h->quit = 1;
+		pthread_cond_broadcast(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+		pthread_join(h->thread, NULL);
+	}
+
+	if(h->fd >= 0 && !h->failed) {
+		tail.nkeys = h->nkeys;
+		if(history_write(h, h->keys, h->nkeys * sizeof(*h->keys)) ||
+				history_write(h, &tail, sizeof(tail))) {
+			ERRNO_OUT("Error writing %s's keyframe index", h->path);
+		}
+		INFO_OUT("Recorded %u frames of grids (%.1fMB) to %s, dropping %u.\n",
+				h->written, h->offset / 1e6, h->path, h->dropped);
+	}
+	if(h->fd >= 0) {
+		close(h->fd);
+	}
+
+	pthread_cond_destroy(&h->cond);
+	pthread_mutex_destroy(&h->lock);
+	free(h->next);
+	free(h->cur);
+	free(h->prev);
+	free(h->zero);
+	free(h->rec);
+	free(h->keys);
+	free(h);
+}
+
+// Starts recording data's grids to a new grid history at path.  The grids
+// must already be allocated.
+static int start_history(struct kinradar_data *data, const char *path)
+{
+	struct grid_history_header hdr = {
+		.magic = HISTORY_MAGIC,
+		.version = HISTORY_VERSION,
+		.header_size = sizeof(struct grid_history_header),
+		.zmin = data->xgrid.zmin,
+		.zmax = data->xgrid.zmax,
+		.xwmax = data->xgrid.wmax,
+		.ywmax = data->ygrid.wmax,
+		.key_interval = HISTORY_KEY_INTERVAL,
+	};
+	struct grid_history *h;
+	int ret;
+
+	h = calloc(1, sizeof(*h));
+	if(h == NULL) {
+		ERRNO_OUT("Error allocating grid history");
+		return -1;
+	}
+	data->history = h;
+	h->path = path;
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->cond, NULL);
+
+	h->ncells = (1 + data->nbands) * data->xgrid.udiv * data->xgrid.vdiv +
+		data->ygrid.udiv * data->ygrid.vdiv;
+	h->next = calloc(h->ncells, sizeof(uint16_t));
+	h->cur = calloc(h->ncells, sizeof(uint16_t));
+	h->prev = calloc(h->ncells, sizeof(uint16_t));
+	h->zero = calloc(h->ncells, sizeof(uint16_t));
+	h->rec = malloc(sizeof(struct grid_record) + (3 * h->ncells + 2) * sizeof(uint16_t));
+	if(!h->next || !h->cur || !h->prev || !h->zero || !h->rec) {
+		ERRNO_OUT("Error allocating grid history");
+		h->fd = -1;
+		stop_history(data);
+		return -1;
+	}
+
+	h->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(h->fd < 0) {
+		ERRNO_OUT("Error opening %s for recording grids", path);
+		stop_history(data);
+		return -1;
+	}
+	if(history_write(h, &hdr, sizeof(hdr))) {
+		ERRNO_OUT("Error writing header to %s", path);
+		h->failed = 1;
+		stop_history(data);
+		return -1;
+	}
+	h->offset = sizeof(hdr);
+
+	ret = start_thread(&h->thread, history_thread, h);
+	if(ret) {
+		errno = ret;
+		ERRNO_OUT("Error starting grid history thread");
+		h->failed = 1;
+		stop_history(data);
+		return -1;
+	}
+	h->started = 1;
+
+	want_products(data, WANT_RECORD);
+
+	return 0;
+}
+
+// Builds the grids for p, with their lookup tables and everything sized by
+// them, away from the binning thread.  They are allocated in a kinradar_data
+// of their own, given data's settings that can't change while running.
+static struct grid_config *build_config(const struct kinradar_data *data,
+		const struct control_params *p)
+{
+	struct grid_config *cfg;
+	struct kinradar_data *g;
+	int i;
+
+	cfg = calloc(1, sizeof(*cfg));
+	if(cfg == NULL) {
+		return NULL;
+	}
+	cfg->params = *p;
+	g = cfg->grids = calloc(1, sizeof(*g));
+	if(g == NULL) {
+		free_config(cfg);
+		return NULL;
+	}
+
+	g->nbands = data->nbands;
+	memcpy(g->band_top, data->band_top, sizeof(g->band_top));
+	memcpy(g->band_bot, data->band_bot, sizeof(g->band_bot));
+	memcpy(g->band_slice, data->band_slice, sizeof(g->band_slice));
+	g->nslices = data->nslices;
+	g->kernel = data->kernel;
+	g->decay = data->decay;
+	g->track_min = data->track_min;
+	g->nworkers = data->nworkers;
+	g->headless = data->headless;
+	g->disp_mode = p->disp_mode;
+	g->ytop = p->ytop;
+	g->ybot = p->ybot;
+
+	g->xgrid.udiv = p->xudiv;
+	g->xgrid.vdiv = p->xvdiv;
+	g->ygrid.udiv = p->yudiv;
+	g->ygrid.vdiv = p->yvdiv;
+	g->xgrid.zmin = g->ygrid.zmin = p->zmin;
+	g->xgrid.zmax = g->ygrid.zmax = p->zmax;
+	xgrid_extent(data, &g->xgrid, p->zmax);
+	ygrid_extent(data, &g->ygrid, p->zmax);
+
+	// A different display mode may need different views, and a different
+	// level a different pyramid
+	want_products(g, output_products(g));
+	if(data->server != NULL || data->history != NULL) {
+		want_products(g, WANT_RECORD);
+	}
+	if(g->track_min) {
+		want_products(g, WANT_XGRID);
+	}
+	want_level(g, p->level);
+	for(i = 0; data->server != NULL && i < data->server->nstreams; i++) {
+		want_level(g, data->server->streams[i].level);
+	}
+
+	if(alloc_grids(g) ||
+			init_grid_lut(&g->xgrid, data->depth_lut, FREENECT_FRAME_W, 0, xworld) ||
+			init_grid_lut(&g->ygrid, data->depth_lut, FREENECT_FRAME_H, 1, yworld)) {
+		free_config(cfg);
+		return NULL;
+	}
+
+	return cfg;
+}
+
+// Returns whether settings p would give records of a different size than old.
+static int record_size_changes(const struct control_params *p, const struct control_params *old)
+{
+	return p->xudiv != old->xudiv || p->xvdiv != old->xvdiv ||
+		p->yudiv != old->yudiv || p->yvdiv != old->yvdiv || p->level != old->level;
+}
+
+// Applies one line of --control commands to a copy of the current settings
+// in p.  Commands are the option letters, with or without a dash, and with
+// any value attached or as the next word: "g 40 -Z3.5 v".  Nothing changes
+// unless the whole line is valid.
+static int parse_command(const struct kinradar_data *data, const struct control *ctl,
+		char *line, struct control_params *p, char *err, size_t errsize)
+{
+	char *tok, *val, *save, *end;
+	long n = 0;
+	float f = 0.0f;
+	int opt;
+
+	*p = ctl->params;
+	for(tok = strtok_r(line, " \t\r", &save); tok != NULL; tok = strtok_r(NULL, " \t\r", &save)) {
+		if(*tok == '-') {
+			tok++;
+		}
+		if(!strcmp(tok, "show")) {
+			continue;
+		}
+
+		opt = *tok;
+		if(opt && strchr("gGyYzZl", opt)) {
+			val = tok[1] ? tok + 1 : strtok_r(NULL, " \t\r", &save);
+			if(val == NULL) {
+				snprintf(err, errsize, "-%c needs a value", opt);
+				return -1;
+			}
+			errno = 0;
+			if(opt == 'z' || opt == 'Z') {
+				f = strtof(val, &end);
+			} else {
+				n = strtol(val, &end, 10);
+			}
+			if(errno || end == val || *end) {
+				snprintf(err, errsize, "invalid value for -%c: %s", opt, val);
+				return -1;
+			}
+		} else if(!opt || tok[1]) {
+			snprintf(err, errsize, "unknown command: %s", tok);
+			return -1;
+		}
+
+		// Image rows are clamped just like the options
+		if(opt == 'y' || opt == 'Y') {
+			if(n < 0) {
+				n = 0;
+			} else if(n >= FREENECT_FRAME_H) {
+				n = FREENECT_FRAME_H - 1;
+			}
+		}
+
+		switch(opt) {
+			case 'g':
+				p->xudiv = n > CONTROL_MAX_DIVS ? 0 : n;
+				p->yvdiv = p->xudiv;
+				break;
+			case 'G':
+				p->xvdiv = n > CONTROL_MAX_DIVS ? 0 : n;
+				p->yudiv = p->xvdiv;
+				break;
+			case 'y':
+				p->ytop = n;
+				break;
+			case 'Y':
+				p->ybot = n;
+				break;
+			case 'z':
+				p->zmin = f;
+				break;
+			case 'Z':
+				p->zmax = f;
+				break;
+			case 'l':
+				p->level = n < 0 || n > MAX_LEVELS ? -1 : n;
+				break;
+			case 'h':
+				p->disp_mode = SHOW_HORIZ;
+				break;
+			case 'v':
+				p->disp_mode = SHOW_VERT;
+				break;
+			case 'b':
+				p->disp_mode = SHOW_BOTH;
+				break;
+			default:
+				snprintf(err, errsize, "unknown command: %s", tok);
+				return -1;
+		}
+	}
+
+	if(p->xudiv < 1 || p->xvdiv < 1) {
+		snprintf(err, errsize, "grid divisions must be 1 to %d", CONTROL_MAX_DIVS);
+		return -1;
+	}
+	if(!(p->zmin >= 0.0f && p->zmax > p->zmin)) {
+		snprintf(err, errsize, "depth range must have 0 <= zmin < zmax");
+		return -1;
+	}
+	if(p->level < 0) {
+		snprintf(err, errsize, "pyramid level must be 0 to %d", MAX_LEVELS);
+		return -1;
+	}
+
+	// Headless streams, subscribers, and grid histories are promised one
+	// record size, and subscribers were sent theirs when they connected
+	if((data->headless || data->server != NULL || data->history != NULL) &&
+			record_size_changes(p, &ctl->params)) {
+		snprintf(err, errsize, "grid size and level can't change while writing or serving records");
+		return -1;
+	}
+
+	// A grid history's header also gives one depth range for the whole file
+	if(data->history != NULL && (p->zmin != ctl->params.zmin || p->zmax != ctl->params.zmax)) {
+		snprintf(err, errsize, "depth range can't change while recording grids");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Runs one line from the control channel and replies with "ok" and the
+// resulting settings, or "error:" and why nothing changed.
+static void run_command(struct kinradar_data *data, struct control *ctl, char *line)
+{
+	static const char *const modes[] = { "b", "h", "v" };
+	struct control_params p;
+	struct grid_config *cfg = NULL;
+	char reply[CONTROL_LINE], err[128];
+	int len, changed;
+
+	// The grids retired by the last reconfiguration are freed here, off
+	// the binning thread
+	free_config(atomic_exchange(&data->config_done, NULL));
+
+	if(parse_command(data, ctl, line, &p, err, sizeof(err))) {
+		len = snprintf(reply, sizeof(reply), "error: %s\n", err);
+	} else if((changed = memcmp(&p, &ctl->params, sizeof(p))) &&
+			(cfg = build_config(data, &p)) == NULL) {
+		len = snprintf(reply, sizeof(reply), "error: out of memory\n");
+	} else {
+		// Replaces any config the binning thread hasn't picked up yet
+		if(changed) {
+			free_config(atomic_exchange(&data->config_next, cfg));
+			ctl->params = p;
+		}
+		len = snprintf(reply, sizeof(reply), "ok -g %d -G %d -y %d -Y %d -z %.3f -Z %.3f -l %d %s\n",
+				p.xudiv, p.xvdiv, p.ytop, p.ybot, p.zmin, p.zmax, p.level, modes[p.disp_mode]);
+	}
+
+	// Replies to stdin go to stderr, to stay out of the way of the display
+	if(write(ctl->fd == STDIN_FILENO ? STDERR_FILENO : ctl->fd, reply, len) < 0) {
+		ERRNO_OUT("Error replying to control command");
+	}
+}
+
+// Reads control commands, from one connection at a time, until
+// stop_control().
+static void *control_thread(void *arg)
+{
+	struct kinradar_data *data = arg;
+	struct control *ctl = data->control;
+	struct epoll_event ev;
+	char *nl;
+	ssize_t ret;
+	int epfd;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0) {
+		ERRNO_OUT("Error creating control epoll");
+		return NULL;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = ctl->quit_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, ctl->quit_fd, &ev);
+	ev.data.fd = ctl->fd >= 0 ? ctl->fd : ctl->listen_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+
+	for(;;) {
+		if(epoll_wait(epfd, &ev, 1, -1) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			ERRNO_OUT("Error waiting for control commands");
+			break;
+		}
+		if(ev.data.fd == ctl->quit_fd) {
+			break;
+		}
+
+		// Only one client is listened to at a time
+		if(ev.data.fd == ctl->listen_fd) {
+			ctl->fd = accept4(ctl->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if(ctl->fd < 0) {
+				ERRNO_OUT("Error accepting control connection");
+				continue;
+			}
+			ctl->len = 0;
+			epoll_ctl(epfd, EPOLL_CTL_DEL, ctl->listen_fd, NULL);
+			ev.data.fd = ctl->fd;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, ctl->fd, &ev);
+			continue;
+		}
+
+		ret = read(ctl->fd, ctl->line + ctl->len, sizeof(ctl->line) - 1 - ctl->len);
+		if(ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if(ret <= 0) {
+			if(ret < 0) {
+				ERRNO_OUT("Error reading control commands");
+			}
+			epoll_ctl(epfd, EPOLL_CTL_DEL, ctl->fd, NULL);
+
+			// The end of stdin ends control, but a socket takes a new client
+			if(ctl->listen_fd < 0) {
+				ctl->fd = -1;
+				break;
+			}
+			close(ctl->fd);
+			ctl->fd = -1;
+			ev.data.fd = ctl->listen_fd;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, ctl->listen_fd, &ev);
+			continue;
+		}
+
+		ctl->len += ret;
+		while((nl = memchr(ctl->line, '\n', ctl->len)) != NULL) {
+			*nl = 0;
+			run_command(data, ctl, ctl->line);
+			ctl->len -= nl + 1 - ctl->line;
+			memmove(ctl->line, nl + 1, ctl->len);
+		}
+		if(ctl->len == sizeof(ctl->line) - 1) {
+			ERROR_OUT("Discarding control command longer than %d bytes.\n", CONTROL_LINE - 1);
+			ctl->len = 0;
+		}
+	}
+
+	close(epfd);
+	return NULL;
+}
+
+// Stops the control thread and frees any reconfiguration not yet applied.
+static void stop_control(struct kinradar_data *data)
+{
+	struct control *ctl = data->control;
+	uint64_t one = 1;
+
+	if(ctl == NULL) {
+		return;
+	}
+	data->control = NULL;
+
+	if(ctl->started) {
+		if(write(ctl->quit_fd, &one, sizeof(one)) < 0) {
+			ERRNO_OUT("Error stopping control thread");
+		}
+		pthread_join(ctl->thread, NULL);
+	}
+
+	if(ctl->fd > STDIN_FILENO) {
+		close(ctl->fd);
+	}
+	if(ctl->listen_fd >= 0) {
+		close(ctl->listen_fd);
+	}
+	if(ctl->quit_fd >= 0) {
+		close(ctl->quit_fd);
+	}
+	if(ctl->unix_path != NULL) {
+		unlink(ctl->unix_path);
+		free(ctl->unix_path);
+	}
+	free_config(atomic_exchange(&data->config_next, NULL));
+	free_config(atomic_exchange(&data->config_done, NULL));
+	free(ctl);
+}
+
+// Starts taking --control commands from addr: "unix:PATH" to listen on a Unix
+// socket, or "-" for stdin.  Must be called after start_server(), as grid
+// sizes are locked while serving.
+static int start_control(struct kinradar_data *data, const char *addr)
+{
+	struct control *ctl;
+	struct sockaddr_un sun;
+	struct stat st;
+
+	ctl = calloc(1, sizeof(*ctl));
+	if(ctl == NULL) {
+		ERRNO_OUT("Error allocating control channel");
+		return -1;
+	}
+	data->control = ctl;
+	ctl->listen_fd = -1;
+	ctl->fd = -1;
+	ctl->params = (struct control_params){
+		.xudiv = data->xgrid.udiv,
+		.xvdiv = data->xgrid.vdiv,
+		.yudiv = data->ygrid.udiv,
+		.yvdiv = data->ygrid.vdiv,
+		.ytop = data->ytop,
+		.ybot = data->ybot,
+		.zmin = data->xgrid.zmin,
+		.zmax = data->xgrid.zmax,
+		.disp_mode = data->disp_mode,
+		.level = data->level,
+	};
+
+	ctl->quit_fd = eventfd(0, EFD_CLOEXEC);
+	if(ctl->quit_fd < 0) {
+		ERRNO_OUT("Error creating control event");
+		stop_control(data);
+		return -1;
+	}
+
+	if(!strcmp(addr, "-")) {
+		ctl->fd = STDIN_FILENO;
+	} else if(!strncmp(addr, "unix:", 5)) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", addr + 5);
+
+		// Replace a socket left behind by an earlier run
+		if(!stat(sun.sun_path, &st) && S_ISSOCK(st.st_mode)) {
+			unlink(sun.sun_path);
+		}
+
+		ctl->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(ctl->listen_fd < 0 || bind(ctl->listen_fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+				listen(ctl->listen_fd, 1)) {
+			ERRNO_OUT("Error listening on %s", addr + 5);
+			stop_control(data);
+			return -1;
+		}
+		ctl->unix_path = strdup(sun.sun_path);
+	} else {
+		ERROR_OUT("Invalid control address %s, expected unix:PATH or -.\n", addr);
+		stop_control(data);
+		return -1;
+	}
+
+	if(start_thread(&ctl->thread, control_thread, data)) {
+		ERROR_OUT("Error starting control thread.\n");
+		stop_control(data);
+		return -1;
+	}
+	ctl->started = 1;
+
+	return 0;
+}
+
+
+// Opens the headless output destination: "-" for stdout, "unix:PATH" or
+// "tcp:HOST:PORT" to connect to a listening socket, or a file name to create
+// or truncate.  When writing records to stdout, stdout is moved to a new file
+// descriptor and fd 1 is pointed at stderr, so that messages don't corrupt
+// the stream.
+static int open_output(struct kinradar_data *data, const char *dest)
+{
+	struct addrinfo hints, *addrs, *ai;
+	struct sockaddr_un sun;
+	char host[256], *port;
+	int fd = -1, ret;
+
+	if(!strcmp(dest, "-")) {
+		fd = dup(STDOUT_FILENO);
+		if(fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			ERRNO_OUT("Error moving stdout");
+			return -1;
+		}
+	} else if(!strncmp(dest, "unix:", 5)) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", dest + 5);
+
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0 || connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+			ERRNO_OUT("Error connecting to %s", dest + 5);
+			return -1;
+		}
+	} else if(!strncmp(dest, "tcp:", 4)) {
+		if(split_host_port(dest + 4, host, sizeof(host), &port)) {
+			return -1;
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		ret = getaddrinfo(host, port, &hints, &addrs);
+		if(ret) {
+			ERROR_OUT("Error looking up %s: %s\n", host, gai_strerror(ret));
+			return -1;
+		}
+
+		for(ai = addrs; ai != NULL; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if(fd >= 0 && !connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+				break;
+			}
+			if(fd >= 0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(addrs);
+
+		if(fd < 0) {
+			ERRNO_OUT("Error connecting to %s", dest + 4);
+			return -1;
+		}
+	} else {
+		fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) {
+			ERRNO_OUT("Error opening %s", dest);
+			return -1;
+		}
+	}
+
+	// A reader going away is reported as a write error instead
+	signal(SIGPIPE, SIG_IGN);
+
+	data->out.fd = fd;
+	data->headless = 1;
+
+	return 0;
+}
+
+// Reads a decimal number from a PGM header, skipping whitespace and comments.
+static int pgm_int(FILE *f, int *val)
+{
+	int c;
+
+	while((c = getc(f)) == '#' || isspace(c)) {
+		if(c == '#') {
+			while((c = getc(f)) != '\n' && c != EOF) {
+			}
+		}
+	}
+	ungetc(c, f);
+
+	return fscanf(f, "%d", val) == 1 ? 0 : -1;
+}
+
+// Reads the pixel mask from a binary PGM the size of a depth frame (--mask).
+// Nonzero pixels are active.
+static int load_mask(struct kinradar_data *data, const char *path)
+{
+	FILE *f;
+	int w, h, maxval, ok;
+
+	f = fopen(path, "rb");
+	if(f == NULL) {
+		ERRNO_OUT("Error opening %s", path);
+		return -1;
+	}
+
+	data->pixel_mask = malloc(FREENECT_FRAME_PIX);
+	if(data->pixel_mask == NULL) {
+		ERRNO_OUT("Error allocating pixel mask");
+		fclose(f);
+		return -1;
+	}
+
+	// A single whitespace character separates the header from the pixels
+	ok = getc(f) == 'P' && getc(f) == '5' &&
+		!pgm_int(f, &w) && !pgm_int(f, &h) && !pgm_int(f, &maxval) && isspace(getc(f)) &&
+		w == FREENECT_FRAME_W && h == FREENECT_FRAME_H && maxval > 0 && maxval < 256 &&
+		fread(data->pixel_mask, FREENECT_FRAME_PIX, 1, f) == 1;
+	fclose(f);
+
+	if(!ok) {
+		ERROR_OUT("%s is not a %dx%d binary PGM with 8-bit pixels.\n",
+				path, FREENECT_FRAME_W, FREENECT_FRAME_H);
+		free(data->pixel_mask);
+		data->pixel_mask = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+// Iterations of the inverse distortion solved for each pixel's ray
+#define UNDISTORT_ITERATIONS 20
+
+// Reads a depth camera calibration (--calibration) and builds data's ray
+// table from it.  Each line is a name and value, and # starts a comment.
+// fx, fy, cx, and cy are the intrinsics in pixels, and k1, k2, k3, p1, and p2
+// the Brown-Conrady lens distortion; any not given are those of the ideal
+// camera.  "depth A B" replaces the raw depth formula with 1 / (A * raw + B)
+// meters, the model used by most Kinect calibration tools.
+static int load_calibration(struct kinradar_data *data, const char *path)
+{
+	float fx = FREENECT_FRAME_W / 2 / .70021f, fy = fx;
+	float cx = FREENECT_FRAME_W / 2, cy = FREENECT_FRAME_H / 2;
+	float k1 = 0.0f, k2 = 0.0f, k3 = 0.0f, p1 = 0.0f, p2 = 0.0f;
+	const struct {
+		const char *name;
+		float *val;
+	} keys[] = {
+		{ "fx", &fx }, { "fy", &fy }, { "cx", &cx }, { "cy", &cy },
+		{ "k1", &k1 }, { "k2", &k2 }, { "k3", &k3 }, { "p1", &p1 }, { "p2", &p2 },
+	};
+	float a = 0.0f, b = 0.0f, val, xd, yd, xu, yu, r2, radial;
+	char line[256], name[16], *p;
+	int lineno = 0, n, i, x, y, have_depth = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if(f == NULL) {
+		ERRNO_OUT("Error opening %s", path);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		if((p = strchr(line, '#')) != NULL) {
+			*p = 0;
+		}
+
+		n = sscanf(line, "%15s %f %f", name, &val, &b);
+		if(n <= 0) {
+			continue;
+		}
+		if(!strcmp(name, "depth") && n == 3) {
+			a = val;
+			have_depth = 1;
+			continue;
+		}
+
+		for(i = 0; i < (int)(sizeof(keys) / sizeof(keys[0])); i++) {
+			if(!strcmp(name, keys[i].name) && n == 2) {
+				*keys[i].val = val;
+				break;
+			}
+		}
+		if(i == (int)(sizeof(keys) / sizeof(keys[0]))) {
+			ERROR_OUT("%s:%d: Invalid calibration line.\n", path, lineno);
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+
+	if(fx <= 0.0f || fy <= 0.0f) {
+		ERROR_OUT("%s: fx and fy must be positive.\n", path);
+		return -1;
+	}
+
+	data->rays = malloc(sizeof(*data->rays) * FREENECT_FRAME_PIX);
+	if(data->rays == NULL) {
+		ERRNO_OUT("Error allocating ray table");
+		return -1;
+	}
+
+	// Each pixel's undistorted direction, by fixed-point iteration
+	data->ray_xlo = data->ray_ylo = INFINITY;
+	data->ray_xhi = data->ray_yhi = -INFINITY;
+	for(y = 0; y < FREENECT_FRAME_H; y++) {
+		for(x = 0; x < FREENECT_FRAME_W; x++) {
+			xd = (x - cx) / fx;
+			yd = (y - cy) / fy;
+			xu = xd;
+			yu = yd;
+			for(i = 0; i < UNDISTORT_ITERATIONS; i++) {
+				r2 = xu * xu + yu * yu;
+				radial = 1.0f + r2 * (k1 + r2 * (k2 + r2 * k3));
+				xu = (xd - (2.0f * p1 * xu * yu + p2 * (r2 + 2.0f * xu * xu))) / radial;
+				yu = (yd - (p1 * (r2 + 2.0f * yu * yu) + 2.0f * p2 * xu * yu)) / radial;
+			}
+
+			data->rays[y * FREENECT_FRAME_W + x] = (struct pixel_ray){ -xu, -yu };
+			data->ray_xlo = fminf(data->ray_xlo, -xu);
+			data->ray_xhi = fmaxf(data->ray_xhi, -xu);
+			data->ray_ylo = fminf(data->ray_ylo, -yu);
+			data->ray_yhi = fmaxf(data->ray_yhi, -yu);
+		}
+	}
+
+	// The grids stay centered, so they reach as far as the wider side
+	data->ray_xmax = fmaxf(data->ray_xhi, -data->ray_xlo);
+	data->ray_ymax = fmaxf(data->ray_yhi, -data->ray_ylo);
+
+	// Raw values past the end of the model are out of range
+	if(have_depth) {
+		for(i = 0; i < 2047; i++) {
+			val = a * i + b;
+			data->depth_lut[i] = val > 0.0f ? 1.0f / val : INFINITY;
+		}
+	}
+
+	INFO_OUT("Calibration from %s reaches %.1f degrees left, %.1f right, %.1f up, and %.1f down.\n",
+			path, atanf(data->ray_xhi) * 180.0f / M_PI, -atanf(data->ray_xlo) * 180.0f / M_PI,
+			atanf(data->ray_yhi) * 180.0f / M_PI, -atanf(data->ray_ylo) * 180.0f / M_PI);
+
+	return 0;
+}
+
+// Starts learning the pixel mask from the next frames binned (--learn-mask).
+static int start_learning(struct kinradar_data *data, int frames)
+{
+	data->learn_min = malloc(sizeof(uint16_t) * FREENECT_FRAME_PIX);
+	data->learn_max = calloc(FREENECT_FRAME_PIX, sizeof(uint16_t));
+	if(data->learn_min == NULL || data->learn_max == NULL) {
+		ERRNO_OUT("Error allocating mask learning buffers");
+		return -1;
+	}
+	memset(data->learn_min, 0xff, sizeof(uint16_t) * FREENECT_FRAME_PIX);
+	data->learn_frames = frames;
+
+	return 0;
+}
+
+// Allocates the background model, to be learned from the next frames binned
+// (--background).  threshold is in raw depth units.
+static int start_background(struct kinradar_data *data, int frames, int threshold)
+{
+	size_t size = sizeof(uint16_t) * FREENECT_FRAME_PIX;
+
+	data->bg_model = alloc_cells(size * 2);
+	if(data->bg_model == NULL) {
+		ERRNO_OUT("Error allocating background model");
+		return -1;
+	}
+	memset(data->bg_model, 0xff, size);
+	data->fg_frame = data->bg_model + FREENECT_FRAME_PIX;
+	data->bg_learn = frames;
+	data->bg_threshold = threshold << BG_FRAC;
+
+	return 0;
+}
+
+// Opens or creates a raw depth capture file for --record, writing the file
+// header if the file is empty or checking it if not.
+static int open_record(struct kinradar_data *data, const char *path)
+{
+	struct depth_file_header hdr = {
+		.magic = DEPTH_MAGIC,
+		.version = DEPTH_VERSION,
+		.header_size = sizeof(struct depth_file_header),
+		.width = FREENECT_FRAME_W,
+		.height = FREENECT_FRAME_H,
+		.frame_size = sizeof(struct depth_file_frame) + FREENECT_DEPTH_11BIT_SIZE,
+	};
+	struct depth_file_header old;
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if(fd < 0 || fstat(fd, &st)) {
+		ERRNO_OUT("Error opening %s for recording", path);
+		return -1;
+	}
+
+	if(st.st_size == 0) {
+		if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+			ERRNO_OUT("Error writing header to %s", path);
+			close(fd);
+			return -1;
+		}
+	} else if(pread(fd, &old, sizeof(old), 0) != sizeof(old) || memcmp(&old, &hdr, sizeof(hdr))) {
+		ERROR_OUT("%s is not a compatible kinradar depth recording.\n", path);
+		close(fd);
+		return -1;
+	} else if((st.st_size - sizeof(hdr)) % hdr.frame_size) {
+		ERROR_OUT("%s ends with a partial frame; it will be skipped on replay.\n", path);
+	}
+
+	data->record_fd = fd;
+
+	return 0;
+}
+
+// Sleeps until the given CLOCK_MONOTONIC time in nanoseconds.
+static void sleep_until(int64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+// A memory-mapped --record file
+struct recording {
+	const char *map;
+	size_t size;
+	const struct depth_file_header *hdr;
+	size_t nframes;
+};
+
+// Maps and checks a --record file.
+static int open_recording(struct recording *rec, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st)) {
+		ERRNO_OUT("Error opening %s for replay", path);
+		return -1;
+	}
+	if((size_t)st.st_size < sizeof(*rec->hdr)) {
+		ERROR_OUT("%s is too short to be a depth recording.\n", path);
+		close(fd);
+		return -1;
+	}
+
+	rec->size = st.st_size;
+	rec->map = mmap(NULL, rec->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(rec->map == MAP_FAILED) {
+		ERRNO_OUT("Error mapping %s", path);
+		return -1;
+	}
+	madvise((void *)rec->map, rec->size, MADV_SEQUENTIAL);
+
+	rec->hdr = (const struct depth_file_header *)rec->map;
+	if(memcmp(rec->hdr->magic, DEPTH_MAGIC, sizeof(rec->hdr->magic)) ||
+			rec->hdr->version != DEPTH_VERSION ||
+			rec->hdr->width != FREENECT_FRAME_W || rec->hdr->height != FREENECT_FRAME_H ||
+			rec->hdr->frame_size != sizeof(struct depth_file_frame) + FREENECT_DEPTH_11BIT_SIZE ||
+			rec->hdr->header_size < sizeof(*rec->hdr) || rec->hdr->header_size > rec->size) {
+		ERROR_OUT("%s is not a compatible kinradar depth recording.\n", path);
+		munmap((void *)rec->map, rec->size);
+		return -1;
+	}
+
+	rec->nframes = (rec->size - rec->hdr->header_size) / rec->hdr->frame_size;
+
+	return 0;
+}
+
+// Returns the header of frame i of a recording.  The depth values follow it.
+static const struct depth_file_frame *recording_frame(struct recording *rec, size_t i)
+{
+	return (const struct depth_file_frame *)(rec->map + rec->hdr->header_size +
+			i * rec->hdr->frame_size);
+}
+
+static void close_recording(struct recording *rec)
+{
+	munmap((void *)rec->map, rec->size);
+}
+
+// Feeds every frame of a --record file through frame_in(), either at the
+// pace it was recorded or, if fast is nonzero, as fast as binning keeps up.
+// Frames are never dropped during replay.
+static int replay(struct kinradar_data *data, const char *path, int fast)
+{
+	const struct depth_file_frame *frame;
+	struct recording rec;
+	int64_t start, first = 0;
+	size_t i;
+
+	if(open_recording(&rec, path)) {
+		return -1;
+	}
+
+	INFO_OUT("Replaying %zu frames from %s.\n", rec.nframes, path);
+
+	start = now_ns();
+	for(i = 0; i < rec.nframes && !data->done; i++) {
+		frame = recording_frame(&rec, i);
+		if(i == 0) {
+			first = frame->time_ns;
+		}
+		if(!fast) {
+			sleep_until(start + frame->time_ns - first);
+		}
+
+		while(frame_in(data, NULL, (const uint16_t *)(frame + 1), frame->timestamp) && !data->done) {
+			// Wait for the binning thread to free a buffer
+			sleep_until(now_ns() + 1000000);
+		}
+
+		check_stats_request(data, 1);
+	}
+
+	close_recording(&rec);
+
+	return 0;
+}
+
+// A memory-mapped --record-grids file
+struct history {
+	const char *map;
+	size_t size;
+	struct grid_history_header hdr;
+	size_t end; // Offset after the last record
+	struct history_key *keys; // Every keyframe, in order
+	size_t nkeys;
+};
+
+// Copies the header of the record at off in a grid history to hdr, and
+// returns its size, or 0 if there isn't a whole record there.
+static size_t history_record(const struct history *h, size_t off, struct grid_record *hdr)
+{
+	size_t len;
+
+	memset(hdr, 0, sizeof(*hdr));
+	if(off >= h->end || h->end - off < offsetof(struct grid_record, nbands)) {
+		return 0;
+	}
+	len = h->end - off;
+
+	// Runs are read as uint16_t, so nothing may leave them misaligned
+	memcpy(hdr, h->map + off, offsetof(struct grid_record, nbands));
+	if(hdr->header_size > sizeof(*hdr) || hdr->header_size < offsetof(struct grid_record, nbands) ||
+			hdr->record_size < hdr->header_size || hdr->record_size > len ||
+			(hdr->header_size | hdr->record_size) & 1 ||
+			memcmp(hdr->magic, DELTA_MAGIC, sizeof(hdr->magic))) {
+		return 0;
+	}
+	memcpy(hdr, h->map + off, hdr->header_size);
+
+	return hdr->record_size;
+}
+
+static void close_history(struct history *h)
+{
+	free(h->keys);
+	munmap((void *)h->map, h->size);
+}
+
+// Maps a --record-grids file and finds its keyframes.
+static int open_history(struct history *h, const char *path)
+{
+	struct history_tail tail;
+	struct history_key *keys;
+	struct grid_record rec;
+	struct stat st;
+	size_t i, off, len, size = 0;
+	int fd;
+
+	memset(h, 0, sizeof(*h));
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st)) {
+		ERRNO_OUT("Error opening %s for replay", path);
+		return -1;
+	}
+	if((size_t)st.st_size < sizeof(h->hdr)) {
+		ERROR_OUT("%s is too short to be a grid history.\n", path);
+		close(fd);
+		return -1;
+	}
+
+	h->size = st.st_size;
+	h->map = mmap(NULL, h->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(h->map == MAP_FAILED) {
+		ERRNO_OUT("Error mapping %s", path);
+		return -1;
+	}
+
+	memcpy(&h->hdr, h->map, sizeof(h->hdr));
+	if(memcmp(h->hdr.magic, HISTORY_MAGIC, sizeof(h->hdr.magic)) || h->hdr.version != HISTORY_VERSION ||
+			h->hdr.header_size < sizeof(h->hdr) || h->hdr.header_size > h->size ||
+			h->hdr.header_size & 1) {
+		ERROR_OUT("%s is not a compatible kinradar grid history.\n", path);
+		munmap((void *)h->map, h->size);
+		return -1;
+	}
+
+	// The index is at the end, unless recording was cut short.  Records
+	// are only 2-byte aligned, so the index is copied out.
+	h->end = h->size;
+	if(h->size >= h->hdr.header_size + sizeof(tail)) {
+		memcpy(&tail, h->map + h->size - sizeof(tail), sizeof(tail));
+		if(!memcmp(tail.magic, HISTORY_INDEX_MAGIC, sizeof(tail.magic)) && tail.nkeys <=
+				(h->size - sizeof(tail) - h->hdr.header_size) / sizeof(struct history_key)) {
+			h->end = h->size - sizeof(tail) - tail.nkeys * sizeof(struct history_key);
+			h->nkeys = tail.nkeys;
+			h->keys = malloc(h->nkeys * sizeof(*h->keys) + 1);
+			if(h->keys == NULL) {
+				ERRNO_OUT("Error reading %s's keyframe index", path);
+				munmap((void *)h->map, h->size);
+				return -1;
+			}
+			memcpy(h->keys, h->map + h->end, h->nkeys * sizeof(*h->keys));
+
+			// Every key must point at a record
+			for(i = 0; i < h->nkeys; i++) {
+				if(h->keys[i].offset < h->hdr.header_size || h->keys[i].offset >= h->end ||
+						h->keys[i].offset & 1) {
+					ERROR_OUT("%s has a corrupt keyframe index.\n", path);
+					close_history(h);
+					return -1;
+				}
+			}
+			return 0;
+		}
+	}
+
+	ERROR_OUT("%s has no keyframe index; it may have been cut short.\n", path);
+	for(off = h->hdr.header_size; (len = history_record(h, off, &rec)) != 0; off += len) {
+		if(!(rec.flags & DELTA_KEY)) {
+			continue;
+		}
+		if(h->nkeys == size) {
+			size = size * 2 + 64;
+			keys = realloc(h->keys, size * sizeof(*keys));
+			if(keys == NULL) {
+				ERRNO_OUT("Error indexing %s", path);
+				close_history(h);
+				return -1;
+			}
+			h->keys = keys;
+		}
+		h->keys[h->nkeys++] = (struct history_key){
+			.time_ns = rec.time_ns,
+			.offset = off,
+			.frame = rec.frame,
+		};
+	}
+	h->end = off;
+
+	return 0;
+}
+
+// Fills data's grids and data->info from a decoded frame of a grid history,
+// with cells in record order.
+static void load_history_frame(struct kinradar_data *data, const uint16_t *cells,
+		const struct grid_record *rec)
+{
+	struct grid_info *grids[2 + MAX_BANDS];
+	int i, n, u, v;
+
+	n = record_grids(data, grids, &data->xgrid, &data->ygrid, data->bands);
+	for(i = 0; i < n; i++) {
+		for(v = 0; v < grids[i]->vdiv; v++) {
+			for(u = 0; u < grids[i]->udiv; u++) {
+				grids[i]->gridpop[CELL(grids[i], u, v)] = *cells++;
+			}
+		}
+	}
+	data->xgrid.popmax = rec->xpopmax;
+	data->ygrid.popmax = rec->ypopmax;
+	for(i = 0; i < data->nbands; i++) {
+		data->bands[i].popmax = rec->bands[i].popmax;
+	}
+
+	data->info.time_ns = rec->time_ns;
+	data->info.in_ns = now_ns();
+	data->info.timestamp = rec->timestamp;
+	data->info.frame = rec->frame;
+	data->info.oor_total = rec->oor_total;
+	data->info.ytop = data->ytop;
+	data->info.ybot = data->ybot;
+	data->info.disp_mode = data->disp_mode;
+	data->info.config = data->config;
+	data->info.level = data->level;
+
+	if(data->nlevels) {
+		build_pyramid(data);
+	}
+}
+
+// Shows a --record-grids file with output_frame(), starting seek seconds
+// after its first frame, at the recorded pace unless fast is nonzero.
+// Decoding starts from the last keyframe before the seek target.
+static int replay_grids(struct kinradar_data *data, const char *path, double seek, int fast)
+{
+	struct history h;
+	struct grid_record rec, first;
+	struct grid_info *xgrid, *ygrid, *bands;
+	uint16_t *cells;
+	int64_t target, start = 0, first_ns = 0, last_ns = 0, t;
+	size_t k, off, len, ncells;
+	int i, shown = 0, ret = 0;
+
+	if(open_history(&h, path)) {
+		return -1;
+	}
+	if(!h.nkeys || !history_record(&h, h.keys[0].offset, &first) ||
+			first.nbands > MAX_BANDS || first.xudiv < 1 || first.xvdiv < 1 ||
+			first.yudiv < 1 || first.yvdiv < 1) {
+		ERROR_OUT("%s has no frames to replay.\n", path);
+		close_history(&h);
+		return -1;
+	}
+
+	// Start from the last keyframe at or before the target
+	target = h.keys[0].time_ns + (int64_t)(seek * 1e9);
+	for(k = 0; k + 1 < h.nkeys && h.keys[k + 1].time_ns <= target; k++) {
+	}
+
+	// The grids are set up as they were recorded.  Their histories were
+	// already decayed if they had any.
+	data->xgrid.udiv = first.xudiv;
+	data->xgrid.vdiv = first.xvdiv;
+	data->ygrid.udiv = first.yudiv;
+	data->ygrid.vdiv = first.yvdiv;
+	data->xgrid.zmin = data->ygrid.zmin = h.hdr.zmin;
+	data->xgrid.zmax = data->ygrid.zmax = h.hdr.zmax;
+	data->xgrid.wmax = h.hdr.xwmax;
+	data->ygrid.wmax = h.hdr.ywmax;
+	data->nbands = first.nbands;
+	data->nslices = 0;
+	for(i = 0; i < data->nbands; i++) {
+		data->band_top[i] = first.bands[i].top;
+		data->band_bot[i] = first.bands[i].bottom;
+		data->band_slice[i] = !!(first.bands[i].flags & BAND_SLICE);
+		data->nslices += data->band_slice[i];
+	}
+	data->decay = 0.0f;
+	data->track_min = 0;
+
+	ncells = (1 + data->nbands) * data->xgrid.udiv * data->xgrid.vdiv +
+		data->ygrid.udiv * data->ygrid.vdiv;
+	cells = calloc(ncells, sizeof(*cells));
+	want_products(data, output_products(data));
+	want_level(data, data->level);
+	if(cells == NULL || init_grids(data)) {
+		ERROR_OUT("Error initializing grids for %s.\n", path);
+		free(cells);
+		close_history(&h);
+		return -1;
+	}
+
+	INFO_OUT("Replaying %s from the keyframe at frame %u.\n", path, h.keys[k].frame);
+
+	for(off = h.keys[k].offset; !data->done && (len = history_record(&h, off, &rec)); off += len) {
+		if(rec.xudiv != first.xudiv || rec.xvdiv != first.xvdiv || rec.yudiv != first.yudiv ||
+				rec.yvdiv != first.yvdiv || rec.nbands != first.nbands) {
+			ERROR_OUT("%s changes grid size at frame %u.\n", path, rec.frame);
+			ret = -1;
+			break;
+		}
+		if(rec.flags & DELTA_KEY) {
+			memset(cells, 0, ncells * sizeof(*cells));
+		}
+		if(decode_delta(cells, ncells, (const uint16_t *)(h.map + off + rec.header_size),
+					rec.record_size - rec.header_size)) {
+			ERROR_OUT("%s has a bad record at frame %u.\n", path, rec.frame);
+			ret = -1;
+			break;
+		}
+		last_ns = rec.time_ns;
+		if(rec.time_ns < target) {
+			continue;
+		}
+
+		if(!shown++) {
+			start = now_ns();
+			first_ns = rec.time_ns;
+		}
+		if(!fast) {
+			sleep_until(start + rec.time_ns - first_ns);
+		}
+
+		load_history_frame(data, cells, &rec);
+		if(!render_due(data)) {
+			t = now_ns();
+			level_grids(data, data->level, &xgrid, &ygrid, &bands);
+			output_frame(data, xgrid, ygrid, bands, &data->info);
+			render_done(data, t);
+		}
+
+		check_stats_request(data, 1);
+	}
+
+	if(!ret && !shown && !data->done) {
+		ERROR_OUT("%s ends %.1f seconds in.\n", path, (last_ns - h.keys[0].time_ns) / 1e9);
+		ret = -1;
+	}
+
+	free(cells);
+	close_history(&h);
+
+	return ret;
+}
+
+// Grid sizes (-g and -G) measured by --bench
+static const int bench_sizes[][2] = {
+	{ 65, 32 },
+	{ 128, 64 },
+	{ 256, 88 },
+};
+
+// Each benchmark stage runs for at least this many frames and nanoseconds
+#define BENCH_MIN_FRAMES 30
+#define BENCH_MIN_NS 500000000
+
+// Number of synthetic frames generated by --bench
+#define BENCH_SYNTH_FRAMES 16
+
+// Raw depth value for a distance in meters, the inverse of init_lut()
+static uint16_t raw_depth(float z)
+{
+	return (uint16_t)((atanf(z / 0.1236f) - 1.1863f) * 2842.5f);
+}
+
+// Fills buf with synthetic depth frame n: a back wall, a floor, a person-sized
+// box moving across the room, and a sprinkling of out of range pixels.
+static void synth_frame(uint16_t *buf, int n)
+{
+	float t = n * 2.0f * M_PI / BENCH_SYNTH_FRAMES;
+	int bx = FREENECT_FRAME_W / 2 + 200 * sinf(t);
+	float bz = 2.5f + 1.5f * cosf(t);
+	int x, y;
+	float z;
+
+	for(y = 0; y < FREENECT_FRAME_H; y++) {
+		for(x = 0; x < FREENECT_FRAME_W; x++) {
+			if(((x * 7 + y * 13 + n * 5) % 53) == 0 || x < 16) {
+				DPT(buf, x, y) = 2047;
+				continue;
+			}
+
+			z = 4.5f;
+			if(y > FREENECT_FRAME_H * 2 / 3) {
+				z = 0.8f + (FREENECT_FRAME_H - y) * 0.025f;
+			}
+			if(abs(x - bx) < 40 && y > 120 && y < 400) {
+				z = bz;
+			}
+			DPT(buf, x, y) = raw_depth(z);
+		}
+	}
+}
+
+// Returns the percentage of overhead view samples (side view with -v) that
+// land in different cells with --stride than at full resolution, averaged
+// over the given frames, after scaling both grids to the same total.
+static double bench_error(struct kinradar_data *data, const uint16_t *const *frames, int nframes)
+{
+	struct grid_info *grid = (data->wanted & WANT_XGRID) ? &data->xgrid : &data->ygrid;
+	struct pixel_span *spans = data->spans, *full_spans;
+	int *span_index = data->span_index, *full_index;
+	int stride = data->stride, interleave = data->interleave, nphases = data->nphases;
+	uint16_t *full;
+	double err = 0.0, a, b, sum;
+	int64_t ta, tb;
+	int i, u, v, c;
+
+	full = malloc(grid->bufsize);
+	if(full == NULL) {
+		ERRNO_OUT("Error allocating full resolution grid");
+		return -1.0;
+	}
+
+	// Full resolution spans, swapped with the decimated ones for every frame
+	data->stride = 1;
+	data->interleave = 0;
+	data->spans = NULL;
+	data->span_index = NULL;
+	if(compile_spans(data)) {
+		free(full);
+		return -1.0;
+	}
+	full_spans = data->spans;
+	full_index = data->span_index;
+
+	for(i = 0; i < nframes; i++) {
+		data->spans = full_spans;
+		data->row_spans = full_index;
+		fill_grids(data, frames[i]);
+		memcpy(full, grid->gridpop, grid->bufsize);
+
+		data->spans = spans;
+		data->row_spans = span_index + (i % nphases) * (FREENECT_FRAME_H + 1);
+		fill_grids(data, frames[i]);
+
+		ta = 0;
+		tb = 0;
+		for(u = 0; u < grid->udiv; u++) {
+			for(v = 0; v < grid->vdiv; v++) {
+				c = CELL(grid, u, v);
+				ta += full[c];
+				tb += grid->gridpop[c];
+			}
+		}
+
+		sum = 0.0;
+		for(u = 0; u < grid->udiv && ta && tb; u++) {
+			for(v = 0; v < grid->vdiv; v++) {
+				c = CELL(grid, u, v);
+				a = (double)full[c] / ta;
+				b = (double)grid->gridpop[c] / tb;
+				sum += a > b ? a - b : b - a;
+			}
+		}
+		err += sum * 50.0;
+	}
+
+	free(full_spans);
+	free(full_index);
+	free(full);
+	data->spans = spans;
+	data->span_index = span_index;
+	data->stride = stride;
+	data->interleave = interleave;
+	data->nphases = nphases;
+	data->phase = 0;
+	data->row_spans = span_index;
+
+	return err / nframes;
+}
+
+// Pixels the fill kernels visit per frame: the active runs (--mask and
+// --stride) of each row binned into any grid, including --band rows.
+// Background pixels are still visited, just not binned.
+static double visited_pixels(const struct kinradar_data *data)
+{
+	const struct pixel_span *sp;
+	double n = 0.0;
+	int y;
+
+	for(y = data->scan_top; y < data->scan_bot; y++) {
+		if(!data->row_mask[y]) {
+			continue;
+		}
+		for(sp = SPAN_FIRST(data, y); sp < SPAN_END(data, y); sp++) {
+			n += sp->x1 - sp->x0;
+		}
+	}
+
+	return n;
+}
+
+// Times binning and rendering of the given frames with each grid size in
+// bench_sizes, using the current kernel, thread, and display options.
+// Rendered output goes to /dev/null.
+static int bench_frames(struct kinradar_data *data, const char *name,
+		const uint16_t *const *frames, const uint32_t *timestamps, int nframes)
+{
+	struct grid_info *xgrid, *ygrid, *bands;
+	int64_t first, start, bin_ns, render_ns;
+	size_t bytes;
+	int i, n, size;
+	double pixels, err;
+
+	for(size = 0; size < (int)(sizeof(bench_sizes) / sizeof(bench_sizes[0])); size++) {
+		stop_workers(data);
+		free_grids(data);
+
+		data->xgrid.udiv = bench_sizes[size][0];
+		data->ygrid.vdiv = data->xgrid.udiv;
+		data->xgrid.vdiv = bench_sizes[size][1];
+		data->ygrid.udiv = data->xgrid.vdiv;
+
+		if(init_grids(data) || start_workers(data)) {
+			return -1;
+		}
+
+		// Binning
+		start = now_ns();
+		for(n = 0; n < BENCH_MIN_FRAMES || now_ns() - start < BENCH_MIN_NS; n++) {
+			i = n % nframes;
+			bin_frame(data, frames[i], timestamps[i], now_ns());
+		}
+		bin_ns = (now_ns() - start) / n;
+		pixels = visited_pixels(data) * 1e9 / bin_ns;
+
+		// Rendering, binning each frame first, outside the timed section
+		bytes = 0;
+		render_ns = 0;
+		data->out.refresh_count = 0;
+		first = now_ns();
+		for(n = 0; n < BENCH_MIN_FRAMES || now_ns() - first < BENCH_MIN_NS; n++) {
+			i = n % nframes;
+			bin_frame(data, frames[i], timestamps[i], now_ns());
+
+			start = now_ns();
+			level_grids(data, data->level, &xgrid, &ygrid, &bands);
+			output_frame(data, xgrid, ygrid, bands, &data->info);
+			render_ns += now_ns() - start;
+			bytes += data->out.last_len;
+		}
+
+		// Accuracy, only meaningful without persistence
+		err = 0.0;
+		if(data->stride > 1 && data->xgrid.history == NULL) {
+			err = bench_error(data, frames, nframes);
+			if(err < 0.0) {
+				return -1;
+			}
+		}
+
+		printf("%-10s %4dx%-3d %12lld %10.1f %12lld %10zu %6.2f\n", name,
+				data->xgrid.udiv, data->xgrid.vdiv, (long long)bin_ns, pixels / 1e6,
+				(long long)(render_ns / n), bytes / n, err);
+	}
+
+	return 0;
+}
+
+// Runs --bench over synthetic frames, then over a --replay recording if one
+// was given.
+static int bench(struct kinradar_data *data, const char *replay_path)
+{
+	uint16_t *synth[BENCH_SYNTH_FRAMES];
+	const uint16_t **frames;
+	uint32_t *timestamps;
+	struct recording rec;
+	int i, ret;
+
+	// Benchmark frames are never recorded
+	data->record_fd = -1;
+
+	data->out.fd = open("/dev/null", O_WRONLY);
+	if(data->out.fd < 0) {
+		ERRNO_OUT("Error opening /dev/null");
+		return -1;
+	}
+	init_backlog(&data->out);
+
+	printf("Kernel: %s  Threads: %d  Rows: %d-%d  Differential: %d  Headless: %d  Stride: %d%s\n",
+			data->kernel->name, data->nworkers, data->ytop, data->ybot - 1,
+			data->out.refresh_interval, data->headless, data->stride,
+			data->interleave ? " interleaved" : "");
+	printf("%-10s %-8s %12s %10s %12s %10s %6s\n", "frames", "grid", "bin ns/frame",
+			"Mpixel/s", "out ns/frame", "bytes/frame", "err %");
+
+	timestamps = calloc(BENCH_SYNTH_FRAMES, sizeof(uint32_t));
+	for(i = 0; i < BENCH_SYNTH_FRAMES; i++) {
+		synth[i] = malloc(FREENECT_DEPTH_11BIT_SIZE);
+		if(synth[i] == NULL || timestamps == NULL) {
+			ERRNO_OUT("Error allocating synthetic frames");
+			return -1;
+		}
+		synth_frame(synth[i], i);
+	}
+
+	ret = bench_frames(data, "synthetic", (const uint16_t *const *)synth, timestamps,
+			BENCH_SYNTH_FRAMES);
+	for(i = 0; i < BENCH_SYNTH_FRAMES; i++) {
+		free(synth[i]);
+	}
+	free(timestamps);
+
+	if(ret || replay_path == NULL) {
+		return ret;
+	}
+
+	if(open_recording(&rec, replay_path)) {
+		return -1;
+	}
+	if(rec.nframes == 0) {
+		ERROR_OUT("%s has no frames.\n", replay_path);
+		close_recording(&rec);
+		return -1;
+	}
+
+	frames = calloc(rec.nframes, sizeof(*frames));
+	timestamps = calloc(rec.nframes, sizeof(*timestamps));
+	if(frames == NULL || timestamps == NULL) {
+		ERRNO_OUT("Error allocating recorded frame list");
+		close_recording(&rec);
+		return -1;
+	}
+	for(i = 0; i < (int)rec.nframes; i++) {
+		frames[i] = (const uint16_t *)(recording_frame(&rec, i) + 1);
+		timestamps[i] = recording_frame(&rec, i)->timestamp;
+	}
+
+	ret = bench_frames(data, "recorded", frames, timestamps, rec.nframes);
+
+	free(frames);
+	free(timestamps);
+	close_recording(&rec);
+
+	return ret;
+}
+
+void stats_signal(int signum)
+{
+	atomic_store(&stats_requested, 1);
+}
+
+void intr(int signum)
+{
+	printf("\e[m");
+	INFO_OUT("Exiting due to signal %d (%s)\n", signum, strsignal(signum));
+	sigdata->done = 1;
+
+	// Exit the program the next time this signal is received
+	signal(signum, exit);
+}
+
+// Adds a descriptor libusb opened to run_kinect()'s event loop, whose epoll
+// descriptor is at arg.
+static void usb_fd_added(int fd, short events, void *arg)
+{
+	struct epoll_event ev = {
+		.events = ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0),
+		.data.fd = fd,
+	};
+
+	if(epoll_ctl(*(int *)arg, EPOLL_CTL_ADD, fd, &ev)) {
+		ERRNO_OUT("Error watching libusb descriptor %d", fd);
+	}
+}
+
+// Removes a descriptor libusb is closing from the event loop.
+static void usb_fd_removed(int fd, void *arg)
+{
+	epoll_ctl(*(int *)arg, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Sets the LED of each of the n Kinects whose out of range state changed.
+static void update_leds(struct kinradar_data *data, freenect_device **kn_dev, int *last_oor, int n)
+{
+	int i, oor;
+
+	for(i = 0; i < n; i++) {
+		oor = atomic_load(&data[i].out_of_range);
+		if(last_oor[i] != oor) {
+			freenect_set_led(kn_dev[i], oor ? LED_BLINK_RED_YELLOW : LED_GREEN);
+			last_oor[i] = oor;
+		}
+	}
+}
+
+// Unblocks the signals run_kinect() took from signal_fd.  Any still waiting
+// there came in while the loop was stopping, and are dropped first so they
+// don't exit() through intr()'s handler the moment they are unblocked.
+static void unblock_signals(int signal_fd, const sigset_t *old)
+{
+	struct signalfd_siginfo si;
 
-	if(clear) {
-		suffix = "\e[K";
-	} else {
-		suffix = "";
+	while(read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
 	}
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+}
 
-	if(transpose) {
-		for(u = 0; u < grid->udiv; u++) {
-			printf("%s", prefix);
-			for(v = 0; v < grid->vdiv; v++) {
-				print_cell(data, grid->gridpop[v][u], scale);
-			}
-			puts(suffix);
-		}
-	} else {
-		for(v = 0; v < grid->vdiv; v++) {
-			printf("%s", prefix);
-			for(u = 0; u < grid->udiv; u++) {
-				print_cell(data, grid->gridpop[v][u], scale);
-			}
-			puts(suffix);
+// Closes whichever of run_kinect()'s event loop descriptors are open.
+static void close_event_loop(int epfd, int signal_fd, int led_fd, int render_fd)
+{
+	int i, fds[4] = { epfd, signal_fd, led_fd, render_fd };
+
+	for(i = 0; i < 4; i++) {
+		if(fds[i] >= 0) {
+			close(fds[i]);
 		}
 	}
 }
 
-void clear_grid(struct grid_info *grid)
+// Opens n Kinects, each with its own kinradar_data in data[0] through
+// data[n - 1], and runs them until interrupted.  Everything the main thread
+// waits for is in one epoll set: libusb's descriptors, a signalfd for
+// SIGINT, SIGTERM, and SIGUSR1, an eventfd the binning side writes when a
+// Kinect's LED should change, and without -p a timerfd for frames held back
+// by -r.  libusb is only called when it has something to do.
+static int run_kinect(struct kinradar_data *data, int n)
 {
-	memset(grid->gridpop_buffer, 0, grid->bufsize);
-	grid->popmax = 0;
-}
+	freenect_context *kn;
+	freenect_device *kn_dev[MAX_KINECTS];
+	libusb_context *usb;
+	const struct libusb_pollfd **pollfds;
+	struct epoll_event ev[16];
+	struct signalfd_siginfo si;
+	struct timeval tv, zero = { 0, 0 };
+	sigset_t sigs, old;
+	uint64_t count;
+	int last_oor[MAX_KINECTS];
+	int epfd, signal_fd, led_fd, render_fd = -1, fds[3];
+	int i, j, fd, nev, timeout, usb_ready, ret, signalled = 0;
 
-void draw_grid_border(struct grid_info *grid)
-{
-	int u, v;
-	float zw;
-	float inc = (grid->zmax - grid->zmin) / grid->vdiv;
+	if(libusb_init(&usb) < 0) {
+		ERROR_OUT("libusb init failed.\n");
+		return -1;
+	}
+	if(freenect_init(&kn, usb) < 0) {
+		ERROR_OUT("libfreenect init failed.\n");
+		return -1;
+	}
 
-	for(v = 0; v < grid->vdiv; v++) {
-		zw = zgrid_to_world(grid, v) + inc;
-		u = xyworld_to_grid(grid, grid->wmax * zw / grid->zmax);
+	INFO_OUT("Found %d Kinect devices.\n", freenect_num_devices(kn));
+
+	if(freenect_num_devices(kn) < n) {
+		ERROR_OUT("%d Kinect devices needed.\n", n);
+		return -1;
+	}
 
-		if(u >= grid->udiv) {
-			u = grid->udiv - 1;
+	for(i = 0; i < n; i++) {
+		if(freenect_open_device(kn, &kn_dev[i], i)) {
+			ERROR_OUT("Error opening Kinect #%d.\n", i);
+			return -1;
 		}
 
-		grid->gridpop[v][u] = -2;
+		freenect_set_user(kn_dev[i], &data[i]);
+		freenect_set_tilt_degs(kn_dev[i], -5);
+		freenect_set_led(kn_dev[i], LED_GREEN);
+		freenect_set_depth_callback(kn_dev[i], depth);
+		freenect_set_depth_format(kn_dev[i], FREENECT_DEPTH_11BIT);
+	}
+
+	// Signals are taken from the signalfd while the loop runs.  Every
+	// other thread already blocks them.
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
 
-		u = xyworld_to_grid(grid, -grid->wmax * zw / grid->zmax);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	led_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(n == 1 && !data->pipeline) {
+		render_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	}
+	if(epfd < 0 || signal_fd < 0 || led_fd < 0 || (n == 1 && !data->pipeline && render_fd < 0)) {
+		ERRNO_OUT("Error setting up event loop");
+		close_event_loop(epfd, signal_fd, led_fd, render_fd);
+		return -1;
+	}
 
-		if(u < 0 || u >= grid->udiv) {
-			ERROR_OUT("u %d out of range\n", u);
-			abort();
+	fds[0] = signal_fd;
+	fds[1] = led_fd;
+	fds[2] = render_fd;
+	for(i = 0; i < 3 && fds[i] >= 0; i++) {
+		ev[0].events = EPOLLIN;
+		ev[0].data.fd = fds[i];
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], ev)) {
+			ERRNO_OUT("Error setting up event loop");
+			close_event_loop(epfd, signal_fd, led_fd, render_fd);
+			return -1;
 		}
+	}
 
-		grid->gridpop[v][u] = -1;
+	pollfds = libusb_get_pollfds(usb);
+	if(pollfds == NULL) {
+		ERROR_OUT("Error getting libusb descriptors.\n");
+		close_event_loop(epfd, signal_fd, led_fd, render_fd);
+		return -1;
 	}
-}
+	for(i = 0; pollfds[i] != NULL; i++) {
+		usb_fd_added(pollfds[i]->fd, pollfds[i]->events, &epfd);
+	}
+	libusb_free_pollfds(pollfds);
+	libusb_set_pollfd_notifiers(usb, usb_fd_added, usb_fd_removed, &epfd);
 
-void depth(freenect_device *kn_dev, void *depthbuf, uint32_t timestamp)
-{
-	struct kinradar_data *data = freenect_get_user(kn_dev);
-	const uint16_t *buf = (uint16_t *)depthbuf;
-	int oor_total = 0; // Out of range count
-	int x, y, u, v;
-	float xw, yw, zw;
+	if(!data->headless) {
+		printf("\e[H\e[2J");
+	}
 
-	// Initialize data structures
-	clear_grid(&data->xgrid);
-	clear_grid(&data->ygrid);
+	// Every way out from here unblocks them again
+	pthread_sigmask(SIG_BLOCK, &sigs, &old);
 
-	// Fill in cone
-	for(y = data->ytop; y < data->ybot; y++) {
-		for(x = 0; x < FREENECT_FRAME_W; x++) {
-			if(DPT(buf, x, y) == 2047) {
-				oor_total++;
-				continue;
-			}
+	if(data->fuse != NULL && start_pipeline(data->fuse)) {
+		libusb_set_pollfd_notifiers(usb, NULL, NULL, NULL);
+		unblock_signals(signal_fd, &old);
+		close_event_loop(epfd, signal_fd, led_fd, render_fd);
+		return -1;
+	}
+	for(i = 0; i < n; i++) {
+		data[i].led_fd = led_fd;
+		data[i].render_fd = render_fd;
+		if(start_pipeline(&data[i])) {
+			libusb_set_pollfd_notifiers(usb, NULL, NULL, NULL);
+			unblock_signals(signal_fd, &old);
+			close_event_loop(epfd, signal_fd, led_fd, render_fd);
+			return -1;
+		}
+		if(data[i].pipeline) {
+			freenect_set_depth_buffer(kn_dev[i], data[i].capture_frame->buf);
+		}
+
+		freenect_start_depth(kn_dev[i]);
+		last_oor[i] = data[i].out_of_range;
+	}
 
-			zw = data->depth_lut[DPT(buf, x, y)];
+	while(!data->done) {
+		// libusb may have a transfer timeout due before anything happens
+		timeout = -1;
+		if(libusb_get_next_timeout(usb, &tv) == 1) {
+			timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		}
 
-			if(zw < data->xgrid.zmin) {
-				continue;
-			}
-			if(zw > data->xgrid.zmax) {
+		nev = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
+		if(nev < 0) {
+			if(errno == EINTR) {
 				continue;
 			}
+			ERRNO_OUT("Error waiting for events");
+			break;
+		}
 
-			xw = xworld(x, zw);
-			yw = yworld(y, zw);
-
-			u = xyworld_to_grid(&data->xgrid, xw);
-			v = zworld_to_grid(&data->xgrid, zw);
-			data->xgrid.gridpop[v][u]++;
-			if(data->xgrid.gridpop[v][u] > data->xgrid.popmax) {
-				data->xgrid.popmax = data->xgrid.gridpop[v][u];
+		usb_ready = nev == 0;
+		for(j = 0; j < nev; j++) {
+			fd = ev[j].data.fd;
+			if(fd == signal_fd) {
+				while(read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+					if(si.ssi_signo == SIGUSR1) {
+						atomic_store(&stats_requested, 1);
+						check_stats_request(data, n + (data->fuse != NULL));
+					} else if(signalled) {
+						// A second signal exits right away, like intr()'s handler
+						exit(si.ssi_signo);
+					} else {
+						intr(si.ssi_signo);
+						signalled = 1;
+					}
+				}
+			} else if(fd == led_fd) {
+				if(read(led_fd, &count, sizeof(count)) == sizeof(count)) {
+					update_leds(data, kn_dev, last_oor, n);
+				}
+			} else if(fd == render_fd) {
+				if(read(render_fd, &count, sizeof(count)) == sizeof(count)) {
+					output_pending(data);
+				}
+			} else {
+				usb_ready = 1;
 			}
+		}
 
-			u = xyworld_to_grid(&data->ygrid, yw);
-			v = zworld_to_grid(&data->ygrid, zw);
-			data->ygrid.gridpop[v][u]++;
-			if(data->ygrid.gridpop[v][u] > data->ygrid.popmax) {
-				data->ygrid.popmax = data->ygrid.gridpop[v][u];
+		if(usb_ready) {
+			ret = libusb_handle_events_timeout(usb, &zero);
+			if(ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+				// EINTR may occur when profiling
+				break;
 			}
 		}
 	}
 
-	// Draw cone borders
-	draw_grid_border(&data->xgrid);
-	draw_grid_border(&data->ygrid);
+	// From here a second signal is the way out of a shutdown that hangs,
+	// so it exits right away, as set by intr()
+	unblock_signals(signal_fd, &old);
 
-	// Display scene info
-	printf("\e[H");
-	INFO_OUT("\e[Ktime: %u frame: %d top: %d bottom: %d\n",
-			timestamp, data->frame, data->ytop, data->ybot);
-	INFO_OUT("\e[Kxpopmax: %d ypopmax: %d out: %d%%\n",
-			data->xgrid.popmax, data->ygrid.popmax,
-			oor_total * 100 / FREENECT_FRAME_PIX);
+	for(i = 0; i < n; i++) {
+		freenect_stop_depth(kn_dev[i]);
+	}
 
-	// Display grid
-	reset_color();
-	if(data->disp_mode == SHOW_BOTH || data->disp_mode == SHOW_HORIZ) {
-		print_grid(data, &data->xgrid, -1, 2, data->disp_mode == SHOW_HORIZ, 0);
+	// The binning threads use led_fd until they stop
+	for(i = 0; i < n; i++) {
+		stop_pipeline(&data[i]);
+		data[i].led_fd = -1;
+		data[i].render_fd = -1;
 	}
-	if(data->disp_mode == SHOW_BOTH || data->disp_mode == SHOW_VERT) {
-		print_grid(data, &data->ygrid,
-				data->disp_mode == SHOW_VERT ? -1 : data->xgrid.udiv + 1, 2,
-				1, 1);
+	if(data->fuse != NULL) {
+		stop_pipeline(data->fuse);
 	}
-	printf("\e[m\e[K");
 
-	fflush(stdout);
+	for(i = 0; i < n; i++) {
+		freenect_set_led(kn_dev[i], LED_OFF);
+		freenect_close_device(kn_dev[i]);
+	}
+	libusb_set_pollfd_notifiers(usb, NULL, NULL, NULL);
+	freenect_shutdown(kn);
+	libusb_exit(usb);
 
-	data->out_of_range = oor_total > FREENECT_FRAME_PIX * 35 / 100;
-	data->frame++;
+	close_event_loop(epfd, signal_fd, led_fd, render_fd);
+
+	return 0;
 }
 
-// http://groups.google.com/group/openkinect/browse_thread/thread/31351846fd33c78/e98a94ac605b9f21#e98a94ac605b9f21
-static void init_lut(float depth_lut[])
+// Copies a grid's geometry from the options, without any buffers or tables.
+static void copy_geometry(struct grid_info *dst, const struct grid_info *src)
 {
-	int i;
-
-	for(i = 0; i < 2048; i++) {
-		depth_lut[i] = 0.1236 * tanf(i / 2842.5 + 1.1863);
-	}
+	dst->udiv = src->udiv;
+	dst->vdiv = src->vdiv;
+	dst->zmin = src->zmin;
+	dst->zmax = src->zmax;
+	dst->wmax = src->wmax;
+	dst->edge_lo = src->edge_lo;
+	dst->edge_hi = src->edge_hi;
 }
 
-static void init_data(struct kinradar_data *data)
+// Sets up one of run_kinects()' instances from the options in data.  Only
+// settings are copied, so nothing data owns is shared.
+static void init_device(struct kinradar_data *dev, const struct kinradar_data *data)
 {
-	memset(data, 0, sizeof(struct kinradar_data));
-
-	init_lut(data->depth_lut);
-
-	data->disp_mode = SHOW_BOTH;
-
-	data->xgrid.udiv = 65;
-	data->xgrid.vdiv = 32;
-	data->xgrid.zmin = 0.0f;
-	data->xgrid.zmax = 6.0f;
-	data->xgrid.wmax = xworld(0, data->xgrid.zmax);
-
-	data->ygrid.udiv = 32;
-	data->ygrid.vdiv = 80;
-	data->ygrid.zmin = 0.0f;
-	data->ygrid.zmax = 6.0f;
-	data->ygrid.wmax = yworld(FREENECT_FRAME_H - 1, data->ygrid.zmax);
-
-	data->ytop = 0;
-	data->ybot = FREENECT_FRAME_H;
+	init_data(dev);
+	memcpy(dev->depth_lut, data->depth_lut, sizeof(dev->depth_lut));
+	dev->disp_mode = data->disp_mode;
+	copy_geometry(&dev->xgrid, &data->xgrid);
+	copy_geometry(&dev->ygrid, &data->ygrid);
+	dev->ytop = data->ytop;
+	dev->ybot = data->ybot;
+	dev->stride = data->stride;
+	dev->interleave = data->interleave;
+	dev->kernel = data->kernel;
+	dev->decay = data->decay;
+	dev->nworkers = data->nworkers;
+	dev->headless = data->headless;
+	dev->out.fd = data->out.fd;
+	dev->out.backlog_req = data->out.backlog_req;
+	dev->out.refresh_interval = data->out.refresh_interval;
+	dev->render_rate = data->render_rate;
+	dev->adaptive = data->adaptive;
+	dev->show_stats = data->show_stats;
 }
 
-static int alloc_grid(struct grid_info *grid)
+// Sets up one kinradar_data per Kinect from the options in data, plus one
+// more after them for the fused grid if fuse is nonzero, and runs them.
+// Every Kinect always gets a capture pipeline, as if -p were given, so that
+// each bins on its own thread, pinned to its own CPU where possible.
+static int run_kinects(struct kinradar_data *data, int n, const struct pose *poses, int fuse)
 {
-	int i;
+	struct kinradar_data *devs;
+	int i, rows, ret;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
-	grid->bufsize = sizeof(int) * grid->udiv * grid->vdiv;
-
-	grid->gridpop_buffer = malloc(grid->bufsize);
-	if(grid->gridpop_buffer == NULL) {
-		ERRNO_OUT("Error allocating grid population buffer");
-		return -1;
-	}
-	grid->gridpop = malloc(sizeof(int *) * grid->vdiv);
-	if(grid->gridpop == NULL) {
-		ERRNO_OUT("Error allocating grid population array");
+	devs = calloc(n + 1, sizeof(*devs));
+	if(devs == NULL) {
+		ERRNO_OUT("Error allocating Kinect state");
 		return -1;
 	}
 
-	for(i = 0; i < grid->vdiv; i++) {
-		grid->gridpop[i] = grid->gridpop_buffer + i * grid->udiv;
+	// Displays are stacked, one below the other, unless fused
+	rows = 0;
+	if(data->disp_mode != SHOW_VERT) {
+		rows = data->xgrid.vdiv;
 	}
+	if(data->disp_mode != SHOW_HORIZ && data->ygrid.udiv > rows) {
+		rows = data->ygrid.udiv;
+	}
+	rows += 3 + data->show_stats;
 
-	return 0;
-}
-
-static int init_grids(struct kinradar_data *data)
-{
-	return (alloc_grid(&data->xgrid) || alloc_grid(&data->ygrid)) ? -1 : 0;
-}
+	for(i = 0; i < n; i++) {
+		init_device(&devs[i], data);
+		devs[i].device = i;
+		devs[i].pose = poses[i];
+		devs[i].pipeline = 1;
+		devs[i].cpu = ncpu > 0 ? i % ncpu : -1;
+		devs[i].row0 = fuse ? 0 : i * rows;
+		want_products(&devs[i], fuse ? WANT_XGRID : output_products(&devs[i]));
+		if(init_grids(&devs[i]) || start_workers(&devs[i])) {
+			return -1;
+		}
+	}
+	if(fuse) {
+		init_device(&devs[n], data);
+		if(init_fusion(&devs[n], devs, n)) {
+			return -1;
+		}
+	}
 
+	sigdata = devs;
+	ret = run_kinect(devs, n);
 
-void intr(int signum)
-{
-	printf("\e[m");
-	INFO_OUT("Exiting due to signal %d (%s)\n", signum, strsignal(signum));
-	sigdata->done = 1;
+	for(i = 0; i < n; i++) {
+		stop_pipeline(&devs[i]);
+		stop_workers(&devs[i]);
+	}
+	if(fuse) {
+		stop_pipeline(&devs[n]);
+	}
 
-	// Exit the program the next time this signal is received
-	signal(signum, exit);
+	return ret;
 }
 
 int main(int argc, char *argv[])
 {
+	enum {
+		OPT_RECORD = 256,
+		OPT_REPLAY,
+		OPT_FAST,
+		OPT_BENCH,
+		OPT_POSE,
+		OPT_FUSE,
+		OPT_SERVE,
+		OPT_BAND,
+		OPT_SLICE,
+		OPT_MASK,
+		OPT_LEARN_MASK,
+		OPT_SAVE_MASK,
+		OPT_BACKGROUND,
+		OPT_BG_THRESHOLD,
+		OPT_STRIDE,
+		OPT_INTERLEAVE,
+		OPT_CONTROL,
+		OPT_CALIBRATION,
+		OPT_TRACK,
+		OPT_RECORD_GRIDS,
+		OPT_REPLAY_GRIDS,
+		OPT_SEEK,
+	};
+	static const struct option long_opts[] = {
+		{ "record", required_argument, NULL, OPT_RECORD },
+		{ "replay", required_argument, NULL, OPT_REPLAY },
+		{ "fast", no_argument, NULL, OPT_FAST },
+		{ "bench", no_argument, NULL, OPT_BENCH },
+		{ "pose", required_argument, NULL, OPT_POSE },
+		{ "fuse", no_argument, NULL, OPT_FUSE },
+		{ "serve", required_argument, NULL, OPT_SERVE },
+		{ "band", required_argument, NULL, OPT_BAND },
+		{ "slice", required_argument, NULL, OPT_SLICE },
+		{ "mask", required_argument, NULL, OPT_MASK },
+		{ "learn-mask", required_argument, NULL, OPT_LEARN_MASK },
+		{ "save-mask", required_argument, NULL, OPT_SAVE_MASK },
+		{ "background", required_argument, NULL, OPT_BACKGROUND },
+		{ "bg-threshold", required_argument, NULL, OPT_BG_THRESHOLD },
+		{ "stride", required_argument, NULL, OPT_STRIDE },
+		{ "interleave", no_argument, NULL, OPT_INTERLEAVE },
+		{ "control", required_argument, NULL, OPT_CONTROL },
+		{ "calibration", required_argument, NULL, OPT_CALIBRATION },
+		{ "track", required_argument, NULL, OPT_TRACK },
+		{ "record-grids", required_argument, NULL, OPT_RECORD_GRIDS },
+		{ "replay-grids", required_argument, NULL, OPT_REPLAY_GRIDS },
+		{ "seek", required_argument, NULL, OPT_SEEK },
+		{ NULL, 0, NULL, 0 },
+	};
 	struct kinradar_data data;
-	freenect_context *kn;
-	freenect_device *kn_dev;
-	int ret = 0, opt;
+	char *kernel_name = NULL;
+	char *output_dest = NULL;
+	char *record_path = NULL;
+	char *replay_path = NULL;
+	char *grids_record_path = NULL;
+	char *grids_replay_path = NULL;
+	double seek = -1.0;
+	int replay_fast = 0;
+	int run_bench = 0;
+	char *serve_addrs[MAX_SERVE];
+	int nserve = 0;
+	char *control_addr = NULL;
+	char *calib_path = NULL;
+	char *mask_path = NULL;
+	int learn_frames = 0;
+	int bg_frames = 0;
+	int bg_threshold = 0;
+	float lo, hi;
+	struct pose poses[MAX_KINECTS], pose;
+	int ndevices = 1, fuse = 0;
+	int ret = 0, opt, i;
 
 	init_data(&data);
 	sigdata = &data;
 
+	memset(poses, 0, sizeof(poses));
+
 	// Handle command-line options
-	while((opt = getopt(argc, argv, "g:G:y:Y:z:Z:hv")) != -1) {
+	while((opt = getopt_long(argc, argv, "g:G:y:Y:z:Z:e:hvk:j:pd:r:ao:sn:l:", long_opts, NULL)) != -1) {
 		switch(opt) {
 			case 'g':
 				// Horizontal grid divisions
@@ -479,6 +7812,13 @@ int main(int argc, char *argv[])
 				data.xgrid.zmax = atof(optarg);
 				data.ygrid.zmax = data.xgrid.zmax;
 				break;
+			case 'e':
+				// Persistence
+				data.decay = atof(optarg);
+				if(data.decay < 0.0f) {
+					data.decay = 0.0f;
+				}
+				break;
 			case 'h':
 				// Horizontal only
 				data.disp_mode = SHOW_HORIZ;
@@ -487,8 +7827,219 @@ int main(int argc, char *argv[])
 				// Vertical only
 				data.disp_mode = SHOW_VERT;
 				break;
+			case 'k':
+				// Fill kernel
+				kernel_name = optarg;
+				break;
+			case 'd':
+				// Differential rendering
+				data.out.refresh_interval = atoi(optarg);
+				if(data.out.refresh_interval < 0) {
+					data.out.refresh_interval = 0;
+				}
+				break;
+			case 'r':
+				// Render rate limit
+				data.render_rate = atoi(optarg);
+				if(data.render_rate < 0) {
+					data.render_rate = 0;
+				}
+				break;
+			case 'a':
+				// Adaptive frame skipping
+				data.adaptive = 1;
+				break;
+			case 's':
+				// Latency statistics line
+				data.show_stats = 1;
+				break;
+			case 'o':
+				// Headless output
+				output_dest = optarg;
+				break;
+			case 'l':
+				// Grid pyramid level to output
+				data.level = atoi(optarg);
+				if(data.level < 0) {
+					data.level = 0;
+				} else if(data.level > MAX_LEVELS) {
+					data.level = MAX_LEVELS;
+				}
+				break;
+			case 'p':
+				// Capture pipeline
+				data.pipeline = 1;
+				break;
+			case 'j':
+				// Binning threads
+				data.nworkers = atoi(optarg);
+				if(data.nworkers < 1) {
+					data.nworkers = 1;
+				} else if(data.nworkers > MAX_WORKERS) {
+					data.nworkers = MAX_WORKERS;
+				}
+				break;
+			case OPT_RECORD:
+				// Raw depth recording
+				record_path = optarg;
+				break;
+			case OPT_REPLAY:
+				// Raw depth replay
+				replay_path = optarg;
+				break;
+			case OPT_FAST:
+				// Replay as fast as possible
+				replay_fast = 1;
+				break;
+			case OPT_BENCH:
+				// Benchmark binning and rendering
+				run_bench = 1;
+				break;
+			case 'n':
+				// Number of Kinects
+				ndevices = atoi(optarg);
+				if(ndevices < 1) {
+					ndevices = 1;
+				} else if(ndevices > MAX_KINECTS) {
+					ndevices = MAX_KINECTS;
+				}
+				break;
+			case OPT_POSE:
+				// Kinect placement for fusion
+				if(sscanf(optarg, "%d:%f,%f,%f", &i, &pose.x, &pose.z, &pose.yaw) != 4 ||
+						i < 0 || i >= MAX_KINECTS) {
+					ERROR_OUT("Invalid pose %s, expected INDEX:X,Z,YAW.\n", optarg);
+					return -1;
+				}
+				pose.yaw *= M_PI / 180.0f;
+				poses[i] = pose;
+				break;
+			case OPT_FUSE:
+				// Merge all Kinects into one overhead grid
+				fuse = 1;
+				break;
+			case OPT_SERVE:
+				// Publish grids to network subscribers
+				if(nserve == MAX_SERVE) {
+					ERROR_OUT("At most %d --serve addresses are supported.\n", MAX_SERVE);
+					return -1;
+				}
+				serve_addrs[nserve++] = optarg;
+				break;
+			case OPT_BAND:
+				// Extra row band with its own overhead grid
+				if(data.nbands == MAX_BANDS) {
+					ERROR_OUT("At most %d --band and --slice options are supported.\n", MAX_BANDS);
+					return -1;
+				}
+				if(sscanf(optarg, "%d:%d", &data.band_top[data.nbands],
+							&data.band_bot[data.nbands]) != 2 ||
+						data.band_top[data.nbands] < 0 ||
+						data.band_bot[data.nbands] > FREENECT_FRAME_H ||
+						data.band_top[data.nbands] >= data.band_bot[data.nbands]) {
+					ERROR_OUT("Invalid band %s, expected TOP:BOTTOM rows within 0-%d.\n",
+							optarg, FREENECT_FRAME_H);
+					return -1;
+				}
+				data.nbands++;
+				break;
+			case OPT_SLICE:
+				// Height slice of the voxels with its own overhead grid
+				if(data.nbands == MAX_BANDS) {
+					ERROR_OUT("At most %d --band and --slice options are supported.\n", MAX_BANDS);
+					return -1;
+				}
+				if(sscanf(optarg, "%f:%f", &lo, &hi) != 2 || lo >= hi) {
+					ERROR_OUT("Invalid slice %s, expected LOW:HIGH heights in meters.\n", optarg);
+					return -1;
+				}
+				data.band_top[data.nbands] = lroundf(lo * 1000.0f);
+				data.band_bot[data.nbands] = lroundf(hi * 1000.0f);
+				data.band_slice[data.nbands] = 1;
+				data.nbands++;
+				data.nslices++;
+				break;
+			case OPT_MASK:
+				// Pixel mask
+				mask_path = optarg;
+				break;
+			case OPT_LEARN_MASK:
+				// Learn the pixel mask from the first frames
+				learn_frames = atoi(optarg);
+				if(learn_frames < 1) {
+					learn_frames = 1;
+				}
+				break;
+			case OPT_SAVE_MASK:
+				// Write the learned mask
+				data.mask_save = optarg;
+				break;
+			case OPT_BACKGROUND:
+				// Subtract a background learned from the first frames
+				bg_frames = atoi(optarg);
+				if(bg_frames < 1) {
+					bg_frames = 1;
+				}
+				break;
+			case OPT_BG_THRESHOLD:
+				// Foreground depth change
+				bg_threshold = atoi(optarg);
+				if(bg_threshold < 1) {
+					bg_threshold = 1;
+				} else if(bg_threshold > 2046) {
+					bg_threshold = 2046;
+				}
+				break;
+			case OPT_STRIDE:
+				// Decimation
+				data.stride = atoi(optarg);
+				if(data.stride < 1) {
+					data.stride = 1;
+				} else if(data.stride > MAX_STRIDE) {
+					data.stride = MAX_STRIDE;
+				}
+				break;
+			case OPT_INTERLEAVE:
+				// Sample different pixels each frame
+				data.interleave = 1;
+				break;
+			case OPT_CONTROL:
+				// Accept reconfiguration commands while running
+				control_addr = optarg;
+				break;
+			case OPT_CALIBRATION:
+				// Calibrated depth camera model
+				calib_path = optarg;
+				break;
+			case OPT_TRACK:
+				// Object tracking
+				data.track_min = atoi(optarg);
+				if(data.track_min < 1) {
+					data.track_min = 1;
+				}
+				break;
+			case OPT_RECORD_GRIDS:
+				// Compressed grid recording
+				grids_record_path = optarg;
+				break;
+			case OPT_REPLAY_GRIDS:
+				// Show a grid recording instead of binning
+				grids_replay_path = optarg;
+				break;
+			case OPT_SEEK:
+				// Grid replay start, in seconds
+				seek = atof(optarg);
+				if(seek < 0.0) {
+					seek = 0.0;
+				}
+				break;
 			default:
-				fprintf(stderr, "Usage: %s [-gG divisions] [-yY pixels] [-zZ distance] [-hv]\n",
+				fprintf(stderr, "Usage: %s [-gG divisions] [-yY pixels] [-zZ distance] [-e decay] [-hvpas] [-k kernel] [-j threads] [-d frames] [-r rate] [-o output] [-l level]\n"
+						"\t[-n kinects [--pose index:x,z,yaw]... [--fuse]] [--record file] [--replay file [--fast]] [--bench]\n"
+						"\t[--serve address]... [--band top:bottom]... [--slice low:high]... [--mask file.pgm]\n"
+						"\t[--learn-mask frames [--save-mask file.pgm]] [--background frames [--bg-threshold depth]]\n"
+						"\t[--stride pixels [--interleave]] [--control address] [--calibration file]\n"
+						"\t[--track count] [--record-grids file] [--replay-grids file [--seek seconds] [--fast]]\n",
 						argv[0]);
 				fprintf(stderr, "Use any of:\n");
 				fprintf(stderr, "\tg - Set horizontal grid divisions\n");
@@ -499,79 +8050,211 @@ int main(int argc, char *argv[])
 						FREENECT_FRAME_H);
 				fprintf(stderr, "\tz - Set near clipping plane in meters (default 0.0)\n");
 				fprintf(stderr, "\tZ - Set far clipping plane in meters (default 6.0)\n");
+				fprintf(stderr, "\te - Keep this fraction (0-1) of each cell's history every frame\n");
 				fprintf(stderr, "\th - Show horizontal (overhead) view only\n");
 				fprintf(stderr, "\tv - Show vertical (side) view only\n");
+				fprintf(stderr, "\tk - Set fill kernel (auto, %s)\n", fill_kernel_names());
+				fprintf(stderr, "\tj - Set number of binning threads (default 1)\n");
+				fprintf(stderr, "\tp - Bin and display frames on separate threads from capture\n");
+				fprintf(stderr, "\td - Only redraw changed cells, with a full redraw every N frames\n");
+				fprintf(stderr, "\tr - Render at most N frames per second (binning continues)\n");
+				fprintf(stderr, "\ta - Skip rendering frames while the terminal is behind\n");
+				fprintf(stderr, "\ts - Show per-stage latency and lost frames (SIGUSR1 prints them)\n");
+				fprintf(stderr, "\to - Write binary grid records instead of drawing (-, FILE,\n");
+				fprintf(stderr, "\t    unix:PATH, or tcp:HOST:PORT)\n");
+				fprintf(stderr, "\tl - Show or write the grids summed over 2^N by 2^N cell blocks (max %d)\n",
+						MAX_LEVELS);
+				fprintf(stderr, "\tn - Use this many Kinects, each shown below the last and always\n");
+				fprintf(stderr, "\t    binned as with -p (max %d)\n", MAX_KINECTS);
+				fprintf(stderr, "\t--pose - Place a Kinect in the fused grid (meters, degrees)\n");
+				fprintf(stderr, "\t--fuse - Merge all Kinects into one overhead grid\n");
+				fprintf(stderr, "\t--record - Append raw depth frames to a file\n");
+				fprintf(stderr, "\t--replay - Read depth frames from a recording instead of a Kinect\n");
+				fprintf(stderr, "\t--fast - Replay as fast as possible instead of at the recorded pace\n");
+				fprintf(stderr, "\t--bench - Time binning and rendering of synthetic frames, and of\n");
+				fprintf(stderr, "\t    the --replay recording if given, then exit\n");
+				fprintf(stderr, "\t--serve - Publish delta-encoded grids (tcp:[HOST]:PORT, unix:PATH,\n");
+				fprintf(stderr, "\t    or udp:HOST:PORT), with @LEVEL for a coarser -l level\n");
+				fprintf(stderr, "\t--band - Also bin image rows TOP to BOTTOM - 1 into their own\n");
+				fprintf(stderr, "\t    overhead grid (max %d)\n", MAX_BANDS);
+				fprintf(stderr, "\t--slice - Also show what is between two heights in meters\n");
+				fprintf(stderr, "\t    relative to the Kinect, from a 3D voxel grid (max %d with --band)\n",
+						MAX_BANDS);
+				fprintf(stderr, "\t--mask - Only bin pixels that are nonzero in a 640x480 PGM\n");
+				fprintf(stderr, "\t--learn-mask - Mask out pixels that stay still for the first N frames\n");
+				fprintf(stderr, "\t--save-mask - Write the learned mask to a PGM\n");
+				fprintf(stderr, "\t--background - Only bin pixels that differ from a background\n");
+				fprintf(stderr, "\t    learned from the first N frames\n");
+				fprintf(stderr, "\t--bg-threshold - Raw depth change from the background that\n");
+				fprintf(stderr, "\t    counts as foreground (default %d)\n", BG_THRESHOLD);
+				fprintf(stderr, "\t--stride - Only bin every Nth row and column (max %d)\n", MAX_STRIDE);
+				fprintf(stderr, "\t--interleave - Bin a different pixel of each block every frame\n");
+				fprintf(stderr, "\t--control - Take -gGyYzZlhv commands, one line at a time, from\n");
+				fprintf(stderr, "\t    unix:PATH or - for stdin\n");
+				fprintf(stderr, "\t--calibration - Project pixels with the intrinsics, lens distortion,\n");
+				fprintf(stderr, "\t    and depth model in a file\n");
+				fprintf(stderr, "\t--track - Follow objects made of overhead cells with at least N\n");
+				fprintf(stderr, "\t    samples, written after each -o record\n");
+				fprintf(stderr, "\t--record-grids - Write delta-encoded grids to a file, for long recordings\n");
+				fprintf(stderr, "\t--replay-grids - Show a --record-grids file instead of binning\n");
+				fprintf(stderr, "\t--seek - Start --replay-grids this many seconds in\n");
 				fprintf(stderr, "Press Ctrl-C (or send SIGINT) to quit.\n");
 				return -1;
 		}
 	}
 
-	data.xgrid.wmax = xworld(0, data.xgrid.zmax);
-	data.ygrid.wmax = yworld(FREENECT_FRAME_H - 1, data.ygrid.zmax);
-
-	init_grids(&data);
+	if(calib_path != NULL && load_calibration(&data, calib_path)) {
+		return -1;
+	}
+	xgrid_extent(&data, &data.xgrid, data.xgrid.zmax);
+	ygrid_extent(&data, &data.ygrid, data.ygrid.zmax);
 
-	INFO_OUT("zmax: %f xworldmax: %f zgridmax: %d xgridmin: %d xgridmax: %d\n",
-			data.xgrid.zmax, data.xgrid.wmax, zworld_to_grid(&data.xgrid, data.xgrid.zmax),
-			xyworld_to_grid(&data.xgrid, xworld(0, data.xgrid.zmax)),
-			xyworld_to_grid(&data.xgrid, xworld(639, data.xgrid.zmax)));
+	if(output_dest != NULL && open_output(&data, output_dest)) {
+		return -1;
+	}
+	if(record_path != NULL && open_record(&data, record_path)) {
+		return -1;
+	}
+	init_backlog(&data.out);
 
-	INFO_OUT("yworldmax: %f ygridmin: %d ygridmax: %d\n", data.ygrid.wmax,
-			xyworld_to_grid(&data.ygrid, yworld(479, data.ygrid.zmax)),
-			xyworld_to_grid(&data.ygrid, yworld(0, data.ygrid.zmax)));
+	// Calibrated rays need their own kernel, which needs the rays
+	if(calib_path != NULL && kernel_name != NULL && strcmp(kernel_name, "auto") &&
+			strcmp(kernel_name, KERNEL_RAYS)) {
+		ERROR_OUT("--calibration only works with the %s fill kernel.\n", KERNEL_RAYS);
+		return -1;
+	}
+	data.kernel = find_kernel(calib_path != NULL ? KERNEL_RAYS : kernel_name);
+	if(data.kernel == NULL) {
+		return -1;
+	}
+	if(calib_path == NULL && !strcmp(data.kernel->name, KERNEL_RAYS)) {
+		ERROR_OUT("The %s fill kernel needs --calibration.\n", KERNEL_RAYS);
+		return -1;
+	}
+	INFO_OUT("Using %s fill kernel on %d thread(s).\n", data.kernel->name, data.nworkers);
 
 	if(signal(SIGINT, intr) == SIG_ERR ||
-			signal(SIGTERM, intr) == SIG_ERR) {
+			signal(SIGTERM, intr) == SIG_ERR ||
+			signal(SIGUSR1, stats_signal) == SIG_ERR) {
 		ERROR_OUT("Error setting signal handlers\n");
 		return -1;
 	}
 
-	if(freenect_init(&kn, NULL) < 0) {
-		ERROR_OUT("libfreenect init failed.\n");
+	if(ndevices > 1 || fuse) {
+		if(run_bench || replay_path != NULL || record_path != NULL || nserve || data.nbands ||
+				mask_path != NULL || learn_frames || bg_frames || control_addr != NULL ||
+				calib_path != NULL || data.track_min || grids_record_path != NULL ||
+				grids_replay_path != NULL || data.level) {
+			ERROR_OUT("--bench, --record, --replay, --serve, --band, --slice, masks, --background,\n"
+					"--control, --calibration, --track, grid recordings, and -l only support one Kinect.\n");
+			return -1;
+		}
+
+		return run_kinects(&data, ndevices, poses, fuse);
+	}
+	if(run_bench && (nserve || control_addr != NULL || grids_record_path != NULL)) {
+		ERROR_OUT("--serve, --control, and --record-grids can't be used with --bench.\n");
 		return -1;
 	}
+	if(seek >= 0.0 && grids_replay_path == NULL) {
+		ERROR_OUT("--seek needs --replay-grids.\n");
+		return -1;
+	}
+	if(grids_replay_path != NULL) {
+		if(run_bench || replay_path != NULL || record_path != NULL || grids_record_path != NULL ||
+				nserve || control_addr != NULL) {
+			ERROR_OUT("--replay-grids can't be used with --bench, --replay, recording, --serve,\n"
+					"or --control.\n");
+			return -1;
+		}
+		if(!data.headless) {
+			printf("\e[H\e[2J");
+		}
 
-	INFO_OUT("Found %d Kinect devices.\n", freenect_num_devices(kn));
-
-	if(freenect_num_devices(kn) == 0) {
-		ERROR_OUT("No Kinect devices present.\n");
+		return replay_grids(&data, grids_replay_path, seek > 0.0 ? seek : 0.0, replay_fast);
+	}
+	if(data.mask_save != NULL && !learn_frames) {
+		ERROR_OUT("--save-mask needs --learn-mask.\n");
+		return -1;
+	}
+	if(mask_path != NULL && load_mask(&data, mask_path)) {
+		return -1;
+	}
+	if(learn_frames && start_learning(&data, learn_frames)) {
+		return -1;
+	}
+	if(data.interleave && data.stride == 1) {
+		ERROR_OUT("--interleave needs --stride.\n");
+		return -1;
+	}
+	if(bg_threshold && !bg_frames) {
+		ERROR_OUT("--bg-threshold needs --background.\n");
+		return -1;
+	}
+	if(bg_frames && start_background(&data, bg_frames, bg_threshold ? bg_threshold : BG_THRESHOLD)) {
 		return -1;
 	}
 
-	if(freenect_open_device(kn, &kn_dev, 0)) {
-		ERROR_OUT("Error opening Kinect #0.\n");
+	want_products(&data, output_products(&data));
+	if(data.track_min) {
+		want_products(&data, WANT_XGRID);
+	}
+	want_level(&data, data.level);
+	if(init_grids(&data)) {
+		ERROR_OUT("Error initializing grids.\n");
 		return -1;
 	}
 
-	freenect_set_user(kn_dev, &data);
-	freenect_set_tilt_degs(kn_dev, -5);
-	freenect_set_led(kn_dev, LED_GREEN);
-	freenect_set_depth_callback(kn_dev, depth);
-	freenect_set_depth_format(kn_dev, FREENECT_DEPTH_11BIT);
+	INFO_OUT("zmax: %f xworldmax: %f zgridmax: %d xgridmin: %d xgridmax: %d\n",
+			data.xgrid.zmax, data.xgrid.wmax, zworld_to_grid(&data.xgrid, data.xgrid.zmax),
+			xyworld_to_grid(&data.xgrid, xworld(0, data.xgrid.zmax)),
+			xyworld_to_grid(&data.xgrid, xworld(639, data.xgrid.zmax)));
 
-	freenect_start_depth(kn_dev);
+	INFO_OUT("yworldmax: %f ygridmin: %d ygridmax: %d\n", data.ygrid.wmax,
+			xyworld_to_grid(&data.ygrid, yworld(479, data.ygrid.zmax)),
+			xyworld_to_grid(&data.ygrid, yworld(0, data.ygrid.zmax)));
 
-	printf("\e[H\e[2J");
+	if(start_workers(&data)) {
+		return -1;
+	}
+	if(nserve && start_server(&data, serve_addrs, nserve)) {
+		return -1;
+	}
+	if(grids_record_path != NULL && start_history(&data, grids_record_path)) {
+		return -1;
+	}
+	if(data.history != NULL && replay_path != NULL) {
+		// Replays don't drop frames, so the recording doesn't either
+		data.history->wait = 1;
+	}
+	if(control_addr != NULL && start_control(&data, control_addr)) {
+		return -1;
+	}
 
-	int last_oor = data.out_of_range;
-	while(!data.done) {
-		ret = freenect_process_events(kn);
-		if(ret && ret != LIBUSB_ERROR_INTERRUPTED) {
-			// EINTR may occur when profiling
-			break;
+	if(run_bench) {
+		ret = bench(&data, replay_path);
+	} else if(replay_path != NULL) {
+		if(!data.headless) {
+			printf("\e[H\e[2J");
 		}
-
-		if(last_oor != data.out_of_range) {
-			freenect_set_led(kn_dev, data.out_of_range ? LED_BLINK_RED_YELLOW : LED_GREEN);
-			last_oor = data.out_of_range;
+		if(start_pipeline(&data)) {
+			return -1;
 		}
+
+		ret = replay(&data, replay_path, replay_fast);
+	} else {
+		ret = run_kinect(&data, 1);
 	}
 
-	freenect_stop_depth(kn_dev);
-	freenect_set_led(kn_dev, LED_OFF);
-	freenect_close_device(kn_dev);
-	freenect_shutdown(kn);
+	stop_control(&data);
+	stop_pipeline(&data);
+	stop_workers(&data);
+	stop_server(&data);
+	stop_history(&data);
 
-	return 0;
-}
+	if(data.record_fd >= 0) {
+		close(data.record_fd);
+	}
 
+	return ret;
+}